@@ -0,0 +1,426 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Camera.h"
+#include "CpuDispatch.h"
+#include "GeometryUtils.h"
+#include "Integrator.h"
+#include "ParallelFor.h"
+#include "PhotonMap.h"
+#include "RadianceCache.h"
+#include "Rasterizer.h"
+#include "Scenes.h"
+#include "ThreadPool.h"
+
+namespace bv {
+    struct BenchScene {
+        const char* name;
+        std::function<std::unique_ptr<Scene>()> create;
+    };
+
+    const std::vector<BenchScene>& benchScenes() {
+        static const std::vector<BenchScene> scenes{
+            {"cornell", createCornellBox},
+            {"caustics", createCausticRoom},
+        };
+        return scenes;
+    }
+
+    struct Settings {
+        std::string scene = "cornell";
+        int width = 160;
+        int height = 120;
+        int maxBounces = 16;
+        int threads = 4;
+        uint64_t seed = 1;
+        int samples = 256;
+        int tileSize = 16;
+        // Positions per pixel of the visibility buffer primary hits are taken from, 0 traces camera rays.
+        int visibilitySamples = 0;
+        // Cell size of a radiance cache shared by every pass, 0 for none. Cells fill in whatever order the workers
+        // reach them, so runs with a cache are only reproducible on a single thread.
+        double radianceCacheCell = 0.0;
+        // Caustic photons emitted before the first pass, whose time counts towards it, 0 for none. Biased, so leave
+        // them out of references.
+        size_t photons = 0;
+        double photonRadius = 0.02;
+    };
+
+    struct Checkpoint {
+        int samples;
+        double seconds;
+        double rmse;
+        double relMSE;
+    };
+
+    //
+    // Progressive renderer whose output depends only on the seed: every tile of every pass reseeds the generator of
+    // whichever worker picks it up. With visibility samples, a visibility buffer is rasterized every that many
+    // passes and each pass takes its first hits from the next of its positions.
+    //
+    class Accumulator {
+    public:
+        Accumulator(Scene& scene, const Settings& settings, ThreadPool& threadPool, const uint64_t seed)
+            : scene(scene), threadPool(threadPool), seed(seed), maxBounces(settings.maxBounces),
+              visibilitySamples(settings.visibilitySamples), photons(settings.photons),
+              photonRadius(settings.photonRadius),
+              cache(settings.radianceCacheCell > 0.0
+                        ? std::make_unique<RadianceCache>(RadianceCacheSettings{settings.radianceCacheCell})
+                        : nullptr),
+              camera({0.0, 0.0, -3.0}, 0.0, 0.0, 0.0, settings.height, 1.0, settings.width, settings.height,
+                     settings.width / 2.0, settings.height / 2.0),
+              tiles(makeTiles(settings.width, settings.height, settings.tileSize)),
+              sum(size_t(settings.width) * settings.height, vec3f(0.0f)),
+              count(size_t(settings.width) * settings.height, 0.0f) {}
+
+        void pass() {
+            if (passes == 0 && photons > 0) {
+                PhotonMapSettings causticSettings;
+                causticSettings.photons = photons;
+                causticSettings.radius = photonRadius;
+                causticSettings.seed = mix(seed);
+                caustics = std::make_unique<PhotonMap>(scene, causticSettings, &threadPool);
+            }
+
+            const int sample = visibilitySamples > 0 ? passes % visibilitySamples : 0;
+            if (visibilitySamples > 0 && sample == 0) {
+                seedRandom(mix(~seed ^ uint64_t(passes)));
+                rasterize(scene, camera, visibilitySamples, visibility, &threadPool);
+            }
+
+            const PathCaches caches{cache.get(), caustics.get()};
+
+            parallelFor(&threadPool, tiles.size(), 1, [this, sample, &caches](const size_t t) {
+                seedRandom(mix(seed ^ mix((uint64_t(passes) << 32) | t)));
+                accumulateTile(scene, camera, tiles[t], maxBounces, sum.data(), count.data(), nullptr,
+                               visibilitySamples > 0 ? &visibility : nullptr, sample, caches);
+            });
+            ++passes;
+        }
+
+        std::vector<vec3f> mean() const {
+            std::vector<vec3f> result(sum.size());
+            for (size_t i = 0; i < sum.size(); ++i) {
+                result[i] = sum[i] / count[i];
+            }
+            return result;
+        }
+
+        int samples() const {
+            return passes;
+        }
+
+    private:
+        Scene& scene;
+        ThreadPool& threadPool;
+        const uint64_t seed;
+        const int maxBounces;
+        const int visibilitySamples;
+        const size_t photons;
+        const double photonRadius;
+        const std::unique_ptr<RadianceCache> cache;
+        std::unique_ptr<PhotonMap> caustics;
+        const Camerad camera;
+        const std::vector<Tile> tiles;
+        std::vector<vec3f> sum;
+        std::vector<float> count;
+        VisibilityBuffer visibility;
+        int passes = 0;
+    };
+
+    //
+    // Reference file: "BREF", width, height and samples as int32, then width * height linear RGB float triples.
+    //
+    void writeReference(const std::string& filename, const std::vector<vec3f>& image, const int width,
+                        const int height, const int samples) {
+        std::ofstream file(filename, std::ios::binary);
+        const int32_t header[3] = {width, height, samples};
+        file.write("BREF", 4);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(image.data()), std::streamsize(image.size() * sizeof(vec3f)));
+
+        if (!file)
+            throw std::runtime_error("Could not write reference " + filename);
+    }
+
+    std::vector<vec3f> readReference(const std::string& filename, const int width, const int height) {
+        std::ifstream file(filename, std::ios::binary);
+        char magic[4];
+        int32_t header[3];
+        file.read(magic, 4);
+        file.read(reinterpret_cast<char*>(header), sizeof(header));
+
+        if (!file || std::memcmp(magic, "BREF", 4) != 0)
+            throw std::runtime_error("Could not read reference " + filename);
+
+        if (header[0] != width || header[1] != height)
+            throw std::runtime_error("Reference " + filename + " is " + std::to_string(header[0]) + "x" +
+                                     std::to_string(header[1]));
+
+        std::vector<vec3f> image(size_t(width) * height);
+        file.read(reinterpret_cast<char*>(image.data()), std::streamsize(image.size() * sizeof(vec3f)));
+
+        if (!file)
+            throw std::runtime_error("Reference " + filename + " is truncated");
+
+        return image;
+    }
+
+    // Root mean squared error and relative MSE over every channel. relMSE divides each squared error by the squared
+    // reference value, offset so that black pixels do not dominate.
+    void measure(const std::vector<vec3f>& image, const std::vector<vec3f>& reference, double& rmse,
+                 double& relMSE) {
+        double squared = 0.0;
+        double relative = 0.0;
+
+        for (size_t i = 0; i < image.size(); ++i) {
+            for (int c = 0; c < 3; ++c) {
+                const double error = double(image[i][c]) - double(reference[i][c]);
+                squared += error * error;
+                relative += error * error / (double(reference[i][c]) * reference[i][c] + 1e-2);
+            }
+        }
+
+        const double n = 3.0 * double(image.size());
+        rmse = std::sqrt(squared / n);
+        relMSE = relative / n;
+    }
+
+    // Time at which relMSE first falls to target, interpolated log-log between the checkpoints either side of it.
+    // Negative if it never does.
+    double timeToTarget(const std::vector<Checkpoint>& checkpoints, const double target) {
+        for (size_t i = 0; i < checkpoints.size(); ++i) {
+            if (checkpoints[i].relMSE > target)
+                continue;
+
+            if (i == 0 || checkpoints[i - 1].relMSE <= checkpoints[i].relMSE)
+                return checkpoints[i].seconds;
+
+            const auto& a = checkpoints[i - 1];
+            const auto& b = checkpoints[i];
+            const double f = std::log(a.relMSE / target) / std::log(a.relMSE / b.relMSE);
+            return std::exp(std::log(a.seconds) + f * (std::log(b.seconds) - std::log(a.seconds)));
+        }
+
+        return -1.0;
+    }
+
+    // Checkpoints fall at 1, 2, 3, 4, 6, 8, 12, 16, ... samples, evenly spread on the log scale the curves are read on.
+    bool isCheckpoint(const int samples) {
+        int power = 1;
+        while (power * 2 <= samples)
+            power *= 2;
+        return samples == power || samples == power + power / 2;
+    }
+
+    void usage() {
+        std::cout << "ConvergenceBench --make-reference <file> <samples> [options]\n"
+                     "ConvergenceBench --reference <file> [--csv <file>] [--target <relMSE>]\n"
+                     "                 [--baseline <file> [--tolerance <fraction>] | --write-baseline <file>] "
+                     "[options]\n"
+                     "options: --scene <name> --size <width> <height> --samples <n> --bounces <n> --seed <n> "
+                     "--threads <n>\n"
+                     "         --visibility <samples per pixel> --radiance-cache <cell size>\n"
+                     "         --photons <n> --photon-radius <radius> --cpu-path <generic|sse4.2|avx2|avx512>\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+    std::string referenceFile;
+    std::string csvFile;
+    std::string baselineFile;
+    std::string writeBaselineFile;
+    int referenceSamples = 0;
+    double target = 0.01;
+    double tolerance = 0.1;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--make-reference") {
+                referenceFile = next();
+                referenceSamples = std::stoi(next());
+            } else if (arg == "--reference") {
+                referenceFile = next();
+            } else if (arg == "--csv") {
+                csvFile = next();
+            } else if (arg == "--target") {
+                target = std::stod(next());
+            } else if (arg == "--baseline") {
+                baselineFile = next();
+            } else if (arg == "--write-baseline") {
+                writeBaselineFile = next();
+            } else if (arg == "--tolerance") {
+                tolerance = std::stod(next());
+            } else if (arg == "--scene") {
+                settings.scene = next();
+            } else if (arg == "--size") {
+                settings.width = std::stoi(next());
+                settings.height = std::stoi(next());
+            } else if (arg == "--samples") {
+                settings.samples = std::stoi(next());
+            } else if (arg == "--bounces") {
+                settings.maxBounces = std::stoi(next());
+            } else if (arg == "--seed") {
+                settings.seed = std::stoull(next());
+            } else if (arg == "--visibility") {
+                settings.visibilitySamples = std::stoi(next());
+            } else if (arg == "--radiance-cache") {
+                settings.radianceCacheCell = std::stod(next());
+            } else if (arg == "--photons") {
+                settings.photons = std::stoull(next());
+            } else if (arg == "--photon-radius") {
+                settings.photonRadius = std::stod(next());
+            } else if (arg == "--threads") {
+                settings.threads = std::stoi(next());
+            } else if (arg == "--cpu-path") {
+                setCpuPath(next());
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+
+        if (referenceFile.empty())
+            throw std::runtime_error("No reference given");
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        usage();
+        return 2;
+    }
+
+    std::unique_ptr<Scene> scene;
+    for (const auto& candidate : benchScenes()) {
+        if (settings.scene == candidate.name)
+            scene = candidate.create();
+    }
+
+    if (!scene) {
+        std::cout << "Unknown scene " << settings.scene << "\n";
+        return 2;
+    }
+
+    ThreadPool threadPool(settings.threads);
+    scene->build(&threadPool);
+
+    //
+    // Reference mode: a high sample count render from a seed stream disjoint from the measured runs, so its
+    // remaining noise is uncorrelated with theirs.
+    //
+    if (referenceSamples > 0) {
+        Accumulator reference(*scene, settings, threadPool, ~settings.seed);
+
+        while (reference.samples() < referenceSamples) {
+            reference.pass();
+        }
+
+        try {
+            writeReference(referenceFile, reference.mean(), settings.width, settings.height, referenceSamples);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << "\n";
+            return 2;
+        }
+
+        std::cout << "Wrote " << referenceSamples << " spp reference " << referenceFile << "\n";
+        return 0;
+    }
+
+    std::vector<vec3f> reference;
+    try {
+        reference = readReference(referenceFile, settings.width, settings.height);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        return 2;
+    }
+
+    //
+    // Only the passes are timed, measuring the error at a checkpoint is left out of the wall time.
+    //
+    Accumulator accumulator(*scene, settings, threadPool, settings.seed);
+    std::vector<Checkpoint> checkpoints;
+    double seconds = 0.0;
+
+    while (accumulator.samples() < settings.samples) {
+        const auto start = std::chrono::steady_clock::now();
+        accumulator.pass();
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (isCheckpoint(accumulator.samples()) || accumulator.samples() == settings.samples) {
+            Checkpoint checkpoint{accumulator.samples(), seconds, 0.0, 0.0};
+            measure(accumulator.mean(), reference, checkpoint.rmse, checkpoint.relMSE);
+            checkpoints.push_back(checkpoint);
+        }
+    }
+
+    std::ofstream csv;
+    if (!csvFile.empty())
+        csv.open(csvFile);
+    std::ostream& out = csvFile.empty() ? std::cout : csv;
+
+    out << "scene,spp,seconds,rmse,relmse\n";
+    for (const auto& checkpoint : checkpoints) {
+        out << settings.scene << "," << checkpoint.samples << "," << checkpoint.seconds << "," << checkpoint.rmse
+            << "," << checkpoint.relMSE << "\n";
+    }
+
+    const double reached = timeToTarget(checkpoints, target);
+
+    if (reached < 0.0) {
+        std::cout << "relMSE " << checkpoints.back().relMSE << " after " << settings.samples
+                  << " spp never reached the target " << target << "\n";
+        return 1;
+    }
+
+    std::cout << "Reached relMSE " << target << " in " << reached << " s\n";
+
+    //
+    // The baseline file holds the time to target of an accepted run. Runs slower than it by more than the
+    // tolerance fail.
+    //
+    if (!writeBaselineFile.empty()) {
+        std::ofstream baseline(writeBaselineFile);
+        baseline << settings.scene << " " << target << " " << reached << "\n";
+        std::cout << "Wrote baseline " << writeBaselineFile << "\n";
+    }
+
+    if (!baselineFile.empty()) {
+        std::ifstream baseline(baselineFile);
+        std::string scene;
+        double baselineTarget = 0.0;
+        double baselineSeconds = 0.0;
+
+        if (!(baseline >> scene >> baselineTarget >> baselineSeconds) || scene != settings.scene ||
+            std::abs(baselineTarget - target) > 1e-9 * target) {
+            std::cout << "Baseline " << baselineFile << " is not for " << settings.scene << " at relMSE " << target
+                      << "\n";
+            return 2;
+        }
+
+        const double limit = baselineSeconds * (1.0 + tolerance);
+        std::cout << "Baseline " << baselineSeconds << " s, limit " << limit << " s\n";
+
+        if (reached > limit) {
+            std::cout << "Time to target regressed by " << 100.0 * (reached / baselineSeconds - 1.0) << "%\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameRing.h"
+#include "ImageIO.h"
+
+namespace bv {
+    struct Settings {
+        std::string name;
+        // Writes every frame read to <savePrefix><NNNN>.qoi, numbered by the producer, when not empty.
+        std::string savePrefix;
+        // Stops after this many frames, 0 reads until the producer closes the ring.
+        uint64_t frames = 0;
+        // How long to wait for the ring to appear.
+        double timeoutSeconds = 10.0;
+    };
+
+    double millisecondsSince(const int64_t steadyNs) {
+        const auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - steadyNs) * 1e-6;
+    }
+
+    // FNV-1a of the pixels, printed so runs can be compared with the producer's files.
+    uint64_t checksum(const uint32_t* pixels, const size_t count) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < count; ++i) {
+            hash ^= pixels[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    std::unique_ptr<FrameSubscriber> attach(const Settings& settings) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(settings.timeoutSeconds);
+
+        for (;;) {
+            try {
+                return std::make_unique<FrameSubscriber>(settings.name);
+            } catch (const std::exception&) {
+                if (std::chrono::steady_clock::now() >= deadline)
+                    throw;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    void usage() {
+        std::cout << "FrameConsumer <shared memory name> [--save <prefix>] [--frames <n>] [--timeout <seconds>]\n"
+                     "Reads frames published by TestApp --shm <name> until the producer exits.\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--save") {
+                settings.savePrefix = next();
+            } else if (arg == "--frames") {
+                settings.frames = std::stoull(next());
+            } else if (arg == "--timeout") {
+                settings.timeoutSeconds = std::stod(next());
+            } else if (settings.name.empty() && arg.rfind("--", 0) != 0) {
+                settings.name = arg;
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+
+        if (settings.name.empty())
+            throw std::runtime_error("No shared memory name given");
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        usage();
+        return 2;
+    }
+
+    std::unique_ptr<FrameSubscriber> subscriber;
+    try {
+        subscriber = attach(settings);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        return 1;
+    }
+
+    uint64_t received = 0;
+    uint64_t torn = 0;
+    double totalLatency = 0.0;
+    std::vector<uint32_t> copy;
+
+    while (settings.frames == 0 || received < settings.frames) {
+        FrameView view;
+        if (!subscriber->acquire(view)) {
+            // Checked after acquire fails, so frames published just before closing are still read.
+            if (subscriber->closed())
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        const double latency = millisecondsSince(view.info.publishedNs);
+        const size_t count = size_t(view.info.width) * size_t(view.info.height);
+
+        //
+        // Read in place. Saving needs a copy, the encoder is too slow to run on memory the producer may come back
+        // around to.
+        //
+        const uint64_t hash = checksum(view.pixels, count);
+        if (!settings.savePrefix.empty())
+            copy.assign(view.pixels, view.pixels + count);
+
+        if (!subscriber->unchanged(view)) {
+            ++torn;
+            continue;
+        }
+
+        ++received;
+        totalLatency += latency;
+
+        std::printf("frame %llu: %dx%d, %d spp, %.2f ms after publishing, checksum %016llx\n",
+                    static_cast<unsigned long long>(view.info.frame), view.info.width, view.info.height,
+                    view.info.samples, latency, static_cast<unsigned long long>(hash));
+        std::fflush(stdout);
+
+        if (!settings.savePrefix.empty()) {
+            char number[24];
+            std::snprintf(number, sizeof(number), "%04llu", static_cast<unsigned long long>(view.info.frame));
+            if (!writeQOI(settings.savePrefix + number + ".qoi", copy.data(), view.info.width, view.info.height))
+                std::cout << "Could not write frame " << view.info.frame << "\n";
+        }
+    }
+
+    std::cout << received << " frames read, " << subscriber->skipped() << " skipped, " << torn
+              << " overwritten while reading";
+    if (received > 0)
+        std::cout << ", " << totalLatency / double(received) << " ms mean latency";
+    std::cout << "\n";
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CpuDispatch.h"
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Scenes.h"
+#include "ThreadPool.h"
+
+namespace bv {
+    struct Settings {
+        size_t spheres = 200000;
+        // Mean radius, each sphere is within a quarter of it. The spheres fill the cube [-1, 1]^3.
+        double radius = 0.01;
+        size_t rays = 1 << 20;
+        int threads = 4;
+        uint64_t seed = 1;
+    };
+
+    // Rays of a batched query, one array per component, see RayBatch.
+    struct Rays {
+        std::vector<double> originX, originY, originZ, dirX, dirY, dirZ, tMin, tMax;
+
+        explicit Rays(const size_t count)
+            : originX(count), originY(count), originZ(count), dirX(count), dirY(count), dirZ(count), tMin(count),
+              tMax(count) {}
+
+        void set(const size_t i, const vec3d& origin, const vec3d& dir, const double far) {
+            originX[i] = origin.x;
+            originY[i] = origin.y;
+            originZ[i] = origin.z;
+            dirX[i] = dir.x;
+            dirY[i] = dir.y;
+            dirZ[i] = dir.z;
+            tMin[i] = 1e-9;
+            tMax[i] = far;
+        }
+
+        RayBatch batch() const {
+            return {originX.size(), originX.data(), originY.data(), originZ.data(), dirX.data(), dirY.data(),
+                    dirZ.data(), tMin.data(), tMax.data()};
+        }
+    };
+
+    vec3d randomPoint(const double min, const double max) {
+        return {randomDouble(min, max), randomDouble(min, max), randomDouble(min, max)};
+    }
+
+    std::unique_ptr<Scene> makeParticles(const Settings& settings, const Accelerator accelerator) {
+        seedRandom(settings.seed);
+
+        auto scene = std::make_unique<Scene>(accelerator);
+        const auto material = scene->materials().intern(createLambertianMaterial({0.5f, 0.5f, 0.5f}));
+        for (size_t i = 0; i < settings.spheres; ++i)
+            scene->add(createSphere(randomPoint(-1.0, 1.0), settings.radius * randomDouble(0.75, 1.25), material));
+
+        return scene;
+    }
+
+    //
+    // camera: from a point outside the cube through a square in front of it, neighbours close together as primary
+    // rays are. random: from random points inside in random directions, as bounces are. shadow: any-hit between pairs
+    // of random points inside.
+    //
+    Rays cameraRays(const size_t count) {
+        Rays rays(count);
+        const auto side = size_t(std::ceil(std::sqrt(double(count))));
+        for (size_t i = 0; i < count; ++i) {
+            const vec3d target((double(i % side) + 0.5) / side * 2.0 - 1.0, (double(i / side) + 0.5) / side * 2.0 - 1.0,
+                               -1.0);
+            rays.set(i, {0.0, 0.0, -3.0}, target - vec3d(0.0, 0.0, -3.0), 1e12);
+        }
+        return rays;
+    }
+
+    Rays randomRays(const size_t count) {
+        Rays rays(count);
+        for (size_t i = 0; i < count; ++i)
+            rays.set(i, randomPoint(-1.0, 1.0), glm::normalize(randomPoint(-1.0, 1.0)), 1e12);
+        return rays;
+    }
+
+    Rays shadowRays(const size_t count) {
+        Rays rays(count);
+        for (size_t i = 0; i < count; ++i) {
+            const vec3d from = randomPoint(-1.0, 1.0);
+            rays.set(i, from, randomPoint(-1.0, 1.0) - from, 1.0 - 1e-9);
+        }
+        return rays;
+    }
+
+    struct Hits {
+        std::vector<uint32_t> primitive;
+        std::vector<double> t;
+        std::vector<uint8_t> occluded;
+    };
+
+    double secondsSince(const std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Millions of rays per second, the best of a few runs.
+    template <typename Query>
+    double timeQuery(const size_t rays, const Query& query) {
+        double best = 0.0;
+        for (int run = 0; run < 3; ++run) {
+            const auto start = std::chrono::steady_clock::now();
+            query();
+            best = std::max(best, double(rays) * 1e-6 / secondsSince(start));
+        }
+        return best;
+    }
+
+    void bench(const char* name, const Accelerator accelerator, const Settings& settings, ThreadPool& threadPool,
+               const Rays& camera, const Rays& random, const Rays& shadow, Hits& cameraHits, Hits& randomHits,
+               Hits& shadowHits) {
+        const auto scene = makeParticles(settings, accelerator);
+
+        const auto start = std::chrono::steady_clock::now();
+        scene->build(&threadPool);
+        const double buildMs = secondsSince(start) * 1000.0;
+        const auto stats = scene->stats();
+
+        const auto closest = [&](const Rays& rays, Hits& hits) {
+            hits.primitive.resize(rays.originX.size());
+            hits.t.resize(rays.originX.size());
+            HitBatch out;
+            out.primitive = hits.primitive.data();
+            out.t = hits.t.data();
+            return timeQuery(rays.originX.size(), [&]() {
+                scene->intersect(rays.batch(), out, &threadPool);
+            });
+        };
+
+        const double cameraRate = closest(camera, cameraHits);
+        const double randomRate = closest(random, randomHits);
+
+        shadowHits.occluded.resize(shadow.originX.size());
+        const double shadowRate = timeQuery(shadow.originX.size(), [&]() {
+            scene->occluded(shadow.batch(), shadowHits.occluded.data(), &threadPool);
+        });
+
+        std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << buildMs << std::setw(10) << double(stats.bytes) / (1 << 20) << std::setw(10)
+                  << stats.nodes << std::setw(10) << std::setprecision(2) << cameraRate << std::setw(10) << randomRate
+                  << std::setw(10) << shadowRate << "\n";
+    }
+
+    // Rays whose closest hit, or whether anything is hit at all, differs between the two accelerators.
+    size_t differences(const Hits& a, const Hits& b) {
+        size_t count = 0;
+        for (size_t i = 0; i < a.primitive.size(); ++i) {
+            if (a.primitive[i] != b.primitive[i] && (a.primitive[i] == noPrimitive || b.primitive[i] == noPrimitive ||
+                                                     a.t[i] != b.t[i]))
+                ++count;
+        }
+        for (size_t i = 0; i < a.occluded.size(); ++i)
+            count += a.occluded[i] != b.occluded[i];
+        return count;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--spheres") {
+                settings.spheres = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--radius") {
+                settings.radius = std::stod(next());
+            } else if (arg == "--rays") {
+                settings.rays = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--threads") {
+                settings.threads = std::stoi(next());
+            } else if (arg == "--seed") {
+                settings.seed = std::stoull(next());
+            } else if (arg == "--cpu-path") {
+                setCpuPath(next());
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n"
+                  << "GridBench [--spheres <n>] [--radius <r>] [--rays <n>] [--threads <n>] [--seed <n>]\n"
+                     "          [--cpu-path <generic|sse4.2|avx2|avx512>]\n";
+        return 2;
+    }
+
+    ThreadPool threadPool(settings.threads);
+
+    seedRandom(settings.seed + 1);
+    const auto camera = cameraRays(settings.rays);
+    const auto random = randomRays(settings.rays);
+    const auto shadow = shadowRays(settings.rays);
+
+    //
+    // build: ms to build on the pool. MiB: memory held by the accelerator. nodes: BVH nodes or grid cells.
+    // camera/random/shadow: millions of rays per second, see cameraRays.
+    //
+    std::cout << settings.spheres << " spheres of radius " << settings.radius << ", " << settings.rays
+              << " rays per test, " << settings.threads << " threads, " << cpuPathName(cpuPath()) << " kernels\n"
+              << std::left << std::setw(8) << "" << std::right << std::setw(10) << "build" << std::setw(10) << "MiB"
+              << std::setw(10) << "nodes" << std::setw(10) << "camera" << std::setw(10) << "random" << std::setw(10)
+              << "shadow" << "\n";
+
+    Hits bvh[3], grid[3];
+    bench("bvh", Accelerator::BVH, settings, threadPool, camera, random, shadow, bvh[0], bvh[1], bvh[2]);
+    bench("grid", Accelerator::Grid, settings, threadPool, camera, random, shadow, grid[0], grid[1], grid[2]);
+
+    size_t differing = 0;
+    for (int i = 0; i < 3; ++i)
+        differing += differences(bvh[i], grid[i]);
+    std::cout << differing << " rays answered differently\n";
+
+    return differing == 0 ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "BVH.h"
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "ParallelFor.h"
+#include "StreamedMesh.h"
+#include "ThreadPool.h"
+
+namespace bv {
+    struct Settings {
+        size_t triangles = 100000;
+        size_t trianglesPerChunk = 2048;
+        // Cache budget, a fraction of the mesh so that chunks are evicted and reloaded. Must hold a chunk or two.
+        double cacheMiB = 4.0;
+        size_t rays = 2000;
+        int threads = 4;
+        uint64_t seed = 1;
+        std::string file = "/tmp/bv-meshbench.bvmesh";
+    };
+
+    // Materials the soup's ids are drawn from, standing in for a scene's MaterialTable.
+    constexpr size_t numMaterials = 5;
+
+    vec3d randomPoint(const double min, const double max) {
+        return {randomDouble(min, max), randomDouble(min, max), randomDouble(min, max)};
+    }
+
+    // Triangles about a unit across scattered through the cube [-10, 10]^3, dense enough that most rays stop within a
+    // few chunks.
+    std::vector<MeshTriangle> makeSoup(const size_t count) {
+        std::vector<MeshTriangle> soup(count);
+        for (size_t i = 0; i < count; ++i) {
+            const vec3d c = randomPoint(-10.0, 10.0);
+            soup[i] = {c, c + randomPoint(-1.0, 1.0), c + randomPoint(-1.0, 1.0), MaterialId(i % numMaterials)};
+        }
+        return soup;
+    }
+
+    double secondsSince(const std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool sameHit(const bool hitA, const Hit& a, const bool hitB, const Hit& b) {
+        return hitA == hitB && (!hitA || (a.t == b.t && a.material == b.material));
+    }
+
+    // Byte positions in the file of the header's chunk count and of the first chunk's offset, which follows its
+    // bounds in the table after the header.
+    constexpr size_t chunkCountAt = 16;
+    constexpr size_t firstOffsetAt = 24 + 48;
+
+    // Writes the first bytes of source to target, optionally overwriting the 64 bit value at patchAt.
+    void writeDamaged(const std::string& source, const std::string& target, const size_t bytes,
+                      const size_t patchAt = 0, const uint64_t* patch = nullptr) {
+        std::ifstream in(source, std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        data.resize(std::min(bytes, data.size()));
+        if (patch && data.size() >= patchAt + sizeof(*patch))
+            std::copy_n(reinterpret_cast<const char*>(patch), sizeof(*patch), data.begin() + patchAt);
+
+        std::ofstream out(target, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), std::streamsize(data.size()));
+    }
+
+    bool rejected(const std::string& file, const size_t materials = numMaterials) {
+        try {
+            GeometryCache cache(1 << 20);
+            const auto mesh = cache.load(file, materials);
+            // Loaded anyway: every chunk must then at least be readable.
+            for (int i = 0; i < 64; ++i) {
+                Hit hit;
+                mesh->intersect(Ray{randomPoint(-10.0, 10.0), randomPoint(-1.0, 1.0)}, hit, 1e-6, 1e9);
+            }
+            return false;
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--triangles") {
+                settings.triangles = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--chunk") {
+                settings.trianglesPerChunk = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--cache") {
+                settings.cacheMiB = std::stod(next());
+            } else if (arg == "--rays") {
+                settings.rays = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--threads") {
+                settings.threads = std::stoi(next());
+            } else if (arg == "--seed") {
+                settings.seed = std::stoull(next());
+            } else if (arg == "--file") {
+                settings.file = next();
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n"
+                  << "MeshBench [--triangles <n>] [--chunk <triangles>] [--cache <MiB>] [--rays <n>] [--threads <n>]\n"
+                     "          [--seed <n>] [--file <path>]\n";
+        return 2;
+    }
+
+    seedRandom(settings.seed);
+    const auto soup = makeSoup(settings.triangles);
+    writeChunkedMesh(settings.file, soup, settings.trianglesPerChunk);
+
+    // Reference answers from the whole soup in memory.
+    std::vector<std::shared_ptr<Geometry>> triangles;
+    triangles.reserve(soup.size());
+    for (const auto& t : soup)
+        triangles.push_back(createTriangle(t.v1, t.v2, t.v3, t.material));
+    BVH reference;
+    reference.build(triangles);
+
+    std::vector<Ray> rays(settings.rays);
+    for (auto& ray : rays)
+        ray = Ray{randomPoint(-10.0, 10.0), glm::normalize(randomPoint(-1.0, 1.0))};
+
+    const auto cap = size_t(settings.cacheMiB * (1 << 20));
+    GeometryCache cache(cap);
+    const auto mesh = cache.load(settings.file, numMaterials);
+    ThreadPool threadPool(settings.threads);
+
+    //
+    // Single rays from every thread at once, so misses overlap and reservations are what holds the cache to its
+    // budget. Then the same rays as one batch, which pages each chunk in once for all of them.
+    //
+    std::atomic<size_t> differing{0};
+    std::atomic<size_t> maxResident{0};
+    auto start = std::chrono::steady_clock::now();
+    parallelFor(&threadPool, rays.size(), 64, [&](const size_t i) {
+        Hit a{}, b{};
+        const bool hitA = reference.intersect(rays[i], a, 1e-6, 1e9);
+        const bool hitB = mesh->intersect(rays[i], b, 1e-6, 1e9);
+        if (!sameHit(hitA, a, hitB, b) || reference.occluded(rays[i], 1e-6, 2.0) != mesh->occluded(rays[i], 1e-6, 2.0))
+            differing++;
+
+        const size_t resident = cache.residentBytes();
+        for (size_t seen = maxResident; resident > seen && !maxResident.compare_exchange_weak(seen, resident);) {}
+    });
+    const double singleSeconds = secondsSince(start);
+    const size_t singleLoads = cache.chunkLoads();
+
+    start = std::chrono::steady_clock::now();
+    std::vector<Hit> hits;
+    std::vector<uint8_t> found;
+    mesh->intersect(rays, 1e-6, 1e9, hits, found);
+    const double batchSeconds = secondsSince(start);
+    for (size_t i = 0; i < rays.size(); ++i) {
+        Hit a{};
+        const bool hitA = reference.intersect(rays[i], a, 1e-6, 1e9);
+        if (!sameHit(hitA, a, found[i], hits[i]))
+            differing++;
+    }
+
+    //
+    // A file cut short inside its chunk data, one cut inside its chunk table, one claiming far more chunks, one whose
+    // first chunk is off its page boundary, and the intact file loaded for a scene with one material too few.
+    //
+    const std::string damaged = settings.file + ".damaged";
+    const uint64_t hugeCount = uint64_t(1) << 60;
+    uint64_t misaligned = 0;
+    std::ifstream(settings.file, std::ios::binary).seekg(firstOffsetAt).read(reinterpret_cast<char*>(&misaligned),
+                                                                             sizeof(misaligned));
+    misaligned += 8;
+    size_t accepted = 0;
+    const auto fileSize = std::streamoff(std::ifstream(settings.file, std::ios::binary | std::ios::ate).tellg());
+    writeDamaged(settings.file, damaged, size_t(std::max<std::streamoff>(fileSize - 4096, 0)));
+    accepted += !rejected(damaged);
+    writeDamaged(settings.file, damaged, 64);
+    accepted += !rejected(damaged);
+    writeDamaged(settings.file, damaged, size_t(-1), chunkCountAt, &hugeCount);
+    accepted += !rejected(damaged);
+    writeDamaged(settings.file, damaged, size_t(-1), firstOffsetAt, &misaligned);
+    accepted += !rejected(damaged);
+    accepted += !rejected(settings.file, numMaterials - 1);
+    std::remove(damaged.c_str());
+    std::remove(settings.file.c_str());
+
+    //
+    // loads: chunks read from the file, counting reloads after eviction. resident: most bytes the cache held at once
+    // against its budget.
+    //
+    std::cout << soup.size() << " triangles in " << mesh->chunkCount() << " chunks, " << rays.size() << " rays, "
+              << settings.threads << " threads\n"
+              << std::fixed << std::setprecision(0) << "single: " << singleLoads << " loads, "
+              << double(rays.size()) / singleSeconds << " rays/s\n"
+              << "batch: " << cache.chunkLoads() - singleLoads << " loads, " << double(rays.size()) / batchSeconds
+              << " rays/s\n"
+              << std::setprecision(2) << "resident: at most " << double(maxResident) / (1 << 20) << " of "
+              << settings.cacheMiB << " MiB\n"
+              << differing << " rays answered differently, " << accepted << " damaged files accepted\n";
+
+    return differing == 0 && accepted == 0 && maxResident <= cap ? 0 : 1;
+}
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "RenderService.h"
+#include "Scenes.h"
+#include "Semaphore.h"
+#include "ThreadPool.h"
+
+namespace bv {
+    struct ServedScene {
+        const char* id;
+        std::function<std::unique_ptr<Scene>()> create;
+    };
+
+    const std::vector<ServedScene>& servedScenes() {
+        static const std::vector<ServedScene> scenes{
+            {"cornell", createCornellBox},
+            {"caustics", createCausticRoom},
+        };
+        return scenes;
+    }
+
+    std::unique_ptr<Scene> loadScene(const std::string& id) {
+        for (const auto& scene : servedScenes()) {
+            if (id == scene.id)
+                return scene.create();
+        }
+        return nullptr;
+    }
+
+    struct Settings {
+        // Unix socket to listen on, empty to serve a single session over stdin and stdout.
+        std::string socketPath;
+        int threads = 4;
+        size_t cachedScenes = 4;
+        // Jobs rendering at once across all sessions. Further requests wait to be read.
+        int maxJobs = 8;
+    };
+
+    //
+    // Request, one per line: "<id> <scene> <tx> <ty> <tz> <roll> <pitch> <yaw> <width> <height> <spp> [bounces]
+    // [priority]". Blank lines and lines starting with '#' are skipped, "quit" ends the session.
+    //
+    // Response: "<id> ok <bytes> <milliseconds> <cached|loaded>" followed by a newline and that many bytes of QOI
+    // image, or "<id> error <message>". Jobs run concurrently, so responses arrive in the order they finish.
+    //
+    bool parseJob(const std::string& line, std::string& id, RenderJob& job) {
+        std::istringstream fields(line);
+        if (!(fields >> id >> job.scene >> job.pose.trans.x >> job.pose.trans.y >> job.pose.trans.z >>
+              job.pose.roll >> job.pose.pitch >> job.pose.yaw >> job.width >> job.height >> job.samples))
+            return false;
+
+        if (!(fields >> job.maxBounces))
+            return fields.eof();
+
+        if (!(fields >> job.priority))
+            return fields.eof();
+
+        std::string rest;
+        return !(fields >> rest);
+    }
+
+    class Session {
+    public:
+        Session(RenderService& service, Semaphore& jobSlots, const int in, const int out)
+            : service(service), jobSlots(jobSlots), in(in), out(out) {}
+
+        // Serves requests until the input ends or asks to quit, then waits for the jobs still running.
+        void serve() {
+            std::string line;
+            while (readLine(line)) {
+                if (line.empty() || line[0] == '#')
+                    continue;
+
+                if (line == "quit")
+                    break;
+
+                std::string id;
+                RenderJob job;
+                if (!parseJob(line, id, job)) {
+                    send((id.empty() ? "-" : id) + " error Malformed request\n", {});
+                    continue;
+                }
+
+                jobSlots.acquire();
+                {
+                    std::lock_guard lk(jobsMutex);
+                    ++runningJobs;
+                }
+
+                std::thread([this, id, job]() {
+                    const RenderResult result = service.render(job);
+
+                    if (result.ok) {
+                        std::cerr << id << ": " << job.scene << " " << job.width << "x" << job.height << " "
+                                  << job.samples << " spp in " << result.seconds * 1000.0 << " ms, scene "
+                                  << (result.sceneCached ? "cached" : "loaded") << "\n";
+                        send(id + " ok " + std::to_string(result.image.size()) + " " +
+                                 std::to_string(int(result.seconds * 1000.0)) + " " +
+                                 (result.sceneCached ? "cached" : "loaded") + "\n",
+                             result.image);
+                    } else {
+                        send(id + " error " + result.error + "\n", {});
+                    }
+
+                    jobSlots.release();
+
+                    // Notified under the lock, serve() cannot return and destroy the session before this is done.
+                    std::lock_guard lk(jobsMutex);
+                    --runningJobs;
+                    jobsDone.notify_all();
+                }).detach();
+            }
+
+            std::unique_lock lk(jobsMutex);
+            jobsDone.wait(lk, [this]() {
+                return runningJobs == 0;
+            });
+        }
+
+    private:
+        bool readLine(std::string& line) {
+            line.clear();
+
+            for (;;) {
+                const auto newline = pending.find('\n');
+                if (newline != std::string::npos) {
+                    line = pending.substr(0, newline);
+                    pending.erase(0, newline + 1);
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    return true;
+                }
+
+                char buffer[4096];
+                const ssize_t n = ::read(in, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    // A last request without a newline still counts.
+                    line.swap(pending);
+                    return !line.empty();
+                }
+                pending.append(buffer, size_t(n));
+            }
+        }
+
+        // Header and image go out together, so responses of concurrent jobs never interleave.
+        void send(const std::string& header, const std::vector<uint8_t>& body) {
+            std::lock_guard lk(outMutex);
+            if (writeAll(reinterpret_cast<const uint8_t*>(header.data()), header.size()))
+                writeAll(body.data(), body.size());
+        }
+
+        bool writeAll(const uint8_t* data, size_t size) {
+            while (size > 0) {
+                const ssize_t n = ::write(out, data, size);
+                if (n <= 0)
+                    return false;
+                data += n;
+                size -= size_t(n);
+            }
+            return true;
+        }
+
+        RenderService& service;
+        Semaphore& jobSlots;
+        const int in;
+        const int out;
+        std::string pending;
+        std::mutex outMutex;
+        std::mutex jobsMutex;
+        std::condition_variable jobsDone;
+        int runningJobs = 0;
+    };
+
+    int listenOn(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Socket path " + path + " is too long");
+
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw std::runtime_error("Could not create socket");
+
+        ::unlink(path.c_str());
+        if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 16) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not listen on " + path + ": " + std::strerror(errno));
+        }
+
+        return fd;
+    }
+
+    void usage() {
+        std::cout << "RenderDaemon [--socket <path>] [--threads <n>] [--cache <scenes>] [--max-jobs <n>]\n"
+                     "Without --socket, requests are read from stdin and responses written to stdout.\n"
+                     "request: <id> <scene> <tx> <ty> <tz> <roll> <pitch> <yaw> <width> <height> <spp> "
+                     "[bounces] [priority]\n"
+                     "scenes:";
+        for (const auto& scene : servedScenes())
+            std::cout << " " << scene.id;
+        std::cout << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--socket") {
+                settings.socketPath = next();
+            } else if (arg == "--threads") {
+                settings.threads = std::stoi(next());
+            } else if (arg == "--cache") {
+                settings.cachedScenes = std::stoull(next());
+            } else if (arg == "--max-jobs") {
+                settings.maxJobs = std::max(std::stoi(next()), 1);
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        usage();
+        return 2;
+    }
+
+    // A client hanging up mid response must not end the process.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    ThreadPool threadPool(settings.threads);
+    RenderService service(threadPool, loadScene, settings.cachedScenes);
+    Semaphore jobSlots(settings.maxJobs);
+
+    if (settings.socketPath.empty()) {
+        Session(service, jobSlots, STDIN_FILENO, STDOUT_FILENO).serve();
+        return 0;
+    }
+
+    int listener;
+    try {
+        listener = listenOn(settings.socketPath);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::cerr << "Listening on " << settings.socketPath << "\n";
+
+    //
+    // One thread per client. Sessions share the service, so its scene cache and the pool, for as long as the
+    // process runs.
+    //
+    for (;;) {
+        const int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+
+        std::thread([&service, &jobSlots, client]() {
+            Session(service, jobSlots, client, client).serve();
+            ::close(client);
+        }).detach();
+    }
+}
@@ -1,19 +1,29 @@
 //#pragma clang optimize off
 
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
 
 #include "glm/gtc/random.hpp"
 
 #include "SDL.h"
 
 #include "Camera.h"
+#include "FrameRing.h"
 #include "Geometry.h"
 #include "SDLWrapper.h"
 #include "Scenes.h"
 #include "ThreadPool.h"
-#include "Latch.h"
+#include "ParallelFor.h"
 #include "GeometryUtils.h"
-#include "Material.h"
+#include "ImageWriter.h"
+#include "Integrator.h"
+#include "Preview.h"
+#include "Rasterizer.h"
+#include "Sequence.h"
 
 namespace bv {
     bool processEvents(const std::vector<SDL_Event>& events, Camerad& camera) {
@@ -78,107 +88,183 @@ namespace bv {
         return true;
     }
 
-    double randomDouble() {
-        static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-        static std::mt19937 generator{0};
-        return distribution(generator);
-    }
-
-    double randomDouble(const double min, const double max) {
-        return min + (max - min) * randomDouble();
-    }
-
-    vec3f rayColour(const std::unique_ptr<Scene>& scene, const Ray& ray, const int depth) {
-        vec3f black(0.0f,0.0f,0.0f);
-
-        if (depth <= 0)
-            return black;
-
-        Hit hit{};
-
-        if (scene->intersect(ray, hit, 1e-3, 1e12)) {
-            Ray scattered{};
-            vec3f attenuation = black;
-
-            if (hit.material->scatter(ray, hit, attenuation, scattered)) {
-                return attenuation * rayColour(scene, scattered, depth - 1);
-            }
-
-            return black;
-        }
-
-        const auto unitRayDir = glm::normalize(ray.dir);
-        const float t = 0.5f * (unitRayDir.y + 1.0f);
-        return (1.0f - t) * vec3f(1.0f, 1.0f, 1.0f) + t * vec3f(0.5f, 0.7f, 1.0f);
+    bool samePose(const Camerad& a, const Camerad& b) {
+        return a.trans == b.trans && a.roll == b.roll && a.pitch == b.pitch && a.yaw == b.yaw;
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     using namespace bv;
     constexpr int screenWidth = 1200;
     constexpr int screenHeight = 800;
     constexpr int numSlices = 4;
     constexpr int numSamples = 512;
     constexpr int maxBounces = 512;
-    constexpr float scale = 1.0 / numSamples;
+    constexpr int numVisibilitySamples = 8;
+
+    //
+    // --shm <name>, anywhere on the command line, also publishes frames to a shared memory ring of that name for
+    // other processes to read, see FramePublisher and FrameConsumer.
+    //
+    std::string sharedMemoryName;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--shm") {
+            sharedMemoryName = argv[i + 1];
+            std::copy(argv + i + 2, argv + argc, argv + i);
+            argc -= 2;
+            break;
+        }
+    }
 
     Camerad camera({0.0, 0.0, -3.0}, 0.0, 0.0, 0.0, screenHeight, 1.0, screenWidth,
                      screenHeight, screenWidth / 2.0, screenHeight / 2.0);
 
     const auto scene = createCornellBox();
 
+    ThreadPool threadPool(4);
+
+    scene->build(&threadPool);
+    const auto stats = scene->stats();
+    std::cout << "BVH: " << stats.primitives << " primitives, " << stats.nodes << " nodes, " << stats.leaves
+              << " leaves, depth " << stats.maxDepth << ", SAH cost " << stats.sahCost << ", "
+              << stats.bytes / 1024 << " KiB, built in " << stats.buildMilliseconds << " ms\n";
+
+    //
+    // Sequence mode: TestApp --sequence <poses file> [output prefix]
+    // Renders every pose without opening a window, reusing the scene built above. A prefix of "-" writes no files,
+    // for use with --shm.
+    //
+    if (argc >= 3 && std::string(argv[1]) == "--sequence") {
+        SequenceSettings settings;
+        settings.numSamples = numSamples;
+        settings.maxBounces = maxBounces;
+        if (argc >= 4)
+            settings.outputPrefix = argv[3];
+        settings.writeImages = settings.outputPrefix != "-";
+        settings.sharedMemoryName = sharedMemoryName;
+
+        try {
+            renderSequence(*scene, camera, loadCameraPoses(argv[2]), threadPool, settings);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+
+        return 0;
+    }
+
     SDLScreen screen(screenWidth, screenHeight, "Basic Raytracer", false);
 
-    const auto sliceHeight = (camera.imageHeight / numSlices);
+    std::vector<SDL_Event> events;
 
-    const auto trace = [&camera, &scene, &screen, sliceHeight](int sliceIndex) {
-        const auto startY = sliceHeight * sliceIndex;
+    //
+    // Interactive mode: TestApp --interactive [--reproject]
+    // Moving passes render at reduced resolution to fit the frame budget, then refine while the camera is still.
+    // With --reproject, moves carry accumulated samples over to the new view instead.
+    //
+    if (argc >= 2 && std::string(argv[1]) == "--interactive") {
+        PreviewSettings settings;
+        settings.maxSamples = numSamples;
+        settings.temporalReprojection = argc >= 3 && std::string(argv[2]) == "--reproject";
+
+        PreviewRenderer preview(*scene, threadPool, screenWidth, screenHeight, settings);
+        Camerad lastCamera = camera;
+
+        // Every collected pass is published, numbered in the order they finish.
+        std::unique_ptr<FramePublisher> publisher;
+        try {
+            if (!sharedMemoryName.empty())
+                publisher = std::make_unique<FramePublisher>(sharedMemoryName, screenWidth, screenHeight);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+        uint64_t passes = 0;
+        std::vector<uint32_t> pixels(screenWidth * screenHeight);
 
-        for (int y = startY; y < startY + sliceHeight; y++) {
-            for (int x = 0; x < camera.imageWidth; x++) {
-                vec3f colour(0.0f, 0.0f, 0.0f);
+        while (processEvents(events, camera)) {
+            if (!samePose(camera, lastCamera)) {
+                preview.cameraMoved();
+                lastCamera = camera;
+            }
 
-                if (numSamples > 1) {
-                    for (int i = 0; i < numSamples; ++i) {
-                        const auto ray = Ray{camera.trans, camera.directionFromPixelUnnormalised({x + randomDouble(), y + randomDouble()})};
-                        colour += rayColour(scene, ray, maxBounces);
+            if (preview.collect()) {
+                for (int y = 0; y < screenHeight; y++) {
+                    for (int x = 0; x < screenWidth; x++) {
+                        pixels[y * screenWidth + x] = packARGB(preview.pixel(x, y));
                     }
-
-                    colour.x = std::sqrt(colour.x * scale);
-                    colour.y = std::sqrt(colour.y * scale);
-                    colour.z = std::sqrt(colour.z * scale);
-                } else {
-                    colour = rayColour(scene, Ray{camera.trans, camera.directionFromPixelUnnormalised({x,y})}, maxBounces);
                 }
 
-                screen.putPixel(x, y, colour);
+                // Shown at the screen's next present, from pollEvents below.
+                screen.putTile(0, 0, screenWidth, screenHeight, pixels.data(), screenWidth);
+
+                if (publisher) {
+                    FrameInfo info;
+                    info.frame = passes++;
+                    info.width = screenWidth;
+                    info.height = screenHeight;
+                    info.samples = preview.samples();
+                    publisher->publish(info, pixels.data());
+                }
             }
+
+            // Keeps one pass queued behind the event loop, a camera move cancels it on the next iteration.
+            preview.startPass(camera);
+
+            // Waits briefly for input so the loop does not spin while a pass runs.
+            events = screen.pollEvents(2);
         }
-    };
 
-    ThreadPool threadPool(4);
+        // Written by the writer's thread, its destructor waits for it on the way out.
+        ImageWriter writer;
+        writer.write("mainout.qoi", std::move(pixels), screenWidth, screenHeight);
+        return 0;
+    }
 
-    std::vector<SDL_Event> events;
+    const auto sliceHeight = (camera.imageHeight / numSlices);
 
-//    while (processEvents(events, camera)) {
-        Latch latch(numSlices);
+    std::vector<vec3f> radiance(camera.imageWidth * camera.imageHeight);
+
+    // First hits of the camera rays, rasterized once for every slice.
+    VisibilityBuffer visibility;
+    rasterize(*scene, camera, numVisibilitySamples, visibility, &threadPool);
+
+    std::vector<uint32_t> pixels(camera.imageWidth * camera.imageHeight);
 
-        for (int i = 0; i < numSlices; ++i) {
-            threadPool.enqueue([i, &trace, &latch](){
-                trace(i);
-                latch.countDown();
+    const auto trace = [&camera, &scene, &screen, &radiance, &pixels, &visibility, sliceHeight](int sliceIndex) {
+        const Tile slice{0, sliceHeight * sliceIndex, camera.imageWidth, sliceHeight * (sliceIndex + 1)};
+
+        traceTile(*scene, camera, slice, numSamples, maxBounces, radiance.data(), nullptr, &visibility);
+
+        // Each slice goes to the screen whole as soon as it is done.
+        const size_t first = size_t(slice.y0) * camera.imageWidth;
+        resolve(radiance.data() + first, size_t(slice.y1 - slice.y0) * camera.imageWidth, pixels.data() + first);
+        screen.putTile(slice.x0, slice.y0, slice.x1 - slice.x0, slice.y1 - slice.y0, pixels.data() + first,
+                       camera.imageWidth);
+    };
+
+//    while (processEvents(events, camera)) {
+        //
+        // Traced off this thread, which owns the window and presents slices as they arrive until every one is done.
+        //
+        auto traced = std::async(std::launch::async, [&threadPool, &trace]() {
+            parallelFor(&threadPool, numSlices, 1, [&trace](const size_t i) {
+                trace(static_cast<int>(i));
             });
+        });
+        while (traced.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            events = screen.pollEvents(16);
         }
+        traced.get();
 
         //
-        // Make sure all worker threads have finished tracing before rendering to screen.
+        // Encoded and written on the writer's thread while the frame is presented.
         //
-        latch.wait();
+        ImageWriter writer;
+        writer.write("mainout.qoi", std::move(pixels), camera.imageWidth, camera.imageHeight);
 
-        events = screen.render();
-        screen.saveImage("mainout.bmp");
+        events = screen.pollEvents();
 //    }
 
     return 1;
 }
-
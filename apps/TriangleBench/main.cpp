@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CpuDispatch.h"
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Scenes.h"
+#include "TriangleKernels.h"
+
+namespace bv {
+    struct Settings {
+        // Triangles of the soup tested directly, large enough to spill out of cache.
+        size_t triangles = 1 << 20;
+        // Triangles of the soup that stays in cache.
+        size_t cachedTriangles = 1 << 10;
+        size_t tests = 1 << 23;
+        // Quads along each side of the grid whose shared edges are aimed at.
+        int gridSize = 256;
+        // Rings of the tessellated sphere traced through a BVH.
+        int sphereRings = 256;
+        size_t sceneRays = 1 << 20;
+        uint64_t seed = 1;
+    };
+
+    struct Corners {
+        vec3d a, b, c;
+    };
+
+    struct Test {
+        uint32_t triangle;
+        Ray ray;
+    };
+
+    vec3d randomPoint(const double min, const double max) {
+        return {randomDouble(min, max), randomDouble(min, max), randomDouble(min, max)};
+    }
+
+    // Small triangles scattered through the unit cube.
+    std::vector<Corners> makeSoup(const size_t count) {
+        std::vector<Corners> soup(count);
+        for (auto& triangle : soup) {
+            const vec3d centre = randomPoint(-1.0, 1.0);
+            triangle = {centre + randomPoint(-0.05, 0.05), centre + randomPoint(-0.05, 0.05),
+                        centre + randomPoint(-0.05, 0.05)};
+        }
+        return soup;
+    }
+
+    //
+    // Each test pairs a random triangle with a ray from a random point towards a point near it, about half of which
+    // cross it. The triangles are visited out of order, as a traversal would.
+    //
+    std::vector<Test> makeTests(const std::vector<Corners>& soup, const size_t count) {
+        std::vector<Test> tests(count);
+        for (auto& test : tests) {
+            test.triangle = uint32_t(randomDouble() * double(soup.size())) % uint32_t(soup.size());
+            const Corners& t = soup[test.triangle];
+
+            double u = randomDouble(-0.2, 1.0);
+            double v = randomDouble(-0.2, 1.0);
+            if (u + v > 1.2) {
+                u = 1.0 - u;
+                v = 1.0 - v;
+            }
+            const vec3d target = t.a + u * (t.b - t.a) + v * (t.c - t.a);
+            const vec3d start = randomPoint(-3.0, 3.0);
+            test.ray = {start, target - start};
+        }
+        return tests;
+    }
+
+    template <typename Kernel>
+    std::vector<Kernel> makeKernels(const std::vector<Corners>& soup) {
+        std::vector<Kernel> kernels;
+        kernels.reserve(soup.size());
+        for (const auto& t : soup)
+            kernels.emplace_back(t.a, t.b, t.c);
+        return kernels;
+    }
+
+    // Nanoseconds per test, the fastest of a few runs. Hits are counted so the tests cannot be optimised away.
+    template <typename Kernel>
+    double timeKernel(const std::vector<Kernel>& kernels, const std::vector<Test>& tests, size_t& hits) {
+        double best = std::numeric_limits<double>::infinity();
+
+        for (int run = 0; run < 3; ++run) {
+            hits = 0;
+            const auto start = std::chrono::steady_clock::now();
+
+            // Compiled for each CPU path, with the kernel inlined.
+            dispatchCpu([&]() BV_CPU_KERNEL {
+                for (const auto& test : tests) {
+                    TriangleIntersection found;
+                    hits += kernels[test.triangle].intersect(test.ray, 1e-9, 1e12, found);
+                }
+            });
+
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = std::min(best, seconds * 1e9 / double(tests.size()));
+        }
+
+        return best;
+    }
+
+    struct Agreement {
+        size_t disagreements = 0;
+        double maxRelativeT = 0.0;
+        double maxBarycentric = 0.0;
+    };
+
+    // Differences from Möller-Trumbore over the same tests. Disagreements can only come from rays grazing an edge.
+    template <typename Kernel>
+    Agreement compare(const std::vector<Kernel>& kernels, const std::vector<MollerTrumbore>& reference,
+                      const std::vector<Test>& tests) {
+        Agreement agreement;
+
+        for (const auto& test : tests) {
+            TriangleIntersection a{}, b{};
+            const bool hitA = kernels[test.triangle].intersect(test.ray, 1e-9, 1e12, a);
+            const bool hitB = reference[test.triangle].intersect(test.ray, 1e-9, 1e12, b);
+
+            if (hitA != hitB) {
+                ++agreement.disagreements;
+            } else if (hitA) {
+                agreement.maxRelativeT = std::max(agreement.maxRelativeT, std::fabs(a.t - b.t) / b.t);
+                agreement.maxBarycentric =
+                    std::max({agreement.maxBarycentric, std::fabs(a.u - b.u), std::fabs(a.v - b.v)});
+            }
+        }
+
+        return agreement;
+    }
+
+    //
+    // Rays at the vertices and edge midpoints of a grid of triangles, sheared and tilted off the axes, where
+    // neighbouring triangles meet. A ray that none of the triangles around its target report is a leak.
+    //
+    template <typename Kernel>
+    size_t countLeaks(const int gridSize) {
+        const auto corner = [gridSize](const int i, const int j) {
+            const double x = double(i) / gridSize, y = double(j) / gridSize;
+            return vec3d(x + 0.3 * y, y, 0.1 * x + 0.7 * y + 0.05 * x * y);
+        };
+
+        // Two triangles per quad, the second index of each pair runs along y.
+        std::vector<Kernel> grid;
+        for (int j = 0; j < gridSize; ++j) {
+            for (int i = 0; i < gridSize; ++i) {
+                grid.emplace_back(corner(i, j), corner(i + 1, j), corner(i + 1, j + 1));
+                grid.emplace_back(corner(i, j), corner(i + 1, j + 1), corner(i, j + 1));
+            }
+        }
+
+        size_t leaks = 0;
+        for (int j = 1; j < gridSize - 1; ++j) {
+            for (int i = 1; i < gridSize - 1; ++i) {
+                const vec3d targets[4] = {corner(i, j), 0.5 * (corner(i, j) + corner(i + 1, j)),
+                                          0.5 * (corner(i, j) + corner(i, j + 1)),
+                                          0.5 * (corner(i, j) + corner(i + 1, j + 1))};
+
+                for (const auto& target : targets) {
+                    const vec3d start = target + vec3d(randomDouble(-1.0, 1.0), randomDouble(-1.0, 1.0), 2.0);
+                    const Ray ray{start, target - start};
+
+                    bool hit = false;
+                    for (int y = j - 1; y <= j + 1 && !hit; ++y) {
+                        for (int x = i - 1; x <= i + 1 && !hit; ++x) {
+                            for (int k = 0; k < 2 && !hit; ++k) {
+                                TriangleIntersection found;
+                                hit = grid[2 * (size_t(y) * gridSize + x) + k].intersect(ray, 0.0, 1e12, found);
+                            }
+                        }
+                    }
+                    leaks += !hit;
+                }
+            }
+        }
+
+        return leaks;
+    }
+
+    // Closest hits through a BVH over a tessellated unit sphere, rays from outside aimed near it.
+    template <typename Kernel>
+    double timeScene(const int rings, const size_t numRays, size_t& hits) {
+        Scene scene;
+        const auto material = scene.materials().intern(createLambertianMaterial({0.5f, 0.5f, 0.5f}));
+
+        const auto point = [rings](const int ring, const int segment) {
+            const double theta = M_PI * ring / rings, phi = 2.0 * M_PI * segment / (2 * rings);
+            return vec3d(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+        };
+
+        for (int ring = 0; ring < rings; ++ring) {
+            for (int segment = 0; segment < 2 * rings; ++segment) {
+                const vec3d a = point(ring, segment), b = point(ring + 1, segment);
+                const vec3d c = point(ring + 1, segment + 1), d = point(ring, segment + 1);
+                if (ring > 0)
+                    scene.add(createTriangleWith<Kernel>(a, c, d, {}, {}, {}, material));
+                if (ring < rings - 1)
+                    scene.add(createTriangleWith<Kernel>(a, b, c, {}, {}, {}, material));
+            }
+        }
+        scene.build();
+
+        std::vector<Ray> rays(numRays);
+        for (auto& ray : rays) {
+            const vec3d start = 3.0 * glm::normalize(randomPoint(-1.0, 1.0));
+            ray = {start, randomPoint(-1.1, 1.1) - start};
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        hits = 0;
+        for (const auto& ray : rays) {
+            Hit hit{};
+            hits += scene.intersect(ray, hit, 1e-9, 1e12);
+        }
+
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 /
+               double(numRays);
+    }
+
+    template <typename Kernel>
+    void bench(const Settings& settings, const std::vector<Corners>& soup, const std::vector<Corners>& cachedSoup,
+               const std::vector<Test>& tests, const std::vector<Test>& cachedTests,
+               const std::vector<MollerTrumbore>& reference) {
+        const auto kernels = makeKernels<Kernel>(soup);
+        const auto cachedKernels = makeKernels<Kernel>(cachedSoup);
+
+        size_t hits = 0, cachedHits = 0, sceneHits = 0;
+        const double ns = timeKernel(kernels, tests, hits);
+        const double cachedNs = timeKernel(cachedKernels, cachedTests, cachedHits);
+        const Agreement agreement = compare(kernels, reference, tests);
+
+        seedRandom(settings.seed);
+        const size_t leaks = countLeaks<Kernel>(settings.gridSize);
+
+        seedRandom(settings.seed);
+        const double sceneNs = timeScene<Kernel>(settings.sphereRings, settings.sceneRays, sceneHits);
+
+        std::cout << std::left << std::setw(16) << Kernel::name << std::right << std::setw(6) << sizeof(Kernel)
+                  << std::setw(11) << std::fixed << std::setprecision(2) << cachedNs << std::setw(11) << ns
+                  << std::setw(11) << sceneNs << std::setw(9) << agreement.disagreements << std::setw(11)
+                  << std::scientific << std::setprecision(1) << agreement.maxRelativeT << std::setw(11)
+                  << agreement.maxBarycentric << std::setw(8) << leaks << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using namespace bv;
+
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const auto next = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " expects a value");
+                return argv[++i];
+            };
+
+            if (arg == "--triangles") {
+                settings.triangles = std::max<size_t>(std::stoull(next()), 1);
+            } else if (arg == "--tests") {
+                settings.tests = std::stoull(next());
+            } else if (arg == "--grid") {
+                settings.gridSize = std::max(std::stoi(next()), 3);
+            } else if (arg == "--rings") {
+                settings.sphereRings = std::max(std::stoi(next()), 2);
+            } else if (arg == "--scene-rays") {
+                settings.sceneRays = std::stoull(next());
+            } else if (arg == "--seed") {
+                settings.seed = std::stoull(next());
+            } else if (arg == "--cpu-path") {
+                setCpuPath(next());
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n"
+                  << "TriangleBench [--triangles <n>] [--tests <n>] [--grid <quads>] [--rings <n>] "
+                     "[--scene-rays <n>] [--seed <n>]\n"
+                     "              [--cpu-path <generic|sse4.2|avx2|avx512>]\n";
+        return 2;
+    }
+
+    seedRandom(settings.seed);
+    const auto soup = makeSoup(settings.triangles);
+    const auto cachedSoup = makeSoup(settings.cachedTriangles);
+    const auto tests = makeTests(soup, settings.tests);
+    const auto cachedTests = makeTests(cachedSoup, settings.tests);
+    const auto reference = makeKernels<MollerTrumbore>(soup);
+
+    //
+    // bytes: kernel size per triangle. cached/soup: ns per test against triangles in cache and spread over memory.
+    // bvh: ns per closest hit ray through a BVH. differ: tests whose hit or miss differs from Möller-Trumbore,
+    // dt and duv the largest relative t and absolute barycentric differences of the rest. leaks: rays through
+    // shared edges and vertices of a grid that hit neither side.
+    //
+    std::cout << soup.size() << " triangles, " << tests.size() << " tests, " << cpuPathName(cpuPath())
+              << " kernels\n"
+              << std::left << std::setw(16) << "kernel" << std::right << std::setw(6) << "bytes" << std::setw(11)
+              << "cached" << std::setw(11) << "soup" << std::setw(11) << "bvh" << std::setw(9) << "differ"
+              << std::setw(11) << "dt" << std::setw(11) << "duv" << std::setw(8) << "leaks" << "\n";
+
+    bench<MollerTrumbore>(settings, soup, cachedSoup, tests, cachedTests, reference);
+    bench<BaldwinWeber>(settings, soup, cachedSoup, tests, cachedTests, reference);
+    bench<Plucker>(settings, soup, cachedSoup, tests, cachedTests, reference);
+    bench<Watertight>(settings, soup, cachedSoup, tests, cachedTests, reference);
+
+    return 0;
+}
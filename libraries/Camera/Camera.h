@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cmath>
+
 #include "GlmTypes.h"
+#include "glm/geometric.hpp"
+#include "glm/matrix.hpp"
 
 #pragma once
 
@@ -20,24 +24,35 @@ namespace bv {
             updateRotationMatrix();
         }
 
+        // Camera to world rotation, world directions are cameraToWorld() * camera directions.
+        mat3x3<T> cameraToWorld() const {
+            return mat3x3<T>(vec3<T>(rot[0]), vec3<T>(rot[1]), vec3<T>(rot[2]));
+        }
+
+        // World to pixel projection K * [R^T | -R^T t], the inverse of directionFromPixel.
         mat3x4<T> projMatrix() const {
-            mat3x3<T> intrinsics(focalLength, 0, centreX,
-                                 0, focalLength * aspectRatio, centreY,
-                                 0, 0, 1);
+            mat3x3<T> intrinsics(T(1));
+            intrinsics[0][0] = focalLength;
+            intrinsics[1][1] = focalLength * aspectRatio;
+            intrinsics[2][0] = centreX;
+            intrinsics[2][1] = centreY;
 
-            mat3x4<T> extrinsics(rot[0][0], rot[0][1], rot[0][2], trans[0],
-                                 rot[1][0], rot[1][1], rot[1][2], trans[1],
-                                 rot[2][0], rot[2][1], rot[2][2], trans[2]);
+            const mat3x3<T> kr = intrinsics * glm::transpose(cameraToWorld());
 
-            return intrinsics * extrinsics;
+            return mat3x4<T>(kr[0], kr[1], kr[2], -(kr * trans));
         }
 
         vec3<T> directionFromPixelUnnormalised(vec2<T> pixel) const {
-            return rot * vec3<T>(pixel.x - centreX, pixel.y - centreY, focalLength);
+            return rot * vec3<T>(pixel.x - centreX, (pixel.y - centreY) / aspectRatio, focalLength);
         }
 
         vec3<T> directionFromPixel(vec2<T> pixel) const {
-            return glm::normalize(rot * vec3<T>(pixel.x - centreX, pixel.y - centreY, focalLength));
+            return glm::normalize(directionFromPixelUnnormalised(pixel));
+        }
+
+        // Angle subtended by one pixel at the image centre, the spread of the ray cone through a pixel.
+        T pixelSpreadAngle() const {
+            return std::atan(T(1) / focalLength);
         }
 
         void updateRotationMatrix() {
@@ -102,6 +117,7 @@ namespace bv {
             return !(p.x < 0 || p.x >= imageWidth || p.y < 0 || p.y >= imageHeight);
         }
 
+        // Pixel position of a world point. Only meaningful for points in front of the camera, see depth().
         vec2<T> project(const vec3<T>& point) const {
             vec3<T> homoPoint = projMatrix() * vec4<T>{point, 1.0};
 
@@ -110,6 +126,11 @@ namespace bv {
             return pp;
         }
 
+        // Distance of a world point along the viewing axis, negative behind the camera.
+        T depth(const vec3<T>& point) const {
+            return glm::dot(point - trans, cameraToWorld()[2]);
+        }
+
         vec3<T> trans;
         T roll, pitch, yaw;
         T focalLength, aspectRatio;
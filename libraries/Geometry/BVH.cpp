@@ -0,0 +1,992 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Geometry.h"
+#include "Latch.h"
+#include "ParallelChunks.h"
+#include "TaskGroup.h"
+#include "ThreadPool.h"
+
+namespace bv {
+
+namespace {
+// SAH costs of a node traversal and a primitive test.
+constexpr double traversalCost = 1.0;
+constexpr double intersectCost = 1.0;
+
+constexpr int binCount = 16;
+constexpr size_t maxLeafSize = 8;
+// Binary nodes this deep are split at the median, which bounds the depth of the tree, and so the traversal stack,
+// at twice this. Subtrees built later count on from the depth of their root, so the bound holds for the whole tree:
+// a node deeper than this holds at most 2^(2 * medianDepth - depth) primitives, and a subtree rooted there halves it
+// at every level.
+constexpr uint32_t medianDepth = 32;
+constexpr uint32_t maxDepth = 2 * medianDepth;
+
+// Nodes at least this large are binned and partitioned by the whole pool, smaller ones become subtree tasks.
+constexpr size_t parallelNodeSize = 1 << 15;
+// A subtree task hands off children at least this large as tasks of their own.
+constexpr size_t spawnSize = 1 << 12;
+// Primitives per chunk of a parallel pass over a node.
+constexpr size_t chunkSize = 1 << 14;
+// Collapsing hands off wide nodes above this depth as tasks.
+constexpr uint32_t collapseSpawnDepth = 4;
+// Nodes refit per chunk when a level is spread over a pool.
+constexpr size_t refitGrain = 256;
+// A lazy build leaves subtrees of at most this many primitives to the first ray that enters them. Small enough that
+// building one holds up that ray for at most a few milliseconds.
+constexpr size_t lazySubtreeSize = 1 << 12;
+
+// Per-node passes wait on their helpers, so they must run ahead of queued subtree tasks.
+constexpr int helperPriority = 1;
+constexpr int subtreePriority = 0;
+
+// Decoded boxes are widened by this fraction of their coordinates and the ray origin's, which covers the rounding
+// of decoding and of the slab test in single precision.
+constexpr float boxPadding = 1.0f / (1 << 20);
+
+struct Bin {
+    AABB bounds;
+    size_t count = 0;
+};
+
+// 2^e for the exponents stored in a node, built directly from the bits.
+float exp2i(const int e) {
+    const uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Single precision copy of a ray for the box tests. Zero direction components are nudged away from zero so that
+// no slab test ever computes 0 * inf.
+struct RayBoxData {
+    float start[3];
+    float invDir[3];
+    float padding[3];
+    float tMin;
+
+    explicit RayBoxData(const Ray& ray, const double tMin) {
+        for (int axis = 0; axis < 3; ++axis) {
+            start[axis] = static_cast<float>(ray.start[axis]);
+            const double d = std::fabs(ray.dir[axis]) < 1e-20 ? std::copysign(1e-20, ray.dir[axis]) : ray.dir[axis];
+            invDir[axis] = static_cast<float>(1.0 / d);
+            padding[axis] = std::fabs(start[axis]) * boxPadding;
+        }
+        this->tMin = std::nextafter(static_cast<float>(tMin), -std::numeric_limits<float>::infinity());
+    }
+};
+
+float farLimit(const double t) {
+    return std::nextafter(static_cast<float>(std::min(t, static_cast<double>(std::numeric_limits<float>::max()))),
+                          std::numeric_limits<float>::infinity());
+}
+}
+
+struct BVH::BuildContext {
+    struct BinaryNode {
+        AABB bounds;
+        // Leaves: first primitive in ordered. Interior nodes: left child, the right child follows it.
+        uint32_t first;
+        // Number of primitives, 0 for interior nodes.
+        uint32_t count;
+    };
+
+    std::vector<PrimRef> refs;
+    // Target of parallel partitions.
+    std::vector<PrimRef> scratch;
+    // Binary tree built first and collapsed into wide nodes, sized up front like the wide nodes.
+    std::vector<BinaryNode> binary;
+    std::atomic<uint32_t> nextBinary{0};
+    // Position in ordered of refs[0].
+    uint32_t offset = 0;
+    // Node the tree is built under and its valid mask, only stored once the whole subtree is finished.
+    uint32_t root = 0;
+    uint8_t rootValid = 0;
+    ThreadPool* threadPool = nullptr;
+    std::unique_ptr<TaskGroup> subtrees;
+    // Stop at subtrees of lazySubtreeSize primitives, leaving them as binary leaves of more than maxLeafSize.
+    bool lazy = false;
+};
+
+void BVH::build(const std::vector<std::shared_ptr<Geometry>>& primitives, ThreadPool* threadPool, const bool lazy) {
+    source.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        source[i] = primitives[i].get();
+
+    rebuild(threadPool, lazy);
+}
+
+void BVH::rebuild(ThreadPool* threadPool, const bool lazy) {
+    const auto start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    info.clear();
+    nextNode = 0;
+    garbage = 0;
+    unexpanded = 0;
+
+    leafOf.assign(source.size(), invalid);
+    ordered.resize(source.size());
+    indices.resize(source.size());
+
+    if (!source.empty()) {
+        BuildContext ctx;
+        ctx.threadPool = threadPool;
+        ctx.lazy = lazy;
+        ctx.refs.resize(source.size());
+
+        const size_t chunks = (source.size() + chunkSize - 1) / chunkSize;
+        parallelChunks(threadPool, chunks, [&](const size_t c) {
+            const size_t end = std::min(source.size(), (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < end; ++i) {
+                auto& ref = ctx.refs[i];
+                ref.bounds = source[i]->bounds();
+                ref.centroid = ref.bounds.centroid();
+                ref.index = static_cast<uint32_t>(i);
+            }
+        }, helperPriority);
+
+        //
+        // Every wide node absorbs at least one binary interior node, of which there are fewer than n. A node left by
+        // a lazy build absorbs none but becomes the root of its subtree, which then allocates fewer nodes than it
+        // has primitives, so the bound holds once everything is expanded and the array is never resized before.
+        //
+        nodes.resize(source.size());
+        info.resize(source.size());
+        nodes[0].parent = invalid;
+        info[0].depth = 0;
+        nextNode = 1;
+
+        buildTree(0, ctx);
+        if (!lazy) {
+            nodes.resize(nextNode);
+            info.resize(nextNode);
+        }
+    }
+
+    marks.assign(nodes.size(), 0);
+
+    buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BVH::buildTree(const uint32_t root, BuildContext& ctx) {
+    ctx.root = root;
+
+    // A binary tree over n primitives has at most 2n - 1 nodes.
+    ctx.binary.resize(2 * ctx.refs.size());
+    ctx.nextBinary = 1;
+    if (ctx.threadPool) {
+        ctx.scratch.resize(ctx.refs.size());
+        ctx.subtrees = std::make_unique<TaskGroup>(*ctx.threadPool, subtreePriority);
+    }
+
+    // Depth counts from the root of the whole tree, so maxDepth bounds it however much was built later.
+    buildNode(0, 0, ctx.refs.size(), info[root].depth, ctx, true);
+
+    if (ctx.subtrees) {
+        ctx.subtrees->wait();
+        ctx.subtrees = std::make_unique<TaskGroup>(*ctx.threadPool, subtreePriority);
+    }
+
+    collapse(root, 0, ctx, true);
+
+    if (ctx.subtrees)
+        ctx.subtrees->wait();
+
+    //
+    // Leaves are put in order, and only then the root is released. Rays entering a lazily expanded subtree take no
+    // lock, so they must not find it before its leaves point at the right primitives.
+    //
+    const size_t chunks = (ctx.refs.size() + chunkSize - 1) / chunkSize;
+    parallelChunks(ctx.threadPool, chunks, [&](const size_t c) {
+        const size_t end = std::min(ctx.refs.size(), (c + 1) * chunkSize);
+        for (size_t i = c * chunkSize; i < end; ++i) {
+            ordered[ctx.offset + i] = source[ctx.refs[i].index];
+            indices[ctx.offset + i] = ctx.refs[i].index;
+        }
+    }, helperPriority);
+    __atomic_store_n(&nodes[root].valid, ctx.rootValid, __ATOMIC_RELEASE);
+
+    updateCosts(root);
+
+    ctx.binary = {};
+    ctx.scratch = {};
+}
+
+void BVH::buildNode(const uint32_t node, const size_t begin, const size_t end, const uint32_t depth,
+                    BuildContext& ctx, const bool onCaller) {
+    auto& refs = ctx.refs;
+    auto& binary = ctx.binary;
+    const size_t count = end - begin;
+
+    // Large nodes are only met on the calling thread, which may block while the pool helps with them.
+    ThreadPool* pool = onCaller && count >= parallelNodeSize ? ctx.threadPool : nullptr;
+    const size_t chunks = pool ? (count + chunkSize - 1) / chunkSize : 1;
+    const auto chunkBegin = [&](const size_t c) {
+        return begin + c * count / chunks;
+    };
+
+    AABB bounds;
+    AABB centroidBounds;
+    {
+        std::vector<std::pair<AABB, AABB>> partial(chunks);
+        parallelChunks(pool, chunks, [&](const size_t c) {
+            for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i) {
+                partial[c].first.extend(refs[i].bounds);
+                partial[c].second.extend(refs[i].centroid);
+            }
+        }, helperPriority);
+        for (const auto& p : partial) {
+            bounds.extend(p.first);
+            centroidBounds.extend(p.second);
+        }
+    }
+
+    binary[node].bounds = bounds;
+
+    if (ctx.lazy && count > maxLeafSize && count <= lazySubtreeSize) {
+        binary[node].first = static_cast<uint32_t>(ctx.offset + begin);
+        binary[node].count = static_cast<uint32_t>(count);
+        return;
+    }
+
+    if (count == 1) {
+        binary[node].first = static_cast<uint32_t>(ctx.offset + begin);
+        binary[node].count = 1;
+        return;
+    }
+
+    const vec3d extent = centroidBounds.max - centroidBounds.min;
+    int axis = 0;
+    if (extent.y > extent[axis])
+        axis = 1;
+    if (extent.z > extent[axis])
+        axis = 2;
+
+    size_t mid = begin + count / 2;
+
+    if (extent[axis] > 0.0 && depth < medianDepth) {
+        const double scale = binCount / extent[axis];
+        const auto binOf = [&](const PrimRef& ref) {
+            const int b = static_cast<int>((ref.centroid[axis] - centroidBounds.min[axis]) * scale);
+            return std::min(b, binCount - 1);
+        };
+
+        std::array<Bin, binCount> bins{};
+        {
+            std::vector<std::array<Bin, binCount>> partial(chunks);
+            parallelChunks(pool, chunks, [&](const size_t c) {
+                for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i) {
+                    auto& bin = partial[c][binOf(refs[i])];
+                    bin.bounds.extend(refs[i].bounds);
+                    bin.count++;
+                }
+            }, helperPriority);
+            for (const auto& p : partial) {
+                for (int b = 0; b < binCount; ++b) {
+                    bins[b].bounds.extend(p[b].bounds);
+                    bins[b].count += p[b].count;
+                }
+            }
+        }
+
+        // Sweep from the right to get the area and size of every right hand side, then from the left to cost
+        // each of the binCount - 1 split planes.
+        std::array<double, binCount> rightArea{};
+        std::array<size_t, binCount> rightCount{};
+        AABB right;
+        size_t rightN = 0;
+        for (int b = binCount - 1; b > 0; --b) {
+            right.extend(bins[b].bounds);
+            rightN += bins[b].count;
+            rightArea[b] = right.surfaceArea();
+            rightCount[b] = rightN;
+        }
+
+        const double area = bounds.surfaceArea();
+        double bestCost = std::numeric_limits<double>::infinity();
+        int bestSplit = -1;
+        AABB left;
+        size_t leftN = 0;
+        for (int b = 1; b < binCount; ++b) {
+            left.extend(bins[b - 1].bounds);
+            leftN += bins[b - 1].count;
+            if (leftN == 0 || rightCount[b] == 0)
+                continue;
+
+            const double cost = area > 0.0
+                    ? traversalCost + intersectCost * (left.surfaceArea() * leftN + rightArea[b] * rightCount[b]) / area
+                    : traversalCost + intersectCost * count;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        if (count <= maxLeafSize && intersectCost * count <= bestCost) {
+            binary[node].first = static_cast<uint32_t>(ctx.offset + begin);
+            binary[node].count = static_cast<uint32_t>(count);
+            return;
+        }
+
+        if (bestSplit > 0 && pool) {
+            // Stable partition in three passes: count each chunk's left side, scatter both sides through
+            // scratch, copy back.
+            std::vector<size_t> leftCounts(chunks, 0);
+            parallelChunks(pool, chunks, [&](const size_t c) {
+                for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+                    leftCounts[c] += binOf(refs[i]) < bestSplit;
+            }, helperPriority);
+
+            std::vector<size_t> leftAt(chunks);
+            std::vector<size_t> rightAt(chunks);
+            size_t totalLeft = 0;
+            for (size_t c = 0; c < chunks; ++c)
+                totalLeft += leftCounts[c];
+            for (size_t c = 0, l = begin, r = begin + totalLeft; c < chunks; ++c) {
+                leftAt[c] = l;
+                rightAt[c] = r;
+                l += leftCounts[c];
+                r += chunkBegin(c + 1) - chunkBegin(c) - leftCounts[c];
+            }
+
+            parallelChunks(pool, chunks, [&](const size_t c) {
+                for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+                    ctx.scratch[binOf(refs[i]) < bestSplit ? leftAt[c]++ : rightAt[c]++] = refs[i];
+            }, helperPriority);
+            parallelChunks(pool, chunks, [&](const size_t c) {
+                std::copy(ctx.scratch.begin() + chunkBegin(c), ctx.scratch.begin() + chunkBegin(c + 1),
+                          refs.begin() + chunkBegin(c));
+            }, helperPriority);
+            mid = begin + totalLeft;
+        } else if (bestSplit > 0) {
+            const auto it = std::partition(refs.begin() + begin, refs.begin() + end, [&](const PrimRef& ref) {
+                return binOf(ref) < bestSplit;
+            });
+            mid = static_cast<size_t>(it - refs.begin());
+        } else {
+            std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                             [axis](const PrimRef& a, const PrimRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+    } else if (count <= maxLeafSize) {
+        binary[node].first = static_cast<uint32_t>(ctx.offset + begin);
+        binary[node].count = static_cast<uint32_t>(count);
+        return;
+    } else if (extent[axis] > 0.0) {
+        std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                         [axis](const PrimRef& a, const PrimRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+    // Otherwise every centroid coincides and the range is simply cut in half.
+
+    const uint32_t left = ctx.nextBinary.fetch_add(2, std::memory_order_relaxed);
+    binary[node].first = left;
+    binary[node].count = 0;
+
+    const std::array<std::pair<size_t, size_t>, 2> ranges{{{begin, mid}, {mid, end}}};
+    for (uint32_t i = 0; i < 2; ++i) {
+        const auto [childBegin, childEnd] = ranges[i];
+        const size_t childCount = childEnd - childBegin;
+        const uint32_t child = left + i;
+
+        const bool spawn = ctx.subtrees && (onCaller ? childCount < parallelNodeSize : childCount >= spawnSize);
+        if (spawn) {
+            ctx.subtrees->run([this, &ctx, child, childBegin = childBegin, childEnd = childEnd, depth]() {
+                buildNode(child, childBegin, childEnd, depth + 1, ctx, false);
+            });
+        } else {
+            buildNode(child, childBegin, childEnd, depth + 1, ctx, onCaller);
+        }
+    }
+}
+
+void BVH::collapse(const uint32_t node, const uint32_t binary, BuildContext& ctx, const bool onCaller) {
+    const auto& tree = ctx.binary;
+
+    // Open up the largest interior child until there are four, keeping them in order so that the leaves of every
+    // subtree stay contiguous in ordered.
+    std::array<uint32_t, width> slots{};
+    int children = 0;
+    if (tree[binary].count > 0) {
+        slots[children++] = binary;
+    } else {
+        slots[children++] = tree[binary].first;
+        slots[children++] = tree[binary].first + 1;
+    }
+
+    while (children < width) {
+        int largest = -1;
+        double largestArea = -1.0;
+        for (int i = 0; i < children; ++i) {
+            const auto& b = tree[slots[i]];
+            if (b.count == 0 && b.bounds.surfaceArea() > largestArea) {
+                largest = i;
+                largestArea = b.bounds.surfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+
+        const uint32_t opened = tree[slots[largest]].first;
+        for (int i = children; i > largest + 1; --i)
+            slots[i] = slots[i - 1];
+        slots[largest] = opened;
+        slots[largest + 1] = opened + 1;
+        children++;
+    }
+
+    auto& n = nodes[node];
+    std::array<AABB, width> bounds;
+    for (int i = 0; i < children; ++i) {
+        const auto& b = tree[slots[i]];
+        bounds[i] = b.bounds;
+
+        // Left by a lazy build: an empty node holding its range, costed as one leaf until it is expanded.
+        if (b.count > maxLeafSize) {
+            const uint32_t child = nextNode.fetch_add(1, std::memory_order_relaxed);
+            n.child[i] = child;
+            n.count[i] = 0;
+            nodes[child].parent = node;
+            nodes[child].valid = 0;
+            nodes[child].child[0] = b.first;
+            nodes[child].child[1] = b.first + b.count;
+            info[child].depth = info[node].depth + 1;
+            info[child].cost = static_cast<float>(intersectCost * b.count);
+            info[child].builtCost = info[child].cost;
+            unexpanded.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (b.count > 0) {
+            n.child[i] = b.first;
+            n.count[i] = static_cast<uint8_t>(b.count);
+            for (uint32_t p = b.first; p < b.first + b.count; ++p)
+                leafOf[ctx.refs[p - ctx.offset].index] = node;
+            continue;
+        }
+
+        const uint32_t child = nextNode.fetch_add(1, std::memory_order_relaxed);
+        n.child[i] = child;
+        n.count[i] = 0;
+        nodes[child].parent = node;
+        info[child].depth = info[node].depth + 1;
+
+        if (ctx.subtrees && info[child].depth <= collapseSpawnDepth) {
+            ctx.subtrees->run([this, &ctx, child, binaryChild = slots[i]]() {
+                collapse(child, binaryChild, ctx, false);
+            });
+        } else {
+            collapse(child, slots[i], ctx, onCaller);
+        }
+    }
+
+    const uint8_t valid = quantize(node, bounds, children, node != ctx.root);
+    if (node == ctx.root)
+        ctx.rootValid = valid;
+}
+
+uint8_t BVH::quantize(const uint32_t node, const std::array<AABB, width>& bounds, const int children,
+                      const bool publish) {
+    auto& n = nodes[node];
+
+    AABB all;
+    for (int i = 0; i < children; ++i)
+        all.extend(bounds[i]);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        // The origin rounds down and the grid is sized up, so every child box decodes to a box that contains it.
+        float origin = static_cast<float>(all.min[axis]);
+        if (origin > all.min[axis])
+            origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+        int exponent = -100;
+        const double extent = all.max[axis] - origin;
+        if (extent > 0.0)
+            std::frexp(extent / 255.0, &exponent);
+        exponent = std::clamp(exponent, -100, 100);
+        const double step = std::ldexp(1.0, exponent);
+
+        n.origin[axis] = origin;
+        n.exponent[axis] = static_cast<int8_t>(exponent);
+        for (int i = 0; i < width; ++i) {
+            if (i < children) {
+                n.lower[axis][i] = static_cast<uint8_t>(std::clamp(std::floor((bounds[i].min[axis] - origin) / step), 0.0, 255.0));
+                n.upper[axis][i] = static_cast<uint8_t>(std::clamp(std::ceil((bounds[i].max[axis] - origin) / step), 0.0, 255.0));
+            } else {
+                n.lower[axis][i] = 0;
+                n.upper[axis][i] = 0;
+            }
+        }
+    }
+
+    // Written last and released, a node is complete before rays can enter it.
+    const auto valid = static_cast<uint8_t>((1u << children) - 1);
+    if (publish)
+        __atomic_store_n(&n.valid, valid, __ATOMIC_RELEASE);
+    return valid;
+}
+
+AABB BVH::childBounds(const WideNode& node, const int i) const {
+    AABB b;
+    for (int axis = 0; axis < 3; ++axis) {
+        const double step = std::ldexp(1.0, node.exponent[axis]);
+        b.min[axis] = node.origin[axis] + node.lower[axis][i] * step;
+        b.max[axis] = node.origin[axis] + node.upper[axis][i] * step;
+    }
+    return b;
+}
+
+AABB BVH::nodeBounds(const uint32_t node) const {
+    AABB b;
+    for (int i = 0; i < width && (nodes[node].valid >> i & 1); ++i)
+        b.extend(childBounds(nodes[node], i));
+    return b;
+}
+
+void BVH::updateCost(const uint32_t node) {
+    const auto& n = nodes[node];
+
+    std::array<double, width> areas{};
+    std::array<double, width> costs{};
+    AABB all;
+    for (int i = 0; i < width && (n.valid >> i & 1); ++i) {
+        const auto b = childBounds(n, i);
+        all.extend(b);
+        areas[i] = b.surfaceArea();
+        costs[i] = n.count[i] > 0 ? intersectCost * n.count[i] : info[n.child[i]].cost;
+    }
+
+    const double area = all.surfaceArea();
+    double cost = traversalCost;
+    for (int i = 0; i < width; ++i)
+        cost += area > 0.0 ? areas[i] / area * costs[i] : costs[i];
+
+    info[node].cost = static_cast<float>(cost);
+}
+
+void BVH::updateCosts(const uint32_t root) {
+    // Breadth first, so every node comes after its parent and walking the list backwards visits them bottom-up.
+    // Nodes left by a lazy build keep their estimate.
+    std::vector<uint32_t> order{root};
+    for (size_t i = 0; i < order.size(); ++i) {
+        const auto& n = nodes[order[i]];
+        for (int c = 0; c < width && (n.valid >> c & 1); ++c) {
+            if (n.count[c] == 0 && nodes[n.child[c]].valid != 0)
+                order.push_back(n.child[c]);
+        }
+    }
+
+    for (auto node = order.rbegin(); node != order.rend(); ++node) {
+        updateCost(*node);
+        info[*node].builtCost = info[*node].cost;
+    }
+}
+
+void BVH::refitNode(const uint32_t node) {
+    const auto& n = nodes[node];
+
+    std::array<AABB, width> bounds;
+    int children = 0;
+    for (; children < width && (n.valid >> children & 1); ++children) {
+        if (n.count[children] > 0) {
+            for (uint32_t p = n.child[children]; p < n.child[children] + n.count[children]; ++p)
+                bounds[children].extend(ordered[p]->bounds());
+        } else {
+            bounds[children] = nodeBounds(n.child[children]);
+        }
+    }
+
+    quantize(node, bounds, children);
+    updateCost(node);
+}
+
+void BVH::rebuildSubtree(const uint32_t node, ThreadPool* threadPool) {
+    // Leaves of a subtree always cover a contiguous range of ordered, from its first leaf to its last.
+    uint32_t first = node;
+    while (nodes[first].count[0] == 0)
+        first = nodes[first].child[0];
+    uint32_t last = node;
+    int lastSlot;
+    for (;;) {
+        lastSlot = width - 1;
+        while (!(nodes[last].valid >> lastSlot & 1))
+            lastSlot--;
+        if (nodes[last].count[lastSlot] > 0)
+            break;
+        last = nodes[last].child[lastSlot];
+    }
+
+    const size_t begin = nodes[first].child[0];
+    const size_t end = nodes[last].child[lastSlot] + nodes[last].count[lastSlot];
+
+    // Everything below node is abandoned, node itself is reused as the root of the new subtree.
+    std::vector<uint32_t> stack{node};
+    while (!stack.empty()) {
+        const auto& n = nodes[stack.back()];
+        stack.pop_back();
+        for (int i = 0; i < width && (n.valid >> i & 1); ++i) {
+            if (n.count[i] == 0) {
+                garbage++;
+                stack.push_back(n.child[i]);
+            }
+        }
+    }
+
+    nextNode = static_cast<uint32_t>(nodes.size());
+    nodes.resize(nodes.size() + (end - begin));
+    info.resize(nodes.size());
+    buildSubtree(node, begin, end, threadPool);
+    nodes.resize(nextNode);
+    info.resize(nextNode);
+}
+
+void BVH::buildSubtree(const uint32_t node, const size_t begin, const size_t end, ThreadPool* threadPool) {
+    BuildContext ctx;
+    ctx.threadPool = threadPool;
+    ctx.offset = static_cast<uint32_t>(begin);
+    ctx.refs.resize(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+        auto& ref = ctx.refs[i - begin];
+        ref.bounds = ordered[i]->bounds();
+        ref.centroid = ref.bounds.centroid();
+        ref.index = indices[i];
+    }
+
+    buildTree(node, ctx);
+}
+
+void BVH::expand(const uint32_t node) const {
+    std::lock_guard lk(expandMutexes[node % expandMutexes.size()]);
+
+    // Another ray may have expanded it while this one waited.
+    if (__atomic_load_n(&nodes[node].valid, __ATOMIC_ACQUIRE) != 0)
+        return;
+
+    //
+    // Logically const, the tree answers every query the same before and after. Subtrees are disjoint in nodes and
+    // in ordered, so others can be expanded at the same time, and the node array never grows while any are left.
+    // Expanded on this thread alone, which may be one of the pool's workers.
+    //
+    auto& self = const_cast<BVH&>(*this);
+    self.buildSubtree(node, nodes[node].child[0], nodes[node].child[1], nullptr);
+    self.unexpanded.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void BVH::expandAll(ThreadPool* threadPool) {
+    if (unexpanded == 0)
+        return;
+
+    std::vector<uint32_t> pending;
+    std::vector<uint32_t> stack{0};
+    while (!stack.empty()) {
+        const auto& n = nodes[stack.back()];
+        stack.pop_back();
+        for (int i = 0; i < width && (n.valid >> i & 1); ++i) {
+            if (n.count[i] == 0)
+                (nodes[n.child[i]].valid ? stack : pending).push_back(n.child[i]);
+        }
+    }
+
+    parallelChunks(threadPool, pending.size(), [&](const size_t i) {
+        expand(pending[i]);
+    }, helperPriority);
+
+    // Costs above the expanded subtrees still hold their estimates.
+    updateCosts(0);
+    nodes.resize(nextNode);
+    info.resize(nextNode);
+    marks.assign(nodes.size(), 0);
+}
+
+namespace {
+// Tests a ray against all four child boxes of a node at once. Returns a bit per child hit in [tMin, tMax] and
+// writes the distance at which the ray enters each box to tNear.
+template <typename Node>
+BV_CPU_INLINE int intersectChildren(const Node& node, const RayBoxData& ray, const float tMax, float tNear[4]) {
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 padding = _mm_set1_ps(boxPadding);
+
+    __m128 enter = _mm_set1_ps(ray.tMin);
+    __m128 exit = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        const __m128 origin = _mm_set1_ps(node.origin[axis]);
+        const __m128 step = _mm_set1_ps(exp2i(node.exponent[axis]));
+
+        int32_t packed;
+        std::memcpy(&packed, node.lower[axis], sizeof(packed));
+        const __m128i lower = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        std::memcpy(&packed, node.upper[axis], sizeof(packed));
+        const __m128i upper = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(lower), step));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(upper), step));
+
+        const __m128 rayPadding = _mm_set1_ps(ray.padding[axis]);
+        lo = _mm_sub_ps(lo, _mm_add_ps(_mm_mul_ps(_mm_and_ps(lo, absMask), padding), rayPadding));
+        hi = _mm_add_ps(hi, _mm_add_ps(_mm_mul_ps(_mm_and_ps(hi, absMask), padding), rayPadding));
+
+        const __m128 start = _mm_set1_ps(ray.start[axis]);
+        const __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, start), invDir);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, start), invDir);
+
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+    }
+
+    _mm_storeu_ps(tNear, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, exit)) & node.valid;
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        float enter = ray.tMin;
+        float exit = tMax;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float step = exp2i(node.exponent[axis]);
+            float lo = node.origin[axis] + node.lower[axis][i] * step;
+            float hi = node.origin[axis] + node.upper[axis][i] * step;
+            lo -= std::fabs(lo) * boxPadding + ray.padding[axis];
+            hi += std::fabs(hi) * boxPadding + ray.padding[axis];
+
+            const float t0 = (lo - ray.start[axis]) * ray.invDir[axis];
+            const float t1 = (hi - ray.start[axis]) * ray.invDir[axis];
+            enter = std::max(enter, std::min(t0, t1));
+            exit = std::min(exit, std::max(t0, t1));
+        }
+        tNear[i] = enter;
+        mask |= (enter <= exit) << i;
+    }
+    return mask & node.valid;
+#endif
+}
+}
+
+bool BVH::intersect(const Ray& ray, Hit& hit, const double tMin, const double tMax) const {
+    return dispatchCpu([&]() BV_CPU_KERNEL {
+        return closestHit(ray, hit, tMin, tMax);
+    });
+}
+
+bool BVH::occluded(const Ray& ray, const double tMin, const double tMax) const {
+    return dispatchCpu([&]() BV_CPU_KERNEL {
+        return anyHit(ray, tMin, tMax);
+    });
+}
+
+bool BVH::closestHit(const Ray& ray, Hit& hit, const double tMin, const double tMax) const {
+    if (nodes.empty())
+        return false;
+
+    const RayBoxData boxRay(ray, tMin);
+
+    struct Entry {
+        uint32_t node;
+        float t;
+    };
+    std::array<Entry, (width - 1) * maxDepth + 1> stack;
+    size_t top = 0;
+
+    double closest = tMax;
+    bool found = false;
+    uint32_t node = 0;
+    for (;;) {
+        if (__atomic_load_n(&nodes[node].valid, __ATOMIC_ACQUIRE) == 0)
+            expand(node);
+        const auto& n = nodes[node];
+
+        float tNear[width];
+        int mask = intersectChildren(n, boxRay, farLimit(closest), tNear);
+
+        // Leaves are intersected straight away, interior children are pushed farthest first so that the
+        // nearest is visited next.
+        Entry interior[width];
+        int interiorCount = 0;
+        for (; mask; mask &= mask - 1) {
+            const int i = __builtin_ctz(mask);
+            if (n.count[i] > 0) {
+                for (uint32_t p = n.child[i]; p < n.child[i] + n.count[i]; ++p) {
+                    if (ordered[p]->intersect(ray, hit, tMin, closest)) {
+                        closest = hit.t;
+                        hit.primitive = indices[p];
+                        found = true;
+                    }
+                }
+            } else {
+                Entry e{n.child[i], tNear[i]};
+                int j = interiorCount++;
+                for (; j > 0 && interior[j - 1].t < e.t; --j)
+                    interior[j] = interior[j - 1];
+                interior[j] = e;
+            }
+        }
+        for (int i = 0; i < interiorCount; ++i)
+            stack[top++] = interior[i];
+
+        const float limit = farLimit(closest);
+        do {
+            if (top == 0)
+                return found;
+            --top;
+        } while (stack[top].t > limit);
+        node = stack[top].node;
+    }
+}
+
+bool BVH::anyHit(const Ray& ray, const double tMin, const double tMax) const {
+    if (nodes.empty())
+        return false;
+
+    const RayBoxData boxRay(ray, tMin);
+    const float limit = farLimit(tMax);
+
+    std::array<uint32_t, (width - 1) * maxDepth + 1> stack;
+    size_t top = 0;
+
+    uint32_t node = 0;
+    for (;;) {
+        if (__atomic_load_n(&nodes[node].valid, __ATOMIC_ACQUIRE) == 0)
+            expand(node);
+        const auto& n = nodes[node];
+
+        float tNear[width];
+        for (int mask = intersectChildren(n, boxRay, limit, tNear); mask; mask &= mask - 1) {
+            const int i = __builtin_ctz(mask);
+            if (n.count[i] > 0) {
+                for (uint32_t p = n.child[i]; p < n.child[i] + n.count[i]; ++p) {
+                    if (ordered[p]->occluded(ray, tMin, tMax))
+                        return true;
+                }
+            } else {
+                stack[top++] = n.child[i];
+            }
+        }
+
+        if (top == 0)
+            return false;
+        node = stack[--top];
+    }
+}
+
+void BVH::refit(const std::vector<uint32_t>& moved, ThreadPool* threadPool, const double rebuildThreshold) {
+    if (nodes.empty() || moved.empty())
+        return;
+
+    expandAll(threadPool);
+
+    // Collect every node on a path from a moved primitive's leaf to the root, once each, bucketed by depth.
+    std::vector<std::vector<uint32_t>> levels;
+    for (const auto i : moved) {
+        for (uint32_t n = leafOf[i]; n != invalid && !marks[n]; n = nodes[n].parent) {
+            marks[n] = 1;
+            if (levels.size() <= info[n].depth)
+                levels.resize(info[n].depth + 1);
+            levels[info[n].depth].push_back(n);
+        }
+    }
+
+    // Children are always one level deeper than their parent, so each level only reads finished results.
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+        const auto& dirty = *level;
+        parallelChunks(dirty.size() > refitGrain ? threadPool : nullptr, (dirty.size() + refitGrain - 1) / refitGrain,
+                       [&](const size_t c) {
+            const size_t end = std::min(dirty.size(), (c + 1) * refitGrain);
+            for (size_t i = c * refitGrain; i < end; ++i)
+                refitNode(dirty[i]);
+        }, helperPriority);
+    }
+
+    // Rebuild the highest dirty subtrees that degraded, a rebuilt subtree covers everything below it.
+    std::vector<uint32_t> degraded;
+    for (const auto& level : levels) {
+        for (const auto n : level) {
+            marks[n] = 0;
+            if (info[n].cost <= rebuildThreshold * info[n].builtCost)
+                continue;
+
+            bool covered = false;
+            for (uint32_t p = nodes[n].parent; p != invalid && !covered; p = nodes[p].parent)
+                covered = marks[p] == 2;
+            if (!covered) {
+                marks[n] = 2;
+                degraded.push_back(n);
+            }
+        }
+    }
+
+    for (const auto n : degraded)
+        marks[n] = 0;
+
+    if (degraded.empty())
+        return;
+
+    for (const auto n : degraded)
+        rebuildSubtree(n, threadPool);
+
+    if (garbage > nodes.size() / 2) {
+        rebuild(threadPool);
+        return;
+    }
+
+    marks.resize(nodes.size(), 0);
+
+    // A rebuilt subtree's bounds can shrink by a quantization step, so its ancestors are refit again.
+    for (const auto n : degraded) {
+        for (uint32_t p = nodes[n].parent; p != invalid; p = nodes[p].parent)
+            refitNode(p);
+    }
+}
+
+double BVH::sahCost() const {
+    return info.empty() ? 0.0 : info[0].cost;
+}
+
+size_t BVH::nodeCount() const {
+    return nextNode - garbage;
+}
+
+BVHStats BVH::stats() const {
+    BVHStats stats;
+    stats.primitives = source.size();
+    stats.sahCost = sahCost();
+    stats.buildMilliseconds = buildMilliseconds;
+    stats.bytes = nodes.size() * sizeof(WideNode) + info.size() * sizeof(NodeInfo)
+                  + (ordered.size() + source.size()) * sizeof(Geometry*)
+                  + (indices.size() + leafOf.size()) * sizeof(uint32_t) + marks.size();
+
+    if (nodes.empty())
+        return stats;
+
+    // Walk from the root, nodes orphaned by subtree rebuilds are still in the array.
+    std::vector<uint32_t> stack{0};
+    while (!stack.empty()) {
+        const auto node = stack.back();
+        stack.pop_back();
+
+        stats.nodes++;
+        stats.maxDepth = std::max(stats.maxDepth, info[node].depth);
+        if (__atomic_load_n(&nodes[node].valid, __ATOMIC_ACQUIRE) == 0)
+            stats.unexpanded++;
+        for (int i = 0; i < width && (nodes[node].valid >> i & 1); ++i) {
+            if (nodes[node].count[i] > 0)
+                stats.leaves++;
+            else
+                stack.push_back(nodes[node].child[i]);
+        }
+    }
+
+    return stats;
+}
+}
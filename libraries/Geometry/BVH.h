@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CpuDispatch.h"
+#include "GeometryUtils.h"
+
+namespace bv {
+class Geometry;
+class ThreadPool;
+
+struct BVHStats {
+    size_t primitives = 0;
+    size_t nodes = 0;
+    size_t leaves = 0;
+    uint32_t maxDepth = 0;
+    double sahCost = 0.0;
+    // Memory held by the hierarchy, including its per-primitive tables.
+    size_t bytes = 0;
+    // Time taken by the last full build.
+    double buildMilliseconds = 0.0;
+    // Subtrees of a lazy build no ray has entered yet, each counted as one node and none of its leaves.
+    size_t unexpanded = 0;
+};
+
+// Four-wide bounding volume hierarchy. It is built as a binary tree with binned SAH and then collapsed into
+// cache line sized nodes whose four child boxes are quantized to 8 bits relative to the node, so traversal decodes
+// and tests all of a node's children at once. Primitives may move after the build: refit updates the bounds above
+// them, and subtrees whose SAH cost has degraded too far are rebuilt in place.
+//
+// A lazy build stops at subtrees of a few thousand primitives. Each is built by the first ray to enter it, on that
+// ray's thread, while rays from other threads that reach it wait for that build rather than repeat it. Rays never
+// entering a part of the scene never pay for its subtrees.
+class BVH {
+public:
+    BVH() = default;
+
+    // Builds over primitives, spread over threadPool when given: the top levels are binned and partitioned by the
+    // whole pool and smaller subtrees are built as independent tasks. The calling thread must not be one of the
+    // pool's workers. With lazy, only the top of the tree is built now, see above.
+    void build(const std::vector<std::shared_ptr<Geometry>>& primitives, ThreadPool* threadPool = nullptr,
+               bool lazy = false);
+
+    bool intersect(const Ray& ray, Hit& hit, double tMin, double tMax) const;
+
+    bool occluded(const Ray& ray, double tMin, double tMax) const;
+
+    // Refits every node above the moved primitives (indices into the vector given to build) bottom-up, one tree
+    // level at a time, spread over threadPool when one is given. The calling thread takes part, but the call must
+    // not be made from one of the pool's own workers. Afterwards the highest dirty subtrees whose SAH cost grew by
+    // more than rebuildThreshold times their cost when built are rebuilt. Subtrees a lazy build left are built first.
+    void refit(const std::vector<uint32_t>& moved, ThreadPool* threadPool = nullptr, double rebuildThreshold = 1.5);
+
+    // Expected cost of a ray through the whole tree, in units of one primitive test.
+    double sahCost() const;
+
+    size_t nodeCount() const;
+
+    BVHStats stats() const;
+
+private:
+    static constexpr uint32_t invalid = ~0u;
+    static constexpr int width = 4;
+
+    // One cache line. Per axis, child i spans origin + lower * 2^exponent to origin + upper * 2^exponent.
+    struct alignas(64) WideNode {
+        float origin[3];
+        int8_t exponent[3];
+        // Bit i is set when child i exists, children always fill the first slots. Zero for a subtree a lazy build
+        // left, which covers ordered[child[0], child[1]) until it is expanded.
+        uint8_t valid;
+        uint8_t lower[3][width];
+        uint8_t upper[3][width];
+        // Interior children: index of the child node. Leaves: first primitive in ordered.
+        uint32_t child[width];
+        // Primitives in each leaf child, 0 for interior children.
+        uint8_t count[width];
+        uint32_t parent;
+    };
+    static_assert(sizeof(WideNode) == 64, "WideNode should fill exactly one cache line");
+
+    // Only used by refit, kept apart so that traversal touches nothing but WideNode.
+    struct NodeInfo {
+        // SAH cost of the subtree for a ray that hits the node, currently and when the subtree was last built.
+        float cost;
+        float builtCost;
+        uint32_t depth;
+    };
+
+    struct PrimRef {
+        AABB bounds;
+        vec3d centroid;
+        uint32_t index;
+    };
+
+    struct BuildContext;
+
+    void rebuild(ThreadPool* threadPool, bool lazy = false);
+    void buildTree(uint32_t root, BuildContext& ctx);
+    void buildNode(uint32_t node, size_t begin, size_t end, uint32_t depth, BuildContext& ctx, bool onCaller);
+    void collapse(uint32_t node, uint32_t binary, BuildContext& ctx, bool onCaller);
+    // Returns the node's valid mask, which is only stored when publish is set.
+    uint8_t quantize(uint32_t node, const std::array<AABB, width>& bounds, int children, bool publish = true);
+    AABB childBounds(const WideNode& node, int i) const;
+    AABB nodeBounds(uint32_t node) const;
+    void rebuildSubtree(uint32_t node, ThreadPool* threadPool);
+    void buildSubtree(uint32_t node, size_t begin, size_t end, ThreadPool* threadPool);
+    void expand(uint32_t node) const;
+    void expandAll(ThreadPool* threadPool);
+    void refitNode(uint32_t node);
+    void updateCost(uint32_t node);
+    void updateCosts(uint32_t root);
+
+    // Traversals behind intersect and occluded, inlined into each CPU path's kernel, see CpuDispatch.h.
+    BV_CPU_INLINE bool closestHit(const Ray& ray, Hit& hit, double tMin, double tMax) const;
+    BV_CPU_INLINE bool anyHit(const Ray& ray, double tMin, double tMax) const;
+
+    // Every node of a build is carved out of this array, sized up front, by bumping nextNode.
+    std::vector<WideNode> nodes;
+    std::vector<NodeInfo> info;
+    std::atomic<uint32_t> nextNode{0};
+    // Primitives in leaf order, and the index each had in the vector given to build.
+    std::vector<Geometry*> ordered;
+    std::vector<uint32_t> indices;
+    // Primitives in build order and the node whose leaf holds each of them.
+    std::vector<Geometry*> source;
+    std::vector<uint32_t> leafOf;
+    // Nodes orphaned by subtree rebuilds, the tree is rebuilt once they are half the array.
+    size_t garbage = 0;
+    std::vector<uint8_t> marks;
+    double buildMilliseconds = 0.0;
+    // Subtrees of a lazy build still to be expanded, and the locks expanding them, picked by node index.
+    std::atomic<size_t> unexpanded{0};
+    mutable std::array<std::mutex, 64> expandMutexes;
+};
+}
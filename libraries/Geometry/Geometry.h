@@ -2,10 +2,14 @@
 
 #include <memory>
 
+#include <glm/mat4x4.hpp>
+
 #include "GlmTypes.h"
+#include "Material.h"
 
 namespace bv {
 
+struct AABB;
 struct Hit;
 struct Ray;
 
@@ -13,12 +17,46 @@ class Geometry {
 public:
     virtual bool intersect(const Ray& ray, Hit& hit, double tMin, double tMax) = 0;
 
+    // Returns true iff intersect would report a hit in [tMin, tMax], without computing any hit data.
+    virtual bool occluded(const Ray& ray, double tMin, double tMax) const = 0;
+
+    virtual AABB bounds() const = 0;
+
+    // Moves the primitive by an affine transform. A sphere's radius is scaled by the cube root of the determinant,
+    // so spheres are only exact under uniform scales.
+    virtual void transform(const mat4d& m) = 0;
+
+    // Corners of a primitive that is a single triangle, for rasterizing it. Returns false for anything else.
+    virtual bool vertices(vec3d&, vec3d&, vec3d&) const {
+        return false;
+    }
+
+    // Material of a primitive made of a single one. Returns false when it varies over the surface.
+    virtual bool uniformMaterial(MaterialId&) const {
+        return false;
+    }
+
     virtual ~Geometry() = 0;
 };
 
-class Material;
-
-std::shared_ptr<Geometry> createTriangle(const vec3d& v1, const vec3d& v2, const vec3d& v3, const std::shared_ptr<Material>& material);
-std::shared_ptr<Geometry> createSphere(const vec3d& centre, double radius, const std::shared_ptr<Material>& material);
+// Triangles intersect with the kernel picked by the TRIANGLE_KERNEL CMake option, Möller-Trumbore by default.
+std::shared_ptr<Geometry> createTriangle(const vec3d& v1, const vec3d& v2, const vec3d& v3, MaterialId material);
+std::shared_ptr<Geometry> createTriangle(const vec3d& v1, const vec3d& v2, const vec3d& v3,
+                                         const vec2d& uv1, const vec2d& uv2, const vec2d& uv3,
+                                         MaterialId material);
+
+// Kernels of TriangleKernels.h.
+class MollerTrumbore;
+class BaldwinWeber;
+class Plucker;
+class Watertight;
+
+// A triangle intersected with a given kernel, whichever one createTriangle uses. Available for the four above.
+template <typename Kernel>
+std::shared_ptr<Geometry> createTriangleWith(const vec3d& v1, const vec3d& v2, const vec3d& v3,
+                                             const vec2d& uv1, const vec2d& uv2, const vec2d& uv3,
+                                             MaterialId material);
+
+std::shared_ptr<Geometry> createSphere(const vec3d& centre, double radius, MaterialId material);
 }
 
@@ -1,8 +1,60 @@
 #include "GeometryUtils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "glm/geometric.hpp"
+
 namespace bv {
 void Hit::correctNormal(const vec3d& rayDir) {
     frontFacing = glm::dot(rayDir, normal) < 0.0;
     normal = frontFacing ? normal : -normal;
 }
-}
\ No newline at end of file
+
+void Hit::setFootprint(const Ray& ray) {
+    const double rayLength = glm::length(ray.dir);
+    const double width = ray.coneWidth + t * rayLength * ray.coneSpread;
+    const double cosine = std::fabs(glm::dot(ray.dir, normal)) / (rayLength * glm::length(normal));
+
+    footprint = width / std::max(cosine, 1e-3);
+}
+
+namespace {
+std::mt19937& generator() {
+    static thread_local std::mt19937 generator{
+        static_cast<std::mt19937::result_type>(std::hash<std::thread::id>{}(std::this_thread::get_id()))};
+    return generator;
+}
+}
+
+double randomDouble() {
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(generator());
+}
+
+double randomDouble(const double min, const double max) {
+    return min + (max - min) * randomDouble();
+}
+
+vec3d randomUnitVector() {
+    const double z = randomDouble(-1.0, 1.0);
+    const double phi = randomDouble(0.0, 2.0 * M_PI);
+    const double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+    return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+void seedRandom(const uint64_t seed) {
+    std::seed_seq sequence{uint32_t(seed), uint32_t(seed >> 32)};
+    generator().seed(sequence);
+}
+
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+}
@@ -1,16 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <memory>
 
+#include <glm/common.hpp>
+
 #include "GlmTypes.h"
+#include "Material.h"
 
 namespace bv {
 struct Ray {
     vec3d start;
     vec3d dir;
-};
 
-class Material;
+    // Ray cone used to pick texture LOD: width at the origin and spread angle per unit of t * |dir|.
+    double coneWidth = 0.0;
+    double coneSpread = 0.0;
+};
 
 struct Hit {
     double t;
@@ -18,9 +26,70 @@ struct Hit {
     vec3d normal;
     bool frontFacing;
     vec3f colour;
-    std::shared_ptr<Material> material;
+    MaterialId material;
+    // Index of the primitive hit in the scene it was added to, set by the acceleration structure.
+    uint32_t primitive;
+
+    // Surface parameterisation at the hit, uvDensity is UV area per unit of surface area.
+    vec2d uv;
+    double uvDensity;
+    // Width of the incoming ray cone at the hit, projected onto the surface.
+    double footprint;
 
     void correctNormal(const vec3d& rayDir);
+
+    void setFootprint(const Ray& ray);
+};
+
+// Axis aligned bounding box, empty (min > max) until something is added to it.
+struct AABB {
+    vec3d min{std::numeric_limits<double>::infinity()};
+    vec3d max{-std::numeric_limits<double>::infinity()};
+
+    void extend(const vec3d& p) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void extend(const AABB& b) {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    bool empty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    vec3d centroid() const {
+        return 0.5 * (min + max);
+    }
+
+    double surfaceArea() const {
+        if (empty())
+            return 0.0;
+
+        const vec3d d = max - min;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Slab test against [tMin, tMax]. invDir is 1 / ray.dir, tEntry receives the distance the ray enters the box.
+    bool intersect(const vec3d& start, const vec3d& invDir, const double tMin, const double tMax, double& tEntry) const {
+        double t0 = tMin;
+        double t1 = tMax;
+        for (int axis = 0; axis < 3; ++axis) {
+            double tNear = (min[axis] - start[axis]) * invDir[axis];
+            double tFar = (max[axis] - start[axis]) * invDir[axis];
+            if (tNear > tFar)
+                std::swap(tNear, tFar);
+
+            // A NaN from 0 * inf (origin on a slab of a flat box) leaves the interval unchanged.
+            t0 = std::max(t0, tNear);
+            t1 = std::min(t1, tFar);
+        }
+
+        tEntry = t0;
+        return t0 <= t1;
+    }
 };
 
 template <typename T>
@@ -32,7 +101,7 @@ template <typename T>
 vec3<T> refract(const vec3<T>& v, const vec3<T>& n, const T etaOverEtaP) {
     const auto cosTheta = std::fmin(glm::dot(-v, n), T(1.0));
     const auto rPrimePerp = etaOverEtaP * (v + cosTheta * n);
-    const auto rPrimeParallel = -std::sqrt(T(1.0) - glm::dot(rPrimePerp, rPrimePerp));
+    const auto rPrimeParallel = -std::sqrt(std::fabs(T(1.0) - glm::dot(rPrimePerp, rPrimePerp))) * n;
     return rPrimePerp + rPrimeParallel;
 }
 
@@ -42,4 +111,17 @@ T reflectance(const T cosine, const T etaOverEtaP) {
     r0 = r0 * r0;
     return r0 + (T(1.0) - r0) * std::pow((T(1.0) - cosine), T(5.0));
 }
-}
\ No newline at end of file
+
+// Uniform samples from the calling thread's generator. Each worker owns one, tiles are traced concurrently.
+double randomDouble();
+double randomDouble(double min, double max);
+
+// Point on the unit sphere.
+vec3d randomUnitVector();
+
+// Restarts the calling thread's random sequence, so work seeded per tile is reproducible whichever worker runs it.
+void seedRandom(uint64_t seed);
+
+// splitmix64 finaliser. Spreads consecutive numbers, such as tile or pass indices, over unrelated seeds and hashes.
+uint64_t mix(uint64_t x);
+}
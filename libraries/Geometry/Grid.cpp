@@ -0,0 +1,262 @@
+#include "Grid.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "Geometry.h"
+#include "ParallelChunks.h"
+
+namespace bv {
+
+namespace {
+// Primitives per chunk of a parallel pass over them, and cells per chunk when sorting cell lists.
+constexpr size_t primitiveGrain = 1 << 13;
+constexpr size_t cellGrain = 1 << 14;
+// Bound on cells per axis, and so on memory, for scenes whose primitives are spread very unevenly.
+constexpr int maxResolution = 1024;
+// Primitives a ray remembers having tested, indexed by the low bits of their index. A power of two.
+constexpr uint32_t mailboxSize = 16;
+constexpr uint32_t emptyMailbox = ~0u;
+
+struct CellRange {
+    int lower[3];
+    int upper[3];
+};
+
+size_t chunksOf(const size_t count, const size_t grain) {
+    return (count + grain - 1) / grain;
+}
+}
+
+void UniformGrid::build(const std::vector<std::shared_ptr<Geometry>>& geometry, ThreadPool* threadPool,
+                        const double cellsPerPrimitive) {
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t n = geometry.size();
+    primitives.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        primitives[i] = geometry[i].get();
+
+    bounds = AABB{};
+    cellStart.clear();
+    cellPrimitives.clear();
+    std::fill(resolution, resolution + 3, 0);
+
+    if (n == 0)
+        return;
+
+    if (n >= std::numeric_limits<uint32_t>::max())
+        throw std::length_error("Too many primitives for a grid");
+
+    // Bounds are read once, the binning passes below use them twice.
+    std::vector<AABB> primitiveBounds(n);
+    std::vector<AABB> chunkBounds(chunksOf(n, primitiveGrain));
+    parallelChunks(threadPool, chunkBounds.size(), [&](const size_t c) {
+        const size_t end = std::min(n, (c + 1) * primitiveGrain);
+        for (size_t i = c * primitiveGrain; i < end; ++i) {
+            primitiveBounds[i] = primitives[i]->bounds();
+            chunkBounds[c].extend(primitiveBounds[i]);
+        }
+    });
+    for (const auto& b : chunkBounds)
+        bounds.extend(b);
+
+    //
+    // Flat axes, such as a single layer of particles, are given a sliver of thickness so the cell count can be worked
+    // out from a volume. Cells are then about cubes of cellsPerPrimitive per primitive.
+    //
+    vec3d extent = bounds.max - bounds.min;
+    const double largest = std::max({extent.x, extent.y, extent.z, 1e-12});
+    extent = glm::max(extent, vec3d(largest * 1e-6));
+    bounds.max = bounds.min + extent;
+
+    const double scale = std::cbrt(std::max(cellsPerPrimitive, 1e-3) * double(n) / (extent.x * extent.y * extent.z));
+    for (int axis = 0; axis < 3; ++axis)
+        resolution[axis] = std::clamp(int(std::ceil(extent[axis] * scale)), 1, maxResolution);
+
+    cellSize = extent / vec3d(resolution[0], resolution[1], resolution[2]);
+    inverseCellSize = 1.0 / cellSize;
+
+    const size_t cells = size_t(resolution[0]) * size_t(resolution[1]) * size_t(resolution[2]);
+
+    const auto cellOf = [this](const double p, const int axis) {
+        return std::clamp(int((p - bounds.min[axis]) * inverseCellSize[axis]), 0, resolution[axis] - 1);
+    };
+
+    // Counts of each cell, summed into the first primitive of each cell once all are counted.
+    cellStart.assign(cells + 1, 0);
+    std::vector<CellRange> ranges(n);
+
+    parallelChunks(threadPool, chunksOf(n, primitiveGrain), [&](const size_t c) {
+        const size_t end = std::min(n, (c + 1) * primitiveGrain);
+        for (size_t i = c * primitiveGrain; i < end; ++i) {
+            auto& range = ranges[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                range.lower[axis] = cellOf(primitiveBounds[i].min[axis], axis);
+                range.upper[axis] = cellOf(primitiveBounds[i].max[axis], axis);
+            }
+
+            for (int z = range.lower[2]; z <= range.upper[2]; ++z)
+                for (int y = range.lower[1]; y <= range.upper[1]; ++y)
+                    for (int x = range.lower[0]; x <= range.upper[0]; ++x)
+                        __atomic_fetch_add(&cellStart[cellIndex(x, y, z)], 1u, __ATOMIC_RELAXED);
+        }
+    });
+
+    uint64_t references = 0;
+    for (size_t cell = 0; cell <= cells; ++cell) {
+        const uint32_t count = cellStart[cell];
+        cellStart[cell] = uint32_t(references);
+        references += count;
+        if (references > std::numeric_limits<uint32_t>::max())
+            throw std::length_error("Too many primitive references for a grid, primitives overlap too many cells");
+    }
+
+    //
+    // Scattered in whatever order threads get there, then each cell's list is sorted so that traversal, and with it
+    // which of two equally near hits is reported, does not depend on it.
+    //
+    cellPrimitives.resize(references);
+    std::vector<uint32_t> cursor(cellStart.begin(), cellStart.end() - 1);
+
+    parallelChunks(threadPool, chunksOf(n, primitiveGrain), [&](const size_t c) {
+        const size_t end = std::min(n, (c + 1) * primitiveGrain);
+        for (size_t i = c * primitiveGrain; i < end; ++i) {
+            const auto& range = ranges[i];
+            for (int z = range.lower[2]; z <= range.upper[2]; ++z)
+                for (int y = range.lower[1]; y <= range.upper[1]; ++y)
+                    for (int x = range.lower[0]; x <= range.upper[0]; ++x)
+                        cellPrimitives[__atomic_fetch_add(&cursor[cellIndex(x, y, z)], 1u, __ATOMIC_RELAXED)] =
+                            uint32_t(i);
+        }
+    });
+
+    parallelChunks(threadPool, chunksOf(cells, cellGrain), [&](const size_t c) {
+        const size_t end = std::min(cells, (c + 1) * cellGrain);
+        for (size_t cell = c * cellGrain; cell < end; ++cell)
+            std::sort(cellPrimitives.begin() + cellStart[cell], cellPrimitives.begin() + cellStart[cell + 1]);
+    });
+
+    buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <bool anyHit>
+BV_CPU_INLINE bool UniformGrid::traverse(const Ray& ray, Hit* hit, const double tMin, const double tMax) const {
+    if (cellPrimitives.empty())
+        return false;
+
+    const vec3d invDir = 1.0 / ray.dir;
+    double tEntry;
+    if (!bounds.intersect(ray.start, invDir, tMin, tMax, tEntry))
+        return false;
+
+    //
+    // 3D-DDA (Amanatides and Woo 1987): per axis, the distance along the ray to the next cell boundary and between
+    // boundaries. The ray steps into the neighbour across whichever boundary is nearest.
+    //
+    const vec3d entry = ray.start + tEntry * ray.dir;
+    int cell[3];
+    int step[3];
+    int stop[3];
+    double tNext[3];
+    double tDelta[3];
+
+    for (int axis = 0; axis < 3; ++axis) {
+        cell[axis] = std::clamp(int((entry[axis] - bounds.min[axis]) * inverseCellSize[axis]), 0,
+                                resolution[axis] - 1);
+
+        if (ray.dir[axis] > 0.0) {
+            step[axis] = 1;
+            stop[axis] = resolution[axis];
+            tNext[axis] = (bounds.min[axis] + (cell[axis] + 1) * cellSize[axis] - ray.start[axis]) * invDir[axis];
+            tDelta[axis] = cellSize[axis] * invDir[axis];
+        } else if (ray.dir[axis] < 0.0) {
+            step[axis] = -1;
+            stop[axis] = -1;
+            tNext[axis] = (bounds.min[axis] + cell[axis] * cellSize[axis] - ray.start[axis]) * invDir[axis];
+            tDelta[axis] = -cellSize[axis] * invDir[axis];
+        } else {
+            step[axis] = 0;
+            stop[axis] = -1;
+            tNext[axis] = std::numeric_limits<double>::infinity();
+            tDelta[axis] = std::numeric_limits<double>::infinity();
+        }
+    }
+
+    uint32_t mailbox[mailboxSize];
+    std::fill(mailbox, mailbox + mailboxSize, emptyMailbox);
+
+    double closest = tMax;
+    bool found = false;
+
+    for (;;) {
+        const uint32_t c = cellIndex(cell[0], cell[1], cell[2]);
+        for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; ++k) {
+            const uint32_t p = cellPrimitives[k];
+
+            // Tested in an earlier cell, against a limit no nearer than the current one.
+            uint32_t& seen = mailbox[p & (mailboxSize - 1)];
+            if (seen == p)
+                continue;
+            seen = p;
+
+            if constexpr (anyHit) {
+                if (primitives[p]->occluded(ray, tMin, tMax))
+                    return true;
+            } else if (primitives[p]->intersect(ray, *hit, tMin, closest)) {
+                closest = hit->t;
+                hit->primitive = p;
+                found = true;
+            }
+        }
+
+        //
+        // A hit found so far may lie in a cell further on, as primitives are listed in every cell they overlap, but
+        // once the ray leaves the cell beyond it no later cell can hold a nearer one.
+        //
+        const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (tNext[axis] >= closest)
+            return found;
+
+        cell[axis] += step[axis];
+        if (cell[axis] == stop[axis])
+            return found;
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+bool UniformGrid::intersect(const Ray& ray, Hit& hit, const double tMin, const double tMax) const {
+    return dispatchCpu([&]() BV_CPU_KERNEL {
+        return traverse<false>(ray, &hit, tMin, tMax);
+    });
+}
+
+bool UniformGrid::occluded(const Ray& ray, const double tMin, const double tMax) const {
+    return dispatchCpu([&]() BV_CPU_KERNEL {
+        return traverse<true>(ray, nullptr, tMin, tMax);
+    });
+}
+
+BVHStats UniformGrid::stats() const {
+    BVHStats stats;
+    stats.primitives = primitives.size();
+    stats.buildMilliseconds = buildMilliseconds;
+    stats.bytes = (cellStart.size() + cellPrimitives.size()) * sizeof(uint32_t) + primitives.size() * sizeof(Geometry*);
+
+    if (cellStart.empty())
+        return stats;
+
+    stats.nodes = cellStart.size() - 1;
+    for (size_t cell = 0; cell < stats.nodes; ++cell) {
+        const uint32_t count = cellStart[cell + 1] - cellStart[cell];
+        if (count > 0)
+            stats.leaves++;
+        stats.maxDepth = std::max(stats.maxDepth, count);
+    }
+
+    return stats;
+}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BVH.h"
+#include "GeometryUtils.h"
+
+namespace bv {
+class Geometry;
+class ThreadPool;
+
+// Uniform grid over the bounds of a scene, with about cellsPerPrimitive cells per primitive shaped to be near cubes.
+// Each cell lists every primitive whose bounds overlap it. A ray walks the cells it crosses in order with a 3D-DDA
+// and stops at the first cell whose far side lies beyond its closest hit, so it suits many primitives of similar
+// size, such as particles, and degrades with primitives much larger than a cell or scenes of mostly empty space.
+//
+// The build is a counting sort of primitives into cells, spread over the pool: primitives are counted into cells,
+// the counts are summed into offsets and the primitives scattered to them, then each cell's list is sorted so that the
+// result does not depend on the order threads got there. A ray remembers the last primitives it tested in a small
+// mailbox, so one spanning several of the cells it crosses is usually only tested once.
+class UniformGrid {
+public:
+    UniformGrid() = default;
+
+    void build(const std::vector<std::shared_ptr<Geometry>>& primitives, ThreadPool* threadPool = nullptr,
+               double cellsPerPrimitive = 1.0);
+
+    bool intersect(const Ray& ray, Hit& hit, double tMin, double tMax) const;
+
+    bool occluded(const Ray& ray, double tMin, double tMax) const;
+
+    // Cells are reported as nodes and those holding primitives as leaves, maxDepth is the most primitives in a cell.
+    BVHStats stats() const;
+
+private:
+    // Inlined into each CPU path's kernel, see CpuDispatch.h.
+    template <bool anyHit>
+    BV_CPU_INLINE bool traverse(const Ray& ray, Hit* hit, double tMin, double tMax) const;
+
+    uint32_t cellIndex(int x, int y, int z) const {
+        return uint32_t((size_t(z) * size_t(resolution[1]) + size_t(y)) * size_t(resolution[0]) + size_t(x));
+    }
+
+    AABB bounds;
+    int resolution[3] = {0, 0, 0};
+    vec3d cellSize{0.0};
+    vec3d inverseCellSize{0.0};
+    // Primitives of cell i are cellPrimitives[cellStart[i], cellStart[i + 1]), as indices into primitives.
+    std::vector<uint32_t> cellStart;
+    std::vector<uint32_t> cellPrimitives;
+    std::vector<Geometry*> primitives;
+    double buildMilliseconds = 0.0;
+};
+}
@@ -1,99 +1,178 @@
 #include "Material.h"
 
 #include <algorithm>
-#include <random>
+#include <functional>
 
-#include "glm/gtc/random.hpp"
 #include "glm/gtc/epsilon.hpp"
 
 #include "GeometryUtils.h"
+#include "Texture.h"
 
 namespace bv {
 
-class LambertianMaterial : public Material {
-public:
-    LambertianMaterial(const vec3f& colour) : colour(colour) {}
+namespace {
+vec3f surfaceColour(const vec3f& colour, const Texture* texture, const Hit& hit) {
+    return texture ? texture->sample(hit.uv, hit.footprint, hit.uvDensity) : colour;
+}
 
-    bool scatter(const Ray&, const Hit& hit, vec3f& attenuation, Ray& scattered) const override {
-        scattered.start = hit.pos;
-        scattered.dir = hit.normal + glm::sphericalRand(1.0);
+// Scattered rays start with the cone width at the hit. Specular bounces keep the incoming spread, glossy and
+// diffuse ones widen it so later hits sample coarser mip levels.
+void propagateCone(const Ray& ray, const Hit& hit, const double spread, Ray& scattered) {
+    scattered.coneWidth = hit.footprint;
+    scattered.coneSpread = ray.coneSpread + spread;
+}
 
-        if (glm::all(glm::epsilonEqual(scattered.dir, {0.0, 0.0, 0.0}, 1e-8))) {
-            scattered.dir = hit.normal;
-        }
+bool scatterLambertian(const vec3f& colour, const Texture* texture, const Ray& ray, const Hit& hit,
+                       vec3f& attenuation, Ray& scattered) {
+    scattered.start = hit.pos;
+    scattered.dir = hit.normal + randomUnitVector();
 
-        attenuation = colour;
-        return true;
+    if (glm::all(glm::epsilonEqual(scattered.dir, {0.0, 0.0, 0.0}, 1e-8))) {
+        scattered.dir = hit.normal;
     }
 
-    ~LambertianMaterial() = default;
+    propagateCone(ray, hit, 1.0, scattered);
 
-private:
-    vec3f colour;
-};
+    attenuation = surfaceColour(colour, texture, hit);
+    return true;
+}
 
-class Metal : public Material {
-public:
-    Metal(const vec3f& albedo, const double fuzz) : albedo(albedo), fuzz(std::clamp(fuzz, 0.0, 1.0)) {}
+bool scatterMetal(const vec3f& albedo, const double fuzz, const Texture* texture, const Ray& ray, const Hit& hit,
+                  vec3f& attenuation, Ray& scattered) {
+    const auto reflectedRay = reflect(glm::normalize(ray.dir), glm::normalize(hit.normal));
 
-    bool scatter(const Ray& ray, const Hit& hit, vec3f& attenuation, Ray& scattered) const override {
-        const auto reflectedRay = reflect(glm::normalize(ray.dir), glm::normalize(hit.normal));
+    scattered.start = hit.pos;
+    scattered.dir = reflectedRay + fuzz * randomUnitVector();
 
-        scattered.start = hit.pos;
-        scattered.dir = reflectedRay + fuzz * glm::sphericalRand(1.0);
+    propagateCone(ray, hit, fuzz, scattered);
 
-        attenuation = albedo;
+    attenuation = surfaceColour(albedo, texture, hit);
 
-        return glm::dot(scattered.dir, hit.normal) > 0;
-    }
+    return glm::dot(scattered.dir, hit.normal) > 0;
+}
+
+bool scatterDielectric(const double indexOfRefraction, const Ray& ray, const Hit& hit, vec3f& attenuation,
+                       Ray& scattered) {
+    attenuation = vec3f{1.0f, 1.0f, 1.0f};
+
+    const auto etaOverEtaP = hit.frontFacing ? 1.0 / indexOfRefraction : indexOfRefraction;
 
-    ~Metal() = default;
+    // Snell's law and Fresnel need the cosine between unit vectors.
+    const auto dir = glm::normalize(ray.dir);
+    const auto normal = glm::normalize(hit.normal);
 
-private:
-    vec3f albedo;
-    double fuzz;
-};
+    const auto cosTheta = std::fmin(glm::dot(-dir, normal), 1.0);
+    const auto sinTheta = std::sqrt(1 - cosTheta * cosTheta);
 
-class Dielectric : public Material {
-public:
-    Dielectric(const double indexOfRefraction) : indexOfRefraction(indexOfRefraction) {}
+    scattered.start = hit.pos;
+    propagateCone(ray, hit, 0.0, scattered);
 
-    bool scatter(const Ray& ray, const Hit& hit, vec3f& attenuation, Ray& scattered) const override {
-        attenuation = vec3f{1.0f, 1.0f, 1.0f};
+    if (etaOverEtaP * sinTheta > 1.0 || reflectance(cosTheta, etaOverEtaP) > randomDouble()) {
+        scattered.dir = reflect(dir, normal);
+    } else {
+        scattered.dir = refract(dir, normal, etaOverEtaP);
+    }
 
-        const auto etaOverEtaP = hit.frontFacing ? 1.0 / indexOfRefraction : indexOfRefraction;
+    return true;
+}
+}
 
-        const auto cosTheta = std::fmin(glm::dot(-ray.dir, hit.normal), 1.0);
-        const auto sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+bool MaterialTable::Record::operator==(const Record& other) const {
+    return type == other.type && colour == other.colour && parameter == other.parameter && texture == other.texture;
+}
 
-        scattered.start = hit.pos;
+size_t MaterialTable::RecordHash::operator()(const Record& record) const {
+    size_t h = std::hash<int>{}(int(record.type));
+    const auto combine = [&h](const size_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    };
+    combine(std::hash<float>{}(record.colour.x));
+    combine(std::hash<float>{}(record.colour.y));
+    combine(std::hash<float>{}(record.colour.z));
+    combine(std::hash<float>{}(record.parameter));
+    combine(std::hash<int32_t>{}(record.texture));
+    return h;
+}
 
-        if (etaOverEtaP * sinTheta > 1.0 || reflectance(cosTheta, etaOverEtaP) > dist(mt)) {
-            scattered.dir = reflect(ray.dir, hit.normal);
-        } else {
-            scattered.dir = refract(glm::normalize(ray.dir), hit.normal, etaOverEtaP);
-        }
+MaterialId MaterialTable::intern(const Material& material) {
+    int32_t texture = -1;
+    if (material.texture) {
+        const auto it = std::find(textures.begin(), textures.end(), material.texture);
+        texture = static_cast<int32_t>(it - textures.begin());
+        if (it == textures.end())
+            textures.push_back(material.texture);
+    }
 
-        return true;
+    Record record{};
+    record.type = material.type;
+    record.texture = texture;
+
+    // Only the fields a type reads take part in the comparison.
+    switch (material.type) {
+        case MaterialType::Lambertian:
+            record.colour = material.colour;
+            break;
+        case MaterialType::Metal:
+            record.colour = material.colour;
+            record.parameter = std::clamp(material.fuzz, 0.0f, 1.0f);
+            break;
+        case MaterialType::Dielectric:
+            record.parameter = material.indexOfRefraction;
+            break;
     }
 
-private:
-    double indexOfRefraction;
-    mutable std::mt19937_64 mt{};
-    mutable std::uniform_real_distribution<double> dist{0.0, 1.0};
-};
+    const auto existing = ids.find(record);
+    if (existing != ids.end())
+        return existing->second;
 
-std::shared_ptr<Material> createLambertianMaterial(const vec3f &colour) {
-    return std::make_shared<LambertianMaterial>(colour);
+    const auto id = static_cast<MaterialId>(records.size());
+    records.push_back(record);
+    ids.emplace(record, id);
+    return id;
 }
 
-std::shared_ptr<Material> createMetalMaterial(const vec3f &colour, const double fuzz) {
-    return std::make_shared<Metal>(colour, fuzz);
+bool MaterialTable::scatter(const MaterialId id, const Ray& ray, const Hit& hit, vec3f& attenuation,
+                            Ray& scattered) const {
+    const auto& record = records[id];
+    const Texture* texture = record.texture >= 0 ? textures[record.texture].get() : nullptr;
+
+    switch (record.type) {
+        case MaterialType::Lambertian:
+            return scatterLambertian(record.colour, texture, ray, hit, attenuation, scattered);
+        case MaterialType::Metal:
+            return scatterMetal(record.colour, record.parameter, texture, ray, hit, attenuation, scattered);
+        case MaterialType::Dielectric:
+            return scatterDielectric(record.parameter, ray, hit, attenuation, scattered);
+    }
+
+    return false;
+}
+
+bool MaterialTable::diffuse(const MaterialId id) const {
+    return records[id].type == MaterialType::Lambertian;
+}
+
+size_t MaterialTable::size() const {
+    return records.size();
+}
+
+Material createLambertianMaterial(const vec3f &colour) {
+    return {MaterialType::Lambertian, colour, 0.0f, 1.0f, nullptr};
 }
 
-std::shared_ptr<Material> createDielectricMaterial(const double indexOfRefraction) {
-    return std::make_shared<Dielectric>(indexOfRefraction);
+Material createLambertianMaterial(const std::shared_ptr<Texture>& texture) {
+    return {MaterialType::Lambertian, vec3f(1.0f, 1.0f, 1.0f), 0.0f, 1.0f, texture};
 }
 
-    Material::~Material() = default;
-}
\ No newline at end of file
+Material createMetalMaterial(const vec3f &colour, const double fuzz) {
+    return {MaterialType::Metal, colour, float(fuzz), 1.0f, nullptr};
+}
+
+Material createMetalMaterial(const std::shared_ptr<Texture>& texture, const double fuzz) {
+    return {MaterialType::Metal, vec3f(1.0f, 1.0f, 1.0f), float(fuzz), 1.0f, texture};
+}
+
+Material createDielectricMaterial(const double indexOfRefraction) {
+    return {MaterialType::Dielectric, vec3f(1.0f, 1.0f, 1.0f), 0.0f, float(indexOfRefraction), nullptr};
+}
+}
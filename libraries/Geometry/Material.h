@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "GlmTypes.h"
 
@@ -8,15 +11,64 @@ namespace bv {
 
 struct Hit;
 struct Ray;
+class Texture;
 
-class Material {
+enum class MaterialType : uint8_t {
+    Lambertian,
+    Metal,
+    Dielectric
+};
+
+// Value description of a material. Scenes intern these into their MaterialTable and primitives refer to the
+// interned copy by MaterialId.
+struct Material {
+    MaterialType type;
+    vec3f colour;
+    float fuzz;
+    float indexOfRefraction;
+    std::shared_ptr<Texture> texture;
+};
+
+using MaterialId = uint32_t;
+
+// Deduplicated, contiguous store of every material in a scene. Shading switches on the material type rather
+// than going through a vtable.
+class MaterialTable {
 public:
-    virtual bool scatter(const Ray& ray, const Hit& hit, vec3f& colour, Ray& scattered) const = 0;
+    // Returns the id of an identical material if one was interned before, otherwise appends it.
+    MaterialId intern(const Material& material);
+
+    bool scatter(MaterialId id, const Ray& ray, const Hit& hit, vec3f& attenuation, Ray& scattered) const;
+
+    // True for materials that scatter uniformly over the cosine weighted hemisphere, whose outgoing radiance only
+    // depends on the incoming radiance through the mean it sees there.
+    bool diffuse(MaterialId id) const;
+
+    size_t size() const;
+
+private:
+    struct Record {
+        vec3f colour;
+        // Metal fuzz or dielectric index of refraction.
+        float parameter;
+        int32_t texture;
+        MaterialType type;
+
+        bool operator==(const Record& other) const;
+    };
+
+    struct RecordHash {
+        size_t operator()(const Record& record) const;
+    };
 
-    virtual ~Material() = 0;
+    std::vector<Record> records;
+    std::vector<std::shared_ptr<Texture>> textures;
+    std::unordered_map<Record, MaterialId, RecordHash> ids;
 };
 
-std::shared_ptr<Material> createLambertianMaterial(const vec3f& colour);
-std::shared_ptr<Material> createMetalMaterial(const vec3f& colour, double fuzz);
-std::shared_ptr<Material> createDielectricMaterial(const double indexOfRefraction);
+Material createLambertianMaterial(const vec3f& colour);
+Material createLambertianMaterial(const std::shared_ptr<Texture>& texture);
+Material createMetalMaterial(const vec3f& colour, double fuzz);
+Material createMetalMaterial(const std::shared_ptr<Texture>& texture, double fuzz);
+Material createDielectricMaterial(const double indexOfRefraction);
 }
@@ -1,55 +1,257 @@
 #include "Scenes.h"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+#include "BVH.h"
+#include "Grid.h"
 #include "Material.h"
 #include "Geometry.h"
 #include "GeometryUtils.h"
+#include "ParallelChunks.h"
 
 namespace bv {
 
+namespace {
+// Rays per chunk of a batched query spread over a pool.
+constexpr size_t batchGrain = 256;
+
+Ray batchRay(const RayBatch& rays, const size_t i) {
+    return Ray{{rays.originX[i], rays.originY[i], rays.originZ[i]}, {rays.dirX[i], rays.dirY[i], rays.dirZ[i]}};
+}
+
+size_t batchChunks(const RayBatch& rays) {
+    return (rays.count + batchGrain - 1) / batchGrain;
+}
+}
+
 class Scene::Impl {
 public:
-    Impl() = default;
+    Impl(const Accelerator kind) : kind(kind) {}
 
-    void add(const std::shared_ptr<Geometry>& g) {
+    size_t add(const std::shared_ptr<Geometry>& g) {
         geometry.emplace_back(g);
+        built = false;
+        return geometry.size() - 1;
+    }
+
+    void transform(const size_t index, const mat4d& m) {
+        geometry.at(index)->transform(m);
+        moved.push_back(static_cast<uint32_t>(index));
+    }
+
+    size_t size() const {
+        return geometry.size();
+    }
+
+    Geometry& primitive(const size_t index) const {
+        return *geometry[index];
+    }
+
+    void build(ThreadPool* threadPool, const bool lazy) {
+        std::lock_guard lk(buildMutex);
+        if (kind == Accelerator::Grid)
+            grid.build(geometry, threadPool);
+        else
+            bvh.build(geometry, threadPool, lazy);
+        built.store(true, std::memory_order_release);
+    }
+
+    BVHStats stats() const {
+        return withAccelerator([](const auto& accelerator) {
+            return accelerator.stats();
+        });
+    }
+
+    void update(ThreadPool* threadPool) {
+        // Before the first query there is nothing to refit, the build will see the new positions.
+        if (built && kind == Accelerator::Grid) {
+            // Rebuilt whole, binning is about as fast as refitting a tree.
+            if (!moved.empty())
+                grid.build(geometry, threadPool);
+        } else if (built) {
+            bvh.refit(moved, threadPool);
+        }
+        moved.clear();
     }
 
     bool intersect(const Ray &ray, Hit &hit, const double tMin, const double tMax) {
-        auto closestDist = std::numeric_limits<double>::max();
-        bool intersection = false;
-
-        for (const auto& g : geometry) {
-            Hit hit_{};
-            if (g->intersect(ray, hit_, tMin, tMax)) {
-                if (hit_.t < closestDist) {
-                    intersection = true;
-                    hit = hit_;
-                    closestDist = hit_.t;
-                }
+        return withAccelerator([&](const auto& accelerator) {
+            return accelerator.intersect(ray, hit, tMin, tMax);
+        });
+    }
+
+    bool occluded(const Ray& ray, const double tMin, const double tMax) const {
+        return withAccelerator([&](const auto& accelerator) {
+            return accelerator.occluded(ray, tMin, tMax);
+        });
+    }
+
+    void occluded(const std::vector<OcclusionQuery>& queries, std::vector<uint8_t>& results) const {
+        withAccelerator([&](const auto& accelerator) {
+            results.resize(queries.size());
+            for (size_t i = 0; i < queries.size(); ++i) {
+                const auto& q = queries[i];
+                results[i] = accelerator.occluded(q.ray, q.tMin, q.tMax) ? 1 : 0;
             }
-        }
+        });
+    }
 
-        return intersection;
+    void intersect(const RayBatch& rays, const HitBatch& hits, ThreadPool* threadPool) {
+        withAccelerator([&](const auto& accelerator) {
+            intersectBatch(accelerator, rays, hits, threadPool);
+        });
+    }
+
+    void occluded(const RayBatch& rays, uint8_t* occluded, ThreadPool* threadPool) const {
+        withAccelerator([&](const auto& accelerator) {
+            occludedBatch(accelerator, rays, occluded, threadPool);
+        });
     }
 
     ~Impl() = default;
 
+    MaterialTable materials;
+
 private:
+    template <typename Accel>
+    static void intersectBatch(const Accel& accelerator, const RayBatch& rays, const HitBatch& hits,
+                               ThreadPool* threadPool) {
+        parallelChunks(threadPool, batchChunks(rays), [&](const size_t c) {
+            const size_t end = std::min(rays.count, (c + 1) * batchGrain);
+            for (size_t i = c * batchGrain; i < end; ++i) {
+                Hit hit{};
+                if (!accelerator.intersect(batchRay(rays, i), hit, rays.tMin[i], rays.tMax[i])) {
+                    hits.primitive[i] = noPrimitive;
+                    continue;
+                }
+
+                hits.primitive[i] = hit.primitive;
+                if (hits.t)
+                    hits.t[i] = hit.t;
+                if (hits.normalX)
+                    hits.normalX[i] = hit.normal.x;
+                if (hits.normalY)
+                    hits.normalY[i] = hit.normal.y;
+                if (hits.normalZ)
+                    hits.normalZ[i] = hit.normal.z;
+                if (hits.u)
+                    hits.u[i] = hit.uv.x;
+                if (hits.v)
+                    hits.v[i] = hit.uv.y;
+                if (hits.material)
+                    hits.material[i] = hit.material;
+            }
+        });
+    }
+
+    template <typename Accel>
+    static void occludedBatch(const Accel& accelerator, const RayBatch& rays, uint8_t* occluded,
+                              ThreadPool* threadPool) {
+        parallelChunks(threadPool, batchChunks(rays), [&](const size_t c) {
+            const size_t end = std::min(rays.count, (c + 1) * batchGrain);
+            for (size_t i = c * batchGrain; i < end; ++i) {
+                occluded[i] = accelerator.occluded(batchRay(rays, i), rays.tMin[i], rays.tMax[i]) ? 1 : 0;
+            }
+        });
+    }
+
+    // Calls f with the scene's accelerator, built first if need be.
+    template <typename F>
+    auto withAccelerator(F&& f) const -> decltype(f(std::declval<const BVH&>())) {
+        // Built on the first query after the scene changes unless built explicitly. Render threads may race to get
+        // here, and may be the pool's own workers, so this build runs on the querying thread alone.
+        if (!built.load(std::memory_order_acquire)) {
+            std::lock_guard lk(buildMutex);
+            if (!built.load(std::memory_order_relaxed)) {
+                if (kind == Accelerator::Grid)
+                    grid.build(geometry);
+                else
+                    bvh.build(geometry);
+                built.store(true, std::memory_order_release);
+            }
+        }
+
+        if (kind == Accelerator::Grid)
+            return f(static_cast<const UniformGrid&>(grid));
+        return f(static_cast<const BVH&>(bvh));
+    }
+
+    Accelerator kind;
     std::vector<std::shared_ptr<Geometry>> geometry;
+    std::vector<uint32_t> moved;
+
+    mutable BVH bvh;
+    mutable UniformGrid grid;
+    mutable std::atomic<bool> built{false};
+    mutable std::mutex buildMutex;
 };
 
-Scene::Scene() : impl(std::make_unique<Impl>()) {}
+Scene::Scene(const Accelerator accelerator) : impl(std::make_unique<Impl>(accelerator)) {}
+
+size_t Scene::add(const std::shared_ptr<Geometry> &geometry) {
+    return impl->add(geometry);
+}
+
+void Scene::transform(const size_t index, const mat4d &transform) {
+    impl->transform(index, transform);
+}
+
+void Scene::build(ThreadPool *threadPool, const bool lazy) {
+    impl->build(threadPool, lazy);
+}
+
+BVHStats Scene::stats() const {
+    return impl->stats();
+}
+
+void Scene::update(ThreadPool *threadPool) {
+    impl->update(threadPool);
+}
 
-void Scene::add(const std::shared_ptr<Geometry> &geometry) {
-    impl->add(geometry);
+size_t Scene::size() const {
+    return impl->size();
+}
+
+Geometry& Scene::primitive(const size_t index) {
+    return impl->primitive(index);
+}
+
+const Geometry& Scene::primitive(const size_t index) const {
+    return impl->primitive(index);
+}
+
+MaterialTable& Scene::materials() {
+    return impl->materials;
+}
+
+const MaterialTable& Scene::materials() const {
+    return impl->materials;
 }
 
 bool Scene::intersect(const Ray &ray, Hit &hit, const double tMin, const double tMax) {
     return impl->intersect(ray, hit, tMin, tMax);
 }
 
+bool Scene::occluded(const Ray &ray, const double tMin, const double tMax) const {
+    return impl->occluded(ray, tMin, tMax);
+}
+
+void Scene::occluded(const std::vector<OcclusionQuery> &queries, std::vector<uint8_t> &results) const {
+    impl->occluded(queries, results);
+}
+
+void Scene::intersect(const RayBatch& rays, const HitBatch& hits, ThreadPool* threadPool) {
+    impl->intersect(rays, hits, threadPool);
+}
+
+void Scene::occluded(const RayBatch& rays, uint8_t* occluded, ThreadPool* threadPool) const {
+    impl->occluded(rays, occluded, threadPool);
+}
+
 Scene::~Scene() = default;
 
 //
@@ -84,15 +286,16 @@ std::unique_ptr<Scene> createCornellBox() {
     vec3f white(0.75f, 0.75f, 0.75f);
 
     auto scene = std::make_unique<Scene>();
+    auto& materials = scene->materials();
 
-    scene->add(createSphere(vec3d(0.4, 0.6, -0.2), 0.4, createDielectricMaterial(1.5)));
+    scene->add(createSphere(vec3d(0.4, 0.6, -0.2), 0.4, materials.intern(createDielectricMaterial(1.5))));
 
     // ---------------------------------------------------------------------------
     // Room
 
     float L = 555;            // Length of Cornell Box side.
 
-    const auto createTriangleWrap = [&L](vec3d a, vec3d b, vec3d c, vec3d colour, bool mirror = false) -> std::shared_ptr<Geometry> {
+    const auto createTriangleWrap = [&L, &materials](vec3d a, vec3d b, vec3d c, vec3d colour, bool mirror = false) -> std::shared_ptr<Geometry> {
         a *= 2 / L;
         b *= 2 / L;
         c *= 2 / L;
@@ -109,7 +312,7 @@ std::unique_ptr<Scene> createCornellBox() {
         b.y *= -1;
         c.y *= -1;
 
-        return createTriangle(a, b, c, mirror ? createMetalMaterial(colour, 0.0f) : createLambertianMaterial(colour));
+        return createTriangle(a, b, c, materials.intern(mirror ? createMetalMaterial(colour, 0.0f) : createLambertianMaterial(colour)));
     };
 
     vec3d A(L, 0, 0);
@@ -214,4 +417,51 @@ std::unique_ptr<Scene> createCornellBox() {
     // ----------------------------------------------
     return scene;
 }
+
+std::unique_ptr<Scene> createCausticRoom() {
+    vec3f red(0.75f, 0.15f, 0.15f);
+    vec3f green(0.15f, 0.75f, 0.15f);
+    vec3f white(0.75f, 0.75f, 0.75f);
+
+    auto scene = std::make_unique<Scene>();
+    auto& materials = scene->materials();
+
+    // Axis aligned rectangle with opposite corners a and b, flat along the axis they share.
+    const auto addRectangle = [&scene, &materials](const vec3d& a, const vec3d& b, const vec3f& colour) {
+        const auto material = materials.intern(createLambertianMaterial(colour));
+        vec3d c = a;
+        vec3d d = b;
+        if (a.x == b.x) {
+            c.y = b.y;
+            d.y = a.y;
+        } else {
+            c.x = b.x;
+            d.x = a.x;
+        }
+        scene->add(createTriangle(a, c, b, material));
+        scene->add(createTriangle(a, b, d, material));
+    };
+
+    const double x0 = -2.0, x1 = 2.0;
+    const double ceiling = -1.5, floor = 1.0;
+    const double z0 = -4.0, z1 = 3.0;
+
+    addRectangle({x0, floor, z0}, {x1, floor, z1}, white);
+    addRectangle({x0, ceiling, z0}, {x0, floor, z1}, red);
+    addRectangle({x1, ceiling, z0}, {x1, floor, z1}, green);
+    addRectangle({x0, ceiling, z1}, {x1, floor, z1}, white);
+    addRectangle({x0, ceiling, z0}, {x1, floor, z0}, white);
+
+    // Ceiling around the skylight.
+    const double hx0 = -0.6, hx1 = 0.6;
+    const double hz0 = -0.1, hz1 = 1.1;
+    addRectangle({x0, ceiling, z0}, {x1, ceiling, hz0}, white);
+    addRectangle({x0, ceiling, hz1}, {x1, ceiling, z1}, white);
+    addRectangle({x0, ceiling, hz0}, {hx0, ceiling, hz1}, white);
+    addRectangle({hx1, ceiling, hz0}, {x1, ceiling, hz1}, white);
+
+    scene->add(createSphere(vec3d(0.0, 0.4, 0.5), 0.6, materials.intern(createDielectricMaterial(1.5))));
+
+    return scene;
+}
 }
\ No newline at end of file
@@ -1,20 +1,112 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <vector>
+
+#include "BVH.h"
+#include "GeometryUtils.h"
+#include "Material.h"
 
 namespace bv {
 class Geometry;
-struct Ray;
-struct Hit;
+class ThreadPool;
+
+// A single visibility question: is anything hit along ray in [tMin, tMax]?
+struct OcclusionQuery {
+    Ray ray;
+    double tMin;
+    double tMax;
+};
+
+// Rays of a batched query as one array per component, each holding count values and owned by the caller. Directions
+// need not be normalised, t is measured in multiples of the direction.
+struct RayBatch {
+    size_t count = 0;
+    const double* originX = nullptr;
+    const double* originY = nullptr;
+    const double* originZ = nullptr;
+    const double* dirX = nullptr;
+    const double* dirY = nullptr;
+    const double* dirZ = nullptr;
+    const double* tMin = nullptr;
+    const double* tMax = nullptr;
+};
+
+constexpr uint32_t noPrimitive = ~0u;
+
+// Closest hits of a RayBatch, written into caller owned arrays of RayBatch::count values. primitive is required and
+// receives the index returned by Scene::add, or noPrimitive on a miss. The other arrays may each be null when not
+// needed, independently of one another, and are left untouched on a miss. Normals face the ray.
+struct HitBatch {
+    uint32_t* primitive = nullptr;
+    double* t = nullptr;
+    double* normalX = nullptr;
+    double* normalY = nullptr;
+    double* normalZ = nullptr;
+    double* u = nullptr;
+    double* v = nullptr;
+    MaterialId* material = nullptr;
+};
+
+// Acceleration structure answering a scene's queries.
+enum class Accelerator {
+    // Four-wide BVH, see BVH. Suits any scene.
+    BVH,
+    // Uniform grid, see UniformGrid. Builds faster and can trace faster for many primitives of similar size, such as
+    // particles. Ignores lazy builds, and update() rebuilds it.
+    Grid
+};
 
 class Scene {
 public:
-    Scene();
+    Scene(Accelerator accelerator = Accelerator::BVH);
+
+    // Returns the primitive's index, used to move it later.
+    size_t add(const std::shared_ptr<Geometry>& geometry);
 
-    void add(const std::shared_ptr<Geometry>& geometry);
+    // Moves a primitive, see Geometry::transform. Queries see stale bounds until the next update.
+    void transform(size_t index, const mat4d& transform);
+
+    // Builds the acceleration structure now, spread over threadPool when given, instead of on the first query.
+    // Must not be called from one of the pool's workers. With lazy, only its top is built now and the rest as rays
+    // first reach each part, which suits large scenes the camera sees little of. See BVH.
+    void build(ThreadPool* threadPool = nullptr, bool lazy = false);
+
+    BVHStats stats() const;
+
+    // Refits the acceleration structure above every primitive moved since the last update, in parallel on
+    // threadPool when given, and rebuilds any part of it whose quality degraded too far. Must not run alongside
+    // queries.
+    void update(ThreadPool* threadPool = nullptr);
+
+    size_t size() const;
+
+    // Primitive by the index add() returned.
+    Geometry& primitive(size_t index);
+    const Geometry& primitive(size_t index) const;
+
+    // Materials referenced by the scene's primitives, see MaterialTable::intern.
+    MaterialTable& materials();
+    const MaterialTable& materials() const;
 
     bool intersect(const Ray& ray, Hit& hit, double tMin, double tMax);
 
+    // Any-hit query: stops at the first primitive found in [tMin, tMax] and never builds a Hit.
+    bool occluded(const Ray& ray, double tMin, double tMax) const;
+
+    // Batched any-hit query, results[i] is 1 if queries[i] is occluded and 0 otherwise.
+    void occluded(const std::vector<OcclusionQuery>& queries, std::vector<uint8_t>& results) const;
+
+    // Closest hit of every ray in rays, spread over threadPool when given. Nothing is allocated per ray. Must not be
+    // called from one of the pool's workers.
+    void intersect(const RayBatch& rays, const HitBatch& hits, ThreadPool* threadPool = nullptr);
+
+    // Any-hit query for every ray in rays, occluded[i] is set to 1 if rays[i] is blocked and 0 otherwise. Spread over
+    // threadPool when given, which must not be the pool the caller runs on.
+    void occluded(const RayBatch& rays, uint8_t* occluded, ThreadPool* threadPool = nullptr) const;
+
     ~Scene();
 
 private:
@@ -27,4 +119,9 @@ private:
 // -1 <= y <= +1
 // -1 <= z <= +1
 std::unique_ptr<Scene> createCornellBox();
+
+// Closed room lit only through a skylight, under which a glass sphere rests on the floor. Nearly all the light on
+// the floor below the sphere arrives through it, a caustic paths from the camera rarely find. The camera at
+// (0, 0, -3) is inside, looking along +z.
+std::unique_ptr<Scene> createCausticRoom();
 }
@@ -0,0 +1,634 @@
+#include "StreamedMesh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <glm/matrix.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BVH.h"
+
+namespace bv {
+
+namespace {
+
+//
+// On-disk layout (.bvmesh):
+//   FileHeader
+//   ChunkRecord[chunks]
+//   chunk data, each chunk's DiskTriangles starting on a page boundary.
+//
+constexpr uint32_t fileMagic = 0x48534d42; // "BMSH"
+constexpr uint32_t fileVersion = 1;
+constexpr uint64_t pageSize = 4096;
+
+// Approximate heap footprint of one resident triangle: the Triangle itself, its shared_ptr control block and the
+// shared_ptr held by the chunk.
+constexpr size_t residentTriangleBytes = 200;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t triangles;
+    uint64_t chunks;
+};
+
+struct ChunkRecord {
+    double min[3];
+    double max[3];
+    uint64_t offset;
+    uint64_t triangles;
+};
+
+struct DiskTriangle {
+    double v[9];
+    uint32_t material;
+    uint32_t padding;
+};
+
+uint64_t part1By2(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffULL;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+    x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x << 2)) & 0x1249249249249249ULL;
+    return x;
+}
+
+uint64_t alignToPage(const uint64_t offset) {
+    return (offset + pageSize - 1) / pageSize * pageSize;
+}
+
+// A chunk paged in: its triangles and a BVH over them.
+struct Chunk {
+    std::vector<std::shared_ptr<Geometry>> triangles;
+    BVH bvh;
+    size_t bytes = 0;
+};
+
+//
+// Chunks of every mesh loaded by one GeometryCache, keyed by mesh and chunk index. A chunk is loaded by the first
+// worker to ask for it while later ones wait on its future, so no chunk is ever read twice at once.
+//
+class ChunkCache {
+public:
+    ChunkCache(const size_t maxResidentBytes) : maxResidentBytes(maxResidentBytes) {}
+
+    uint32_t newMeshId() {
+        return nextMeshId++;
+    }
+
+    // reservedBytes is counted as resident from the moment a miss starts loading, so misses in flight at once are
+    // held to the budget too. It is corrected to the chunk's actual size once loaded.
+    std::shared_ptr<const Chunk> get(const uint64_t key, const size_t reservedBytes,
+                                     const std::function<std::shared_ptr<const Chunk>()>& load) {
+        std::unique_lock lk(mutex);
+
+        const auto it = chunks.find(key);
+        if (it != chunks.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            const auto future = it->second.chunk;
+            lk.unlock();
+            return future.get();
+        }
+
+        std::promise<std::shared_ptr<const Chunk>> promise;
+        lru.push_front(key);
+        chunks.emplace(key, Entry{promise.get_future().share(), lru.begin(), reservedBytes, true});
+        bytes += reservedBytes;
+        evict(key);
+        lk.unlock();
+
+        std::shared_ptr<const Chunk> chunk;
+        try {
+            chunk = load();
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            lk.lock();
+            const auto entry = chunks.find(key);
+            bytes -= entry->second.bytes;
+            lru.erase(entry->second.lru);
+            chunks.erase(entry);
+            throw;
+        }
+        promise.set_value(chunk);
+
+        lk.lock();
+        auto& entry = chunks.at(key);
+        bytes = bytes - entry.bytes + chunk->bytes;
+        entry.bytes = chunk->bytes;
+        entry.loading = false;
+        loads++;
+        evict(key);
+
+        return chunk;
+    }
+
+    size_t residentBytes() const {
+        std::lock_guard lk(mutex);
+        return bytes;
+    }
+
+    size_t chunkLoads() const {
+        std::lock_guard lk(mutex);
+        return loads;
+    }
+
+private:
+    struct Entry {
+        std::shared_future<std::shared_ptr<const Chunk>> chunk;
+        std::list<uint64_t>::iterator lru;
+        // Reserved while loading, then the chunk's size.
+        size_t bytes;
+        bool loading;
+    };
+
+    // Evicts oldest first until within budget, skipping keep and chunks still being loaded by other workers.
+    void evict(const uint64_t keep) {
+        for (auto victim = lru.end(); bytes > maxResidentBytes && victim != lru.begin(); ) {
+            --victim;
+            const auto entry = chunks.find(*victim);
+            if (*victim == keep || entry->second.loading)
+                continue;
+
+            bytes -= entry->second.bytes;
+            chunks.erase(entry);
+            victim = lru.erase(victim);
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> chunks;
+    std::list<uint64_t> lru;
+    size_t bytes = 0;
+    size_t loads = 0;
+    size_t maxResidentBytes;
+    std::atomic<uint32_t> nextMeshId{0};
+};
+
+// A chunk the ray entered, and where.
+struct Candidate {
+    uint32_t chunk;
+    double t;
+};
+
+// Set while the proxy BVH is traversed only to find which chunks a ray enters: proxies then record themselves
+// here instead of paging their chunk in.
+thread_local std::vector<Candidate>* gathering = nullptr;
+}
+
+class StreamedMesh::Impl {
+public:
+    Impl(std::shared_ptr<ChunkCache> cache, const uint32_t meshId, const int fd, char* mapping,
+         const size_t mappingSize, std::vector<ChunkRecord> records, const uint64_t triangles, const size_t materials)
+            : cache(std::move(cache)), meshId(meshId), fd(fd), mapping(mapping), mappingSize(mappingSize),
+              records(std::move(records)), triangles(triangles), materials(materials) {
+        proxies.reserve(this->records.size());
+        for (uint32_t i = 0; i < this->records.size(); ++i) {
+            const auto& r = this->records[i];
+            const AABB box{{r.min[0], r.min[1], r.min[2]}, {r.max[0], r.max[1], r.max[2]}};
+            objectBounds.extend(box);
+            proxies.push_back(std::make_shared<ChunkProxy>(*this, i, box));
+        }
+        proxyBVH.build(proxies);
+    }
+
+    bool intersect(const Ray& ray, Hit& hit, const double tMin, const double tMax) {
+        if (!proxyBVH.intersect(toObject(ray), hit, tMin, tMax))
+            return false;
+        toWorld(hit);
+        return true;
+    }
+
+    bool occluded(const Ray& ray, const double tMin, const double tMax) const {
+        return proxyBVH.occluded(toObject(ray), tMin, tMax);
+    }
+
+    void intersect(const std::vector<Ray>& rays, const double tMin, const double tMax, std::vector<Hit>& hits,
+                   std::vector<uint8_t>& found) {
+        hits.resize(rays.size());
+        found.assign(rays.size(), 0);
+
+        // Every chunk each ray enters, nearest first.
+        std::vector<Ray> objectRays(rays.size());
+        std::vector<std::vector<Candidate>> candidates(rays.size());
+        for (size_t i = 0; i < rays.size(); ++i) {
+            objectRays[i] = toObject(rays[i]);
+
+            Hit unused{};
+            gathering = &candidates[i];
+            proxyBVH.intersect(objectRays[i], unused, tMin, tMax);
+            gathering = nullptr;
+
+            std::sort(candidates[i].begin(), candidates[i].end(),
+                      [](const Candidate& a, const Candidate& b) { return a.t < b.t; });
+        }
+
+        std::vector<double> closest(rays.size(), tMax);
+        std::vector<size_t> next(rays.size(), 0);
+        std::unordered_map<uint32_t, std::vector<uint32_t>> queues;
+
+        for (;;) {
+            // Queue every ray on the next chunk it enters before its closest hit so far.
+            queues.clear();
+            for (uint32_t i = 0; i < rays.size(); ++i) {
+                if (next[i] < candidates[i].size() && candidates[i][next[i]].t <= closest[i])
+                    queues[candidates[i][next[i]].chunk].push_back(i);
+            }
+            if (queues.empty())
+                break;
+
+            for (const auto& [index, queued] : queues) {
+                const auto chunk = this->chunk(index);
+                for (const auto i : queued) {
+                    if (chunk->bvh.intersect(objectRays[i], hits[i], tMin, closest[i])) {
+                        closest[i] = hits[i].t;
+                        found[i] = 1;
+                    }
+                    next[i]++;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (found[i])
+                toWorld(hits[i]);
+        }
+    }
+
+    AABB bounds() const {
+        if (identity)
+            return objectBounds;
+
+        AABB b;
+        for (int corner = 0; corner < 8; ++corner) {
+            const vec3d p(corner & 1 ? objectBounds.max.x : objectBounds.min.x,
+                          corner & 2 ? objectBounds.max.y : objectBounds.min.y,
+                          corner & 4 ? objectBounds.max.z : objectBounds.min.z);
+            b.extend(vec3d(objectToWorld * vec4d(p, 1.0)));
+        }
+        return b;
+    }
+
+    void transform(const mat4d& m) {
+        objectToWorld = m * objectToWorld;
+        worldToObject = glm::inverse(objectToWorld);
+        normalToWorld = glm::transpose(glm::inverse(mat3d(objectToWorld)));
+        identity = false;
+    }
+
+    size_t chunkCount() const {
+        return records.size();
+    }
+
+    size_t triangleCount() const {
+        return triangles;
+    }
+
+    ~Impl() {
+        ::munmap(mapping, mappingSize);
+        ::close(fd);
+    }
+
+private:
+    class ChunkProxy : public Geometry {
+    public:
+        ChunkProxy(Impl& mesh, const uint32_t index, const AABB& box) : mesh(mesh), index(index), box(box) {}
+
+        bool intersect(const Ray& ray, Hit& hit, const double tMin, const double tMax) override {
+            double tEntry;
+            if (!box.intersect(ray.start, 1.0 / ray.dir, tMin, tMax, tEntry))
+                return false;
+
+            if (gathering) {
+                gathering->push_back({index, tEntry});
+                return false;
+            }
+
+            return mesh.chunk(index)->bvh.intersect(ray, hit, tMin, tMax);
+        }
+
+        bool occluded(const Ray& ray, const double tMin, const double tMax) const override {
+            double tEntry;
+            if (!box.intersect(ray.start, 1.0 / ray.dir, tMin, tMax, tEntry))
+                return false;
+
+            return mesh.chunk(index)->bvh.occluded(ray, tMin, tMax);
+        }
+
+        AABB bounds() const override {
+            return box;
+        }
+
+        // Proxies live in the mesh's object space, the mesh transforms rays instead.
+        void transform(const mat4d&) override {}
+
+    private:
+        Impl& mesh;
+        uint32_t index;
+        AABB box;
+    };
+
+    std::shared_ptr<const Chunk> chunk(const uint32_t index) const {
+        return cache->get(uint64_t(meshId) << 32 | index, records[index].triangles * residentTriangleBytes,
+                          [this, index]() {
+            return loadChunk(index);
+        });
+    }
+
+    std::shared_ptr<const Chunk> loadChunk(const uint32_t index) const {
+        const auto& record = records[index];
+        const auto* data = reinterpret_cast<const DiskTriangle*>(mapping + record.offset);
+
+        auto chunk = std::make_shared<Chunk>();
+        chunk->triangles.reserve(record.triangles);
+        for (uint64_t i = 0; i < record.triangles; ++i) {
+            const auto& t = data[i];
+            // Only checkable once the chunk is read, the query that paged it in fails rather than shading garbage.
+            if (t.material >= materials)
+                throw std::runtime_error("Invalid chunked mesh, material " + std::to_string(t.material)
+                                         + " is not in the scene's table of " + std::to_string(materials));
+            chunk->triangles.push_back(createTriangle({t.v[0], t.v[1], t.v[2]}, {t.v[3], t.v[4], t.v[5]},
+                                                      {t.v[6], t.v[7], t.v[8]}, t.material));
+        }
+
+        // The decoded copy is what stays resident, hand the file pages back straight away.
+        const auto begin = record.offset;
+        const auto end = alignToPage(record.offset + record.triangles * sizeof(DiskTriangle));
+        ::madvise(mapping + begin, std::min<uint64_t>(end, mappingSize) - begin,
+                  MADV_DONTNEED);
+
+        chunk->bvh.build(chunk->triangles);
+        chunk->bytes = chunk->triangles.size() * residentTriangleBytes + chunk->bvh.stats().bytes;
+        return chunk;
+    }
+
+    Ray toObject(const Ray& ray) const {
+        if (identity)
+            return ray;
+
+        Ray r = ray;
+        r.start = vec3d(worldToObject * vec4d(ray.start, 1.0));
+        r.dir = mat3d(worldToObject) * ray.dir;
+        return r;
+    }
+
+    void toWorld(Hit& hit) const {
+        if (identity)
+            return;
+
+        hit.pos = vec3d(objectToWorld * vec4d(hit.pos, 1.0));
+        hit.normal = glm::normalize(normalToWorld * hit.normal);
+    }
+
+    std::shared_ptr<ChunkCache> cache;
+    uint32_t meshId;
+    int fd;
+    char* mapping;
+    size_t mappingSize;
+    std::vector<ChunkRecord> records;
+    uint64_t triangles;
+    // Size of the MaterialTable the mesh's material ids index.
+    size_t materials;
+
+    std::vector<std::shared_ptr<Geometry>> proxies;
+    BVH proxyBVH;
+    AABB objectBounds;
+
+    bool identity = true;
+    mat4d objectToWorld{1.0};
+    mat4d worldToObject{1.0};
+    mat3d normalToWorld{1.0};
+};
+
+StreamedMesh::StreamedMesh(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+
+bool StreamedMesh::intersect(const Ray& ray, Hit& hit, const double tMin, const double tMax) {
+    return impl->intersect(ray, hit, tMin, tMax);
+}
+
+bool StreamedMesh::occluded(const Ray& ray, const double tMin, const double tMax) const {
+    return impl->occluded(ray, tMin, tMax);
+}
+
+AABB StreamedMesh::bounds() const {
+    return impl->bounds();
+}
+
+void StreamedMesh::transform(const mat4d& m) {
+    impl->transform(m);
+}
+
+void StreamedMesh::intersect(const std::vector<Ray>& rays, const double tMin, const double tMax,
+                             std::vector<Hit>& hits, std::vector<uint8_t>& found) {
+    impl->intersect(rays, tMin, tMax, hits, found);
+}
+
+size_t StreamedMesh::chunkCount() const {
+    return impl->chunkCount();
+}
+
+size_t StreamedMesh::triangleCount() const {
+    return impl->triangleCount();
+}
+
+StreamedMesh::~StreamedMesh() = default;
+
+void writeChunkedMesh(const std::string& filename, const std::vector<MeshTriangle>& triangles,
+                      const size_t trianglesPerChunk) {
+    if (trianglesPerChunk == 0)
+        throw std::invalid_argument("writeChunkedMesh: trianglesPerChunk must be positive");
+
+    AABB centroidBounds;
+    for (const auto& t : triangles)
+        centroidBounds.extend((t.v1 + t.v2 + t.v3) / 3.0);
+
+    const vec3d extent = glm::max(centroidBounds.max - centroidBounds.min, vec3d(1e-12));
+    std::vector<uint64_t> codes(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const auto& t = triangles[i];
+        const vec3d p = ((t.v1 + t.v2 + t.v3) / 3.0 - centroidBounds.min) / extent * double((1 << 21) - 1);
+        codes[i] = part1By2(uint64_t(p.x)) | part1By2(uint64_t(p.y)) << 1 | part1By2(uint64_t(p.z)) << 2;
+    }
+
+    std::vector<uint32_t> order(triangles.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&codes](const uint32_t a, const uint32_t b) { return codes[a] < codes[b]; });
+
+    const uint64_t chunkCount = (triangles.size() + trianglesPerChunk - 1) / trianglesPerChunk;
+    std::vector<ChunkRecord> records(chunkCount);
+
+    uint64_t offset = alignToPage(sizeof(FileHeader) + chunkCount * sizeof(ChunkRecord));
+    for (uint64_t c = 0; c < chunkCount; ++c) {
+        const size_t begin = c * trianglesPerChunk;
+        const size_t end = std::min(triangles.size(), begin + trianglesPerChunk);
+
+        AABB box;
+        for (size_t i = begin; i < end; ++i) {
+            const auto& t = triangles[order[i]];
+            box.extend(t.v1);
+            box.extend(t.v2);
+            box.extend(t.v3);
+        }
+
+        auto& record = records[c];
+        for (int axis = 0; axis < 3; ++axis) {
+            record.min[axis] = box.min[axis];
+            record.max[axis] = box.max[axis];
+        }
+        record.offset = offset;
+        record.triangles = end - begin;
+        offset = alignToPage(offset + record.triangles * sizeof(DiskTriangle));
+    }
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("Could not write chunked mesh: " + filename);
+
+    const FileHeader header{fileMagic, fileVersion, triangles.size(), chunkCount};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(records.data()), std::streamsize(records.size() * sizeof(ChunkRecord)));
+
+    std::vector<DiskTriangle> data;
+    for (uint64_t c = 0; c < chunkCount; ++c) {
+        const size_t begin = c * trianglesPerChunk;
+
+        data.assign(records[c].triangles, DiskTriangle{});
+        for (size_t i = 0; i < data.size(); ++i) {
+            const auto& t = triangles[order[begin + i]];
+            for (int axis = 0; axis < 3; ++axis) {
+                data[i].v[axis] = t.v1[axis];
+                data[i].v[3 + axis] = t.v2[axis];
+                data[i].v[6 + axis] = t.v3[axis];
+            }
+            data[i].material = t.material;
+        }
+
+        out.seekp(std::streamoff(records[c].offset));
+        out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size() * sizeof(DiskTriangle)));
+    }
+
+    if (!out)
+        throw std::runtime_error("Error writing chunked mesh: " + filename);
+}
+
+class GeometryCache::Impl {
+public:
+    Impl(const size_t maxResidentBytes) : cache(std::make_shared<ChunkCache>(maxResidentBytes)) {}
+
+    std::shared_ptr<StreamedMesh> load(const std::string& filename, const size_t materials) {
+        std::lock_guard lk(loadMutex);
+
+        const auto existing = loaded.find({filename, materials});
+        if (existing != loaded.end()) {
+            if (auto mesh = existing->second.lock())
+                return mesh;
+        }
+
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open chunked mesh: " + filename);
+
+        struct stat st{};
+        FileHeader header{};
+        if (::fstat(fd, &st) != 0 || ::pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))
+                || header.magic != fileMagic || header.version != fileVersion) {
+            ::close(fd);
+            throw std::runtime_error("Invalid chunked mesh: " + filename);
+        }
+
+        // The table has to fit in the file, which bounds what a corrupt count can allocate.
+        const auto size = static_cast<uint64_t>(st.st_size);
+        if (size < sizeof(header) || header.chunks > (size - sizeof(header)) / sizeof(ChunkRecord)) {
+            ::close(fd);
+            throw std::runtime_error("Invalid chunked mesh: " + filename);
+        }
+
+        std::vector<ChunkRecord> records(header.chunks);
+        const auto tableSize = ssize_t(records.size() * sizeof(ChunkRecord));
+        if (::pread(fd, records.data(), size_t(tableSize), sizeof(header)) != tableSize) {
+            ::close(fd);
+            throw std::runtime_error("Invalid chunked mesh: " + filename);
+        }
+
+        //
+        // Every chunk must lie after the table and within the file, or reading it would run off the mapping, and
+        // start on a page boundary as written, so its triangles are aligned.
+        //
+        const uint64_t dataStart = sizeof(header) + uint64_t(tableSize);
+        uint64_t triangles = 0;
+        for (const auto& record : records) {
+            const bool inFile = record.offset >= dataStart && record.offset <= size && record.offset % pageSize == 0
+                                && record.triangles <= (size - record.offset) / sizeof(DiskTriangle) &&
+                                record.triangles <= std::numeric_limits<uint32_t>::max();
+            if (!inFile) {
+                ::close(fd);
+                throw std::runtime_error("Invalid chunked mesh, chunk outside the file: " + filename);
+            }
+            triangles += record.triangles;
+        }
+        if (triangles != header.triangles) {
+            ::close(fd);
+            throw std::runtime_error("Invalid chunked mesh, triangle count mismatch: " + filename);
+        }
+
+        void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Could not map chunked mesh: " + filename);
+        }
+
+        auto mesh = std::shared_ptr<StreamedMesh>(new StreamedMesh(std::make_unique<StreamedMesh::Impl>(
+                cache, cache->newMeshId(), fd, static_cast<char*>(mapping), size_t(size), std::move(records),
+                header.triangles, materials)));
+        loaded[{filename, materials}] = mesh;
+        return mesh;
+    }
+
+    size_t residentBytes() const {
+        return cache->residentBytes();
+    }
+
+    size_t chunkLoads() const {
+        return cache->chunkLoads();
+    }
+
+private:
+    std::shared_ptr<ChunkCache> cache;
+    std::mutex loadMutex;
+    // Keyed by the material count as well, meshes loaded for different tables check against different bounds.
+    std::map<std::pair<std::string, size_t>, std::weak_ptr<StreamedMesh>> loaded;
+};
+
+GeometryCache::GeometryCache(const size_t maxResidentBytes) : impl(std::make_unique<Impl>(maxResidentBytes)) {}
+
+std::shared_ptr<StreamedMesh> GeometryCache::load(const std::string& filename, const size_t materials) {
+    return impl->load(filename, materials);
+}
+
+size_t GeometryCache::residentBytes() const {
+    return impl->residentBytes();
+}
+
+size_t GeometryCache::chunkLoads() const {
+    return impl->chunkLoads();
+}
+
+GeometryCache::~GeometryCache() = default;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Geometry.h"
+#include "GeometryUtils.h"
+
+namespace bv {
+
+// A triangle as written to a chunked mesh file. material indexes the MaterialTable of the scene the mesh is
+// added to.
+struct MeshTriangle {
+    vec3d v1, v2, v3;
+    MaterialId material;
+};
+
+// Splits triangles into spatially coherent chunks of trianglesPerChunk, consecutive along a Morton curve through
+// their centroids, and writes them to filename. Every chunk starts on a page boundary so it can be paged in alone.
+void writeChunkedMesh(const std::string& filename, const std::vector<MeshTriangle>& triangles,
+                      size_t trianglesPerChunk = 4096);
+
+// Triangle mesh streamed from a chunked mesh file. Only the bounds of its chunks are resident up front. A chunk is
+// read from the mapped file the first time a ray enters its bounds and is later evicted by the GeometryCache that
+// loaded the mesh, so several times more geometry than fits in memory can be rendered.
+class StreamedMesh : public Geometry {
+public:
+    bool intersect(const Ray& ray, Hit& hit, double tMin, double tMax) override;
+
+    bool occluded(const Ray& ray, double tMin, double tMax) const override;
+
+    AABB bounds() const override;
+
+    // The file is never modified, the transform is applied to rays instead.
+    void transform(const mat4d& m) override;
+
+    // Closest hits for a batch of rays, found[i] is 1 if rays[i] hit. Each ray is queued on the nearest chunk it
+    // still has to visit and the queues are drained chunk by chunk, so a chunk is paged in once for all the rays
+    // waiting on it rather than once per ray.
+    void intersect(const std::vector<Ray>& rays, double tMin, double tMax, std::vector<Hit>& hits,
+                   std::vector<uint8_t>& found);
+
+    size_t chunkCount() const;
+    size_t triangleCount() const;
+
+    ~StreamedMesh();
+
+private:
+    friend class GeometryCache;
+
+    class Impl;
+    StreamedMesh(std::unique_ptr<Impl> impl);
+
+    std::unique_ptr<Impl> impl;
+};
+
+// Size-bounded, thread safe cache of the chunks of every mesh it loads. Least recently used chunks are evicted
+// once the resident size exceeds the budget, counting chunks still being loaded at an estimate of their size. Chunks
+// in use by a ray stay alive until it is done with them. load rejects files whose chunk table does not fit them.
+class GeometryCache {
+public:
+    GeometryCache(size_t maxResidentBytes);
+
+    // materials is the size of the MaterialTable of the scene the mesh goes into, Scene::materials().size(). A chunk
+    // holding a material id past it throws std::runtime_error from the query that pages it in.
+    std::shared_ptr<StreamedMesh> load(const std::string& filename, size_t materials);
+
+    size_t residentBytes() const;
+
+    // Chunks read from disk so far, counting every reload after an eviction.
+    size_t chunkLoads() const;
+
+    ~GeometryCache();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+}
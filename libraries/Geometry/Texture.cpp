@@ -0,0 +1,556 @@
+#include "Texture.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bv {
+
+namespace {
+
+//
+// On-disk layout (<image>.bvtex):
+//   FileHeader
+//   LevelHeader[levels]
+//   tiles, level by level, row-major by tile, each tile tileSize x tileSize RGBA8 texels in Morton order.
+// Edge tiles are padded by clamping so every tile has the same size and can be read with a single pread.
+//
+constexpr int tileShift = 5;
+constexpr int tileSize = 1 << tileShift;
+constexpr int texelsPerTile = tileSize * tileSize;
+constexpr uint32_t fileMagic = 0x58545642; // "BVTX"
+constexpr uint32_t fileVersion = 1;
+constexpr int numShards = 16;
+
+// Tile cache keys pack the texture id, mip level and tile coordinates into 64 bits, fields from high to low. The id
+// keeps the 19 bits left over, enough for half a million textures per cache.
+constexpr int tileCoordBits = 20;
+constexpr int levelBits = 5;
+constexpr int idBits = 64 - levelBits - 2 * tileCoordBits;
+constexpr uint32_t maxLevels = 1u << levelBits;
+constexpr uint32_t maxTilesPerAxis = 1u << tileCoordBits;
+constexpr uint32_t maxTextures = 1u << idBits;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    uint32_t tileSize;
+};
+
+struct LevelHeader {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint64_t offset;
+};
+
+using TileData = std::array<uint32_t, texelsPerTile>;
+
+uint32_t part1By1(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+uint32_t mortonIndex(const uint32_t x, const uint32_t y) {
+    return part1By1(x) | (part1By1(y) << 1);
+}
+
+// Texels are stored gamma encoded with the same power of two used when resolving the image.
+uint32_t encodeTexel(const vec3f& c) {
+    const auto channel = [](const float v) {
+        return uint32_t(std::clamp(std::sqrt(std::max(v, 0.0f)) * 255.0f + 0.5f, 0.0f, 255.0f));
+    };
+    return channel(c.x) | (channel(c.y) << 8) | (channel(c.z) << 16) | (0xffu << 24);
+}
+
+vec3f decodeTexel(const uint32_t t) {
+    const auto channel = [](const uint32_t v) {
+        const float f = float(v & 0xff) / 255.0f;
+        return f * f;
+    };
+    return {channel(t), channel(t >> 8), channel(t >> 16)};
+}
+
+void readFully(const int fd, void* data, const size_t size, const uint64_t offset) {
+    auto* bytes = static_cast<char*>(data);
+    size_t done = 0;
+
+    while (done < size) {
+        const auto n = ::pread(fd, bytes + done, size - done, static_cast<off_t>(offset + done));
+        if (n <= 0) {
+            throw std::runtime_error("Could not read texture tile");
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+//
+// Tiles are spread over independently locked shards so concurrent lookups from different workers rarely contend.
+// Each shard keeps its own LRU list and an equal share of the byte budget.
+//
+class TileCache {
+public:
+    TileCache(const size_t maxResidentBytes)
+            : maxShardBytes(std::max(maxResidentBytes / numShards, sizeof(TileData))) {}
+
+    // Throws once every id the tile keys can hold is used up. Ids are not reused, tiles of a released texture stay
+    // cached under its id until evicted.
+    uint32_t newTextureId() {
+        uint32_t id = nextTextureId.load(std::memory_order_relaxed);
+        do {
+            if (id >= maxTextures)
+                throw std::runtime_error("Texture cache is out of texture ids, at most " + std::to_string(maxTextures)
+                                         + " textures can be loaded through one cache");
+        } while (!nextTextureId.compare_exchange_weak(id, id + 1, std::memory_order_relaxed));
+        return id;
+    }
+
+    std::shared_ptr<const TileData> get(const uint64_t key, const int fd, const uint64_t offset) {
+        auto& shard = shards[std::hash<uint64_t>{}(key) % numShards];
+
+        {
+            std::lock_guard lk(shard.mutex);
+            const auto it = shard.tiles.find(key);
+            if (it != shard.tiles.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+                return it->second.tile;
+            }
+        }
+
+        // Page the tile in without holding the lock, other workers keep sampling resident tiles meanwhile.
+        auto tile = std::make_shared<TileData>();
+        readFully(fd, tile->data(), sizeof(TileData), offset);
+
+        std::lock_guard lk(shard.mutex);
+        const auto it = shard.tiles.find(key);
+        if (it != shard.tiles.end()) {
+            // Another worker loaded it first.
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+            return it->second.tile;
+        }
+
+        shard.lru.push_front(key);
+        shard.tiles.emplace(key, Entry{tile, shard.lru.begin()});
+        shard.bytes += sizeof(TileData);
+
+        while (shard.bytes > maxShardBytes && shard.lru.size() > 1) {
+            shard.tiles.erase(shard.lru.back());
+            shard.lru.pop_back();
+            shard.bytes -= sizeof(TileData);
+        }
+
+        return tile;
+    }
+
+    size_t residentBytes() const {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard lk(shard.mutex);
+            total += shard.bytes;
+        }
+        return total;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const TileData> tile;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> tiles;
+        std::list<uint64_t> lru;
+        size_t bytes = 0;
+    };
+
+    std::array<Shard, numShards> shards;
+    size_t maxShardBytes;
+    std::atomic<uint32_t> nextTextureId{0};
+};
+
+std::vector<vec3f> readPPM(const std::string& filename, int& width, int& height) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open texture: " + filename);
+    }
+
+    const auto nextToken = [&in]() {
+        std::string token;
+        while (in >> token) {
+            if (token[0] != '#')
+                return token;
+            std::getline(in, token);
+        }
+        throw std::runtime_error("Truncated texture header");
+    };
+
+    if (nextToken() != "P6") {
+        throw std::runtime_error("Texture is not a binary PPM (P6): " + filename);
+    }
+
+    width = std::stoi(nextToken());
+    height = std::stoi(nextToken());
+    const int maxValue = std::stoi(nextToken());
+    in.get();
+
+    if (width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255) {
+        throw std::runtime_error("Unsupported PPM texture: " + filename);
+    }
+
+    std::vector<unsigned char> bytes(size_t(width) * height * 3);
+    if (!in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(bytes.size()))) {
+        throw std::runtime_error("Truncated PPM texture: " + filename);
+    }
+
+    std::vector<vec3f> texels(size_t(width) * height);
+    for (size_t i = 0; i < texels.size(); ++i) {
+        const auto channel = [maxValue](const unsigned char v) {
+            const float f = float(v) / float(maxValue);
+            return f * f;
+        };
+        texels[i] = {channel(bytes[3 * i]), channel(bytes[3 * i + 1]), channel(bytes[3 * i + 2])};
+    }
+
+    return texels;
+}
+
+// Overlap of each source texel with the box [i * src / dst, (i + 1) * src / dst) covered by destination texel i.
+std::vector<std::vector<std::pair<int, float>>> boxWeights(const int srcSize, const int dstSize) {
+    std::vector<std::vector<std::pair<int, float>>> weights(dstSize);
+    const double scale = double(srcSize) / dstSize;
+
+    for (int i = 0; i < dstSize; ++i) {
+        const double begin = i * scale;
+        const double end = (i + 1) * scale;
+        for (int s = int(begin); s < std::min(int(std::ceil(end)), srcSize); ++s) {
+            const double overlap = std::min(end, s + 1.0) - std::max(begin, double(s));
+            if (overlap > 0.0)
+                weights[i].emplace_back(s, float(overlap / scale));
+        }
+    }
+
+    return weights;
+}
+
+// Box filters one level down. Boxes are fractional for odd sizes so every source texel keeps its true weight.
+std::vector<vec3f> downsample(const std::vector<vec3f>& src, const int width, const int height,
+                              const int newWidth, const int newHeight) {
+    const auto xWeights = boxWeights(width, newWidth);
+    const auto yWeights = boxWeights(height, newHeight);
+
+    std::vector<vec3f> rows(size_t(newWidth) * height, vec3f(0.0f, 0.0f, 0.0f));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < newWidth; ++x) {
+            for (const auto& [sx, w] : xWeights[x]) {
+                rows[size_t(y) * newWidth + x] += w * src[size_t(y) * width + sx];
+            }
+        }
+    }
+
+    std::vector<vec3f> dst(size_t(newWidth) * newHeight, vec3f(0.0f, 0.0f, 0.0f));
+    for (int y = 0; y < newHeight; ++y) {
+        for (const auto& [sy, w] : yWeights[y]) {
+            for (int x = 0; x < newWidth; ++x) {
+                dst[size_t(y) * newWidth + x] += w * rows[size_t(sy) * newWidth + x];
+            }
+        }
+    }
+
+    return dst;
+}
+
+void buildTiledFile(const std::string& source, const std::string& destination) {
+    int width, height;
+    auto texels = readPPM(source, width, height);
+
+    std::vector<std::vector<vec3f>> pyramid;
+    std::vector<LevelHeader> levels;
+
+    pyramid.push_back(std::move(texels));
+    levels.push_back({uint32_t(width), uint32_t(height), 0, 0, 0});
+
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const auto& last = levels.back();
+        const int w = std::max(int(last.width) / 2, 1);
+        const int h = std::max(int(last.height) / 2, 1);
+        pyramid.push_back(downsample(pyramid.back(), int(last.width), int(last.height), w, h));
+        levels.push_back({uint32_t(w), uint32_t(h), 0, 0, 0});
+    }
+
+    uint64_t offset = sizeof(FileHeader) + sizeof(LevelHeader) * levels.size();
+    for (auto& level : levels) {
+        level.tilesX = (level.width + tileSize - 1) / tileSize;
+        level.tilesY = (level.height + tileSize - 1) / tileSize;
+        level.offset = offset;
+        offset += uint64_t(level.tilesX) * level.tilesY * sizeof(TileData);
+    }
+
+    const auto temporary = destination + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Could not write tiled texture: " + temporary);
+        }
+
+        const FileHeader header{fileMagic, fileVersion, uint32_t(width), uint32_t(height), uint32_t(levels.size()),
+                                uint32_t(tileSize)};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(levels.data()), std::streamsize(sizeof(LevelHeader) * levels.size()));
+
+        TileData tile;
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const auto& level = levels[l];
+            const auto& data = pyramid[l];
+
+            for (uint32_t ty = 0; ty < level.tilesY; ++ty) {
+                for (uint32_t tx = 0; tx < level.tilesX; ++tx) {
+                    for (uint32_t y = 0; y < uint32_t(tileSize); ++y) {
+                        const auto sy = std::min(ty * tileSize + y, level.height - 1);
+                        for (uint32_t x = 0; x < uint32_t(tileSize); ++x) {
+                            const auto sx = std::min(tx * tileSize + x, level.width - 1);
+                            tile[mortonIndex(x, y)] = encodeTexel(data[size_t(sy) * level.width + sx]);
+                        }
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), sizeof(TileData));
+                }
+            }
+        }
+
+        if (!out) {
+            throw std::runtime_error("Could not write tiled texture: " + temporary);
+        }
+    }
+
+    std::filesystem::rename(temporary, destination);
+}
+
+bool readTiledHeader(const int fd, FileHeader& header, std::vector<LevelHeader>& levels) {
+    if (::pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+        return false;
+
+    if (header.magic != fileMagic || header.version != fileVersion || header.tileSize != uint32_t(tileSize)
+        || header.levels == 0 || header.levels > maxLevels)
+        return false;
+
+    levels.resize(header.levels);
+    const auto size = sizeof(LevelHeader) * levels.size();
+    if (::pread(fd, levels.data(), size, sizeof(header)) != ssize_t(size))
+        return false;
+
+    // Tile coordinates past the key's fields would alias tiles of another level or texture.
+    return std::all_of(levels.begin(), levels.end(), [](const LevelHeader& level) {
+        return level.tilesX <= maxTilesPerAxis && level.tilesY <= maxTilesPerAxis;
+    });
+}
+
+uint64_t tileKey(const uint32_t id, const int level, const uint32_t tx, const uint32_t ty) {
+    return (uint64_t(id) << (levelBits + 2 * tileCoordBits)) | (uint64_t(level) << (2 * tileCoordBits))
+           | (uint64_t(ty) << tileCoordBits) | tx;
+}
+
+// Remembers the last tile touched by a lookup so neighbouring texels skip the cache.
+struct TileRef {
+    uint64_t key = ~uint64_t(0);
+    std::shared_ptr<const TileData> tile;
+};
+}
+
+class Texture::Impl {
+public:
+    Impl(std::shared_ptr<TileCache> cache, const uint32_t id, const int fd, const FileHeader& header,
+         std::vector<LevelHeader> levels)
+            : cache(std::move(cache)), id(id), fd(fd), header(header), levelHeaders(std::move(levels)) {}
+
+    vec3f sample(const vec2d& uv, const double footprint, const double uvDensity) const {
+        double lod = 0.0;
+
+        if (footprint > 0.0 && uvDensity > 0.0) {
+            const double texelsPerUnit = std::sqrt(uvDensity * double(header.width) * double(header.height));
+            lod = std::log2(std::max(footprint * texelsPerUnit, 1e-12));
+        }
+
+        return sampleLevel(uv, lod);
+    }
+
+    vec3f sampleLevel(const vec2d& uv, const double lod) const {
+        const double clamped = std::clamp(lod, 0.0, double(levelHeaders.size() - 1));
+        const int level = int(clamped);
+        const float blend = float(clamped - level);
+
+        TileRef ref;
+        const auto fine = bilinear(level, uv, ref);
+
+        if (blend <= 0.0f || level + 1 >= int(levelHeaders.size()))
+            return fine;
+
+        return (1.0f - blend) * fine + blend * bilinear(level + 1, uv, ref);
+    }
+
+    ~Impl() {
+        ::close(fd);
+    }
+
+    std::shared_ptr<TileCache> cache;
+    uint32_t id;
+    int fd;
+    FileHeader header;
+    std::vector<LevelHeader> levelHeaders;
+
+private:
+    vec3f bilinear(const int level, const vec2d& uv, TileRef& ref) const {
+        const auto& l = levelHeaders[level];
+
+        // Repeat addressing.
+        const double u = uv.x - std::floor(uv.x);
+        const double v = uv.y - std::floor(uv.y);
+
+        const double x = u * l.width - 0.5;
+        const double y = v * l.height - 0.5;
+        const double fx = std::floor(x);
+        const double fy = std::floor(y);
+        const float wx = float(x - fx);
+        const float wy = float(y - fy);
+
+        const auto wrap = [](const int i, const uint32_t n) {
+            const int m = i % int(n);
+            return uint32_t(m < 0 ? m + int(n) : m);
+        };
+
+        const uint32_t x0 = wrap(int(fx), l.width), x1 = wrap(int(fx) + 1, l.width);
+        const uint32_t y0 = wrap(int(fy), l.height), y1 = wrap(int(fy) + 1, l.height);
+
+        const auto t00 = fetch(level, x0, y0, ref);
+        const auto t10 = fetch(level, x1, y0, ref);
+        const auto t01 = fetch(level, x0, y1, ref);
+        const auto t11 = fetch(level, x1, y1, ref);
+
+        return (1.0f - wy) * ((1.0f - wx) * t00 + wx * t10) + wy * ((1.0f - wx) * t01 + wx * t11);
+    }
+
+    vec3f fetch(const int level, const uint32_t x, const uint32_t y, TileRef& ref) const {
+        const auto& l = levelHeaders[level];
+        const uint32_t tx = x >> tileShift;
+        const uint32_t ty = y >> tileShift;
+        const uint64_t key = tileKey(id, level, tx, ty);
+
+        if (key != ref.key) {
+            const uint64_t offset = l.offset + (uint64_t(ty) * l.tilesX + tx) * sizeof(TileData);
+            ref.tile = cache->get(key, fd, offset);
+            ref.key = key;
+        }
+
+        return decodeTexel((*ref.tile)[mortonIndex(x & (tileSize - 1), y & (tileSize - 1))]);
+    }
+};
+
+Texture::Texture(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+
+int Texture::width() const {
+    return int(impl->header.width);
+}
+
+int Texture::height() const {
+    return int(impl->header.height);
+}
+
+int Texture::levels() const {
+    return int(impl->levelHeaders.size());
+}
+
+vec3f Texture::sample(const vec2d& uv, const double footprint, const double uvDensity) const {
+    return impl->sample(uv, footprint, uvDensity);
+}
+
+vec3f Texture::sampleLevel(const vec2d& uv, const double lod) const {
+    return impl->sampleLevel(uv, lod);
+}
+
+Texture::~Texture() = default;
+
+class TextureCache::Impl {
+public:
+    Impl(const size_t maxResidentBytes) : cache(std::make_shared<TileCache>(maxResidentBytes)) {}
+
+    std::shared_ptr<Texture> load(const std::string& filename) {
+        std::lock_guard lk(loadMutex);
+
+        const auto existing = loaded.find(filename);
+        if (existing != loaded.end()) {
+            if (auto texture = existing->second.lock())
+                return texture;
+        }
+
+        const auto tiledFilename = filename + ".bvtex";
+
+        std::error_code ec;
+        const auto sourceTime = std::filesystem::last_write_time(filename, ec);
+        const bool sourceExists = !ec;
+        const auto tiledTime = std::filesystem::last_write_time(tiledFilename, ec);
+        const bool tiledExists = !ec;
+
+        if (!tiledExists || (sourceExists && sourceTime > tiledTime)) {
+            buildTiledFile(filename, tiledFilename);
+        }
+
+        const uint32_t id = cache->newTextureId();
+        const int fd = ::open(tiledFilename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open tiled texture: " + tiledFilename);
+        }
+
+        FileHeader header{};
+        std::vector<LevelHeader> levels;
+        if (!readTiledHeader(fd, header, levels)) {
+            ::close(fd);
+            throw std::runtime_error("Invalid tiled texture: " + tiledFilename);
+        }
+
+        auto texture = std::shared_ptr<Texture>(
+                new Texture(std::make_unique<Texture::Impl>(cache, id, fd, header, std::move(levels))));
+        loaded[filename] = texture;
+        return texture;
+    }
+
+    size_t residentBytes() const {
+        return cache->residentBytes();
+    }
+
+private:
+    std::shared_ptr<TileCache> cache;
+    std::mutex loadMutex;
+    std::unordered_map<std::string, std::weak_ptr<Texture>> loaded;
+};
+
+TextureCache::TextureCache(const size_t maxResidentBytes) : impl(std::make_unique<Impl>(maxResidentBytes)) {}
+
+std::shared_ptr<Texture> TextureCache::load(const std::string& filename) {
+    return impl->load(filename);
+}
+
+size_t TextureCache::residentBytes() const {
+    return impl->residentBytes();
+}
+
+TextureCache::~TextureCache() = default;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "GlmTypes.h"
+
+namespace bv {
+
+// Image texture backed by a tiled, mip-mapped file on disk. Texels are paged in tile by tile through the
+// TextureCache that loaded it, so only the tiles actually touched by rays are resident.
+class Texture {
+public:
+    int width() const;
+    int height() const;
+    int levels() const;
+
+    // Trilinearly filtered lookup. footprint is the projected width of the ray cone at the hit and
+    // uvDensity the UV area per unit of surface area (see Hit), together they select the mip level.
+    vec3f sample(const vec2d& uv, double footprint, double uvDensity) const;
+
+    // Trilinearly filtered lookup at an explicit, fractional mip level.
+    vec3f sampleLevel(const vec2d& uv, double lod) const;
+
+    ~Texture();
+
+private:
+    friend class TextureCache;
+
+    class Impl;
+    Texture(std::unique_ptr<Impl> impl);
+
+    std::unique_ptr<Impl> impl;
+};
+
+// Size-bounded, thread safe cache of texture tiles shared by every texture it loads. Least recently used tiles
+// are evicted once the resident size exceeds the budget.
+class TextureCache {
+public:
+    TextureCache(size_t maxResidentBytes);
+
+    // Loads a binary PPM (P6). On first use the image is converted to a tiled mip pyramid written next to it as
+    // <filename>.bvtex, later loads read only the header of that file. Every load that is not of a texture still
+    // alive takes a new id, and loading throws once 2^19 have been taken.
+    std::shared_ptr<Texture> load(const std::string& filename);
+
+    size_t residentBytes() const;
+
+    ~TextureCache();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cmath>
+
+#include "GeometryUtils.h"
+
+//
+// Ray-triangle intersection algorithms. Every kernel is built from the triangle's vertices, can give them back and
+// answers the same question: where in [tMin, tMax] along the ray, if anywhere, it crosses the triangle, edges
+// included. They differ in what they precompute, so in memory per triangle and work per test, and in how rays
+// through a shared edge fall.
+//
+// Kernels are picked at compile time, see createTriangleWith.
+//
+namespace bv {
+
+// Distance along the ray, in multiples of its direction, and barycentric weights of the second and third vertices.
+struct TriangleIntersection {
+    double t;
+    double u;
+    double v;
+};
+
+// Möller and Trumbore 1997: the vertex and two edges, everything else is computed per test.
+class MollerTrumbore {
+public:
+    static constexpr const char* name = "moller-trumbore";
+
+    MollerTrumbore(const vec3d& a, const vec3d& b, const vec3d& c) : v1(a), e1(b - a), e2(c - a) {}
+
+    void vertices(vec3d& a, vec3d& b, vec3d& c) const {
+        a = v1;
+        b = v1 + e1;
+        c = v1 + e2;
+    }
+
+    bool intersect(const Ray& ray, const double tMin, const double tMax, TriangleIntersection& hit) const {
+        const vec3d h = glm::cross(ray.dir, e2);
+        const double a = glm::dot(h, e1);
+
+        if (a > -1e-12 && a < 1e-12)
+            return false;
+
+        const double f = 1.0 / a;
+        const vec3d s = ray.start - v1;
+        const double u = f * glm::dot(s, h);
+
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        const vec3d q = glm::cross(s, e1);
+        const double v = f * glm::dot(ray.dir, q);
+
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+
+        const double t = f * glm::dot(e2, q);
+
+        if (t < tMin || t > tMax)
+            return false;
+
+        hit = {t, u, v};
+        return true;
+    }
+
+private:
+    vec3d v1, e1, e2;
+};
+
+//
+// Baldwin and Weber 2016 (https://jcgt.org/published/0005/03/03/): an affine transform taking the triangle to the
+// unit triangle in the plane z = 0, dropping whichever column the dominant normal axis makes constant. A test is a
+// plane distance and two dot products, at the cost of storing the transform as well as the vertices.
+//
+class BaldwinWeber {
+public:
+    static constexpr const char* name = "baldwin-weber";
+
+    BaldwinWeber(const vec3d& a, const vec3d& b, const vec3d& c) : v1(a), e1(b - a), e2(c - a) {
+        // Unnormalised, the rows then give barycentrics directly.
+        const vec3d n = glm::cross(e1, e2);
+        const double num = glm::dot(v1, n);
+
+        if (std::fabs(n.x) > std::fabs(n.y) && std::fabs(n.x) > std::fabs(n.z)) {
+            const double x1 = b.y * a.z - b.z * a.y;
+            const double x2 = c.y * a.z - c.z * a.y;
+
+            toBarycentric[0] = vec4d(0.0, e2.z / n.x, -e2.y / n.x, x2 / n.x);
+            toBarycentric[1] = vec4d(0.0, -e1.z / n.x, e1.y / n.x, -x1 / n.x);
+            toBarycentric[2] = vec4d(1.0, n.y / n.x, n.z / n.x, -num / n.x);
+        } else if (std::fabs(n.y) > std::fabs(n.z)) {
+            const double x1 = b.z * a.x - b.x * a.z;
+            const double x2 = c.z * a.x - c.x * a.z;
+
+            toBarycentric[0] = vec4d(-e2.z / n.y, 0.0, e2.x / n.y, x2 / n.y);
+            toBarycentric[1] = vec4d(e1.z / n.y, 0.0, -e1.x / n.y, -x1 / n.y);
+            toBarycentric[2] = vec4d(n.x / n.y, 1.0, n.z / n.y, -num / n.y);
+        } else if (n.z != 0.0) {
+            const double x1 = b.x * a.y - b.y * a.x;
+            const double x2 = c.x * a.y - c.y * a.x;
+
+            toBarycentric[0] = vec4d(e2.y / n.z, -e2.x / n.z, 0.0, x2 / n.z);
+            toBarycentric[1] = vec4d(-e1.y / n.z, e1.x / n.z, 0.0, -x1 / n.z);
+            toBarycentric[2] = vec4d(n.x / n.z, n.y / n.z, 1.0, -num / n.z);
+        } else {
+            // Degenerate, no ray ever reaches the plane.
+            toBarycentric[0] = vec4d(0.0, 0.0, 0.0, -1.0);
+            toBarycentric[1] = vec4d(0.0, 0.0, 0.0, -1.0);
+            toBarycentric[2] = vec4d(0.0, 0.0, 0.0, 1.0);
+        }
+    }
+
+    void vertices(vec3d& a, vec3d& b, vec3d& c) const {
+        a = v1;
+        b = v1 + e1;
+        c = v1 + e2;
+    }
+
+    bool intersect(const Ray& ray, const double tMin, const double tMax, TriangleIntersection& hit) const {
+        // Distance from the plane of the ray's start and how fast the ray closes on it.
+        const double transS = glm::dot(toBarycentric[2], vec4d(ray.start, 1.0));
+        const double transD = glm::dot(toBarycentric[2], vec4d(ray.dir, 0.0));
+
+        if (transD == 0.0)
+            return false;
+
+        const double t = -transS / transD;
+
+        if (t < tMin || t > tMax)
+            return false;
+
+        const vec4d p(ray.start + t * ray.dir, 1.0);
+        const double u = glm::dot(toBarycentric[0], p);
+        const double v = glm::dot(toBarycentric[1], p);
+
+        if (u < 0.0 || v < 0.0 || u + v > 1.0)
+            return false;
+
+        hit = {t, u, v};
+        return true;
+    }
+
+private:
+    vec3d v1, e1, e2;
+    mat4x3d toBarycentric;
+};
+
+//
+// Plücker coordinates: the ray passes inside the triangle when it is on the same side of all three edge lines,
+// found from the permuted inner products of its line with theirs. Edge lines and the plane are precomputed, the
+// most memory of any kernel. Precision falls with distance from the origin, as the ray's moment grows.
+//
+class Plucker {
+public:
+    static constexpr const char* name = "plucker";
+
+    Plucker(const vec3d& a, const vec3d& b, const vec3d& c) : v1(a) {
+        // Edge i is opposite vertex i, its side product is that vertex's barycentric weight.
+        edgeDir[0] = c - b;
+        edgeMoment[0] = glm::cross(b, c);
+        edgeDir[1] = a - c;
+        edgeMoment[1] = glm::cross(c, a);
+        edgeDir[2] = b - a;
+        edgeMoment[2] = glm::cross(a, b);
+
+        normal = glm::cross(b - a, c - a);
+        planeDistance = glm::dot(normal, a);
+    }
+
+    void vertices(vec3d& a, vec3d& b, vec3d& c) const {
+        a = v1;
+        b = v1 + edgeDir[2];
+        c = v1 - edgeDir[1];
+    }
+
+    bool intersect(const Ray& ray, const double tMin, const double tMax, TriangleIntersection& hit) const {
+        const vec3d moment = glm::cross(ray.start, ray.dir);
+
+        double side[3];
+        for (int i = 0; i < 3; ++i)
+            side[i] = glm::dot(ray.dir, edgeMoment[i]) + glm::dot(edgeDir[i], moment);
+
+        const bool allPositive = side[0] >= 0.0 && side[1] >= 0.0 && side[2] >= 0.0;
+        const bool allNegative = side[0] <= 0.0 && side[1] <= 0.0 && side[2] <= 0.0;
+        if (!allPositive && !allNegative)
+            return false;
+
+        const double sum = side[0] + side[1] + side[2];
+        const double d = glm::dot(normal, ray.dir);
+
+        if (sum == 0.0 || d == 0.0)
+            return false;
+
+        const double t = (planeDistance - glm::dot(normal, ray.start)) / d;
+
+        if (t < tMin || t > tMax)
+            return false;
+
+        hit = {t, side[1] / sum, side[2] / sum};
+        return true;
+    }
+
+private:
+    vec3d v1;
+    vec3d edgeDir[3];
+    vec3d edgeMoment[3];
+    vec3d normal;
+    double planeDistance;
+};
+
+//
+// Woop, Benthin and Wald 2013 (https://jcgt.org/published/0002/01/05/): vertices are moved into a space where the
+// ray runs along +z from the origin, and the 2D edge functions there are evaluated so that a ray through a shared
+// edge or vertex hits at least one of the triangles either side, falling back to higher precision when one is
+// exactly zero. Stores only the vertices, the ray's shear is worked out per test as nothing is kept per ray.
+//
+class Watertight {
+public:
+    static constexpr const char* name = "watertight";
+
+    Watertight(const vec3d& a, const vec3d& b, const vec3d& c) : v{a, b, c} {}
+
+    void vertices(vec3d& a, vec3d& b, vec3d& c) const {
+        a = v[0];
+        b = v[1];
+        c = v[2];
+    }
+
+    bool intersect(const Ray& ray, const double tMin, const double tMax, TriangleIntersection& hit) const {
+        // The dominant axis of the ray becomes z, swapping the others if needed to keep the winding.
+        const vec3d absDir = glm::abs(ray.dir);
+        const int kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+        int kx = (kz + 1) % 3;
+        int ky = (kx + 1) % 3;
+        if (ray.dir[kz] < 0.0)
+            std::swap(kx, ky);
+
+        if (ray.dir[kz] == 0.0)
+            return false;
+
+        const double sx = ray.dir[kx] / ray.dir[kz];
+        const double sy = ray.dir[ky] / ray.dir[kz];
+        const double sz = 1.0 / ray.dir[kz];
+
+        const vec3d a = v[0] - ray.start;
+        const vec3d b = v[1] - ray.start;
+        const vec3d c = v[2] - ray.start;
+
+        const double ax = a[kx] - sx * a[kz];
+        const double ay = a[ky] - sy * a[kz];
+        const double bx = b[kx] - sx * b[kz];
+        const double by = b[ky] - sy * b[kz];
+        const double cx = c[kx] - sx * c[kz];
+        const double cy = c[ky] - sy * c[kz];
+
+        double u = cx * by - cy * bx;
+        double v = ax * cy - ay * cx;
+        double w = bx * ay - by * ax;
+
+        if (u == 0.0 || v == 0.0 || w == 0.0) {
+            using ld = long double;
+            u = double(ld(cx) * ld(by) - ld(cy) * ld(bx));
+            v = double(ld(ax) * ld(cy) - ld(ay) * ld(cx));
+            w = double(ld(bx) * ld(ay) - ld(by) * ld(ax));
+        }
+
+        if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+            return false;
+
+        const double det = u + v + w;
+        if (det == 0.0)
+            return false;
+
+        const double t = (u * sz * a[kz] + v * sz * b[kz] + w * sz * c[kz]) / det;
+
+        if (t < tMin || t > tMax)
+            return false;
+
+        hit = {t, v / det, w / det};
+        return true;
+    }
+
+private:
+    vec3d v[3];
+};
+}
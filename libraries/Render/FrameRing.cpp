@@ -0,0 +1,313 @@
+#include "FrameRing.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bv {
+
+namespace {
+constexpr uint32_t ringMagic = 0x62764652; // "RFvb"
+constexpr uint32_t ringVersion = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring counters must be lock free to be shared");
+
+//
+// Layout of the shared memory: the header, then slotCount slots of slotBytes, each a SlotHeader followed by the
+// pixels. Everything a consumer relies on is 64 byte aligned, so counters never share a cache line with pixels.
+//
+struct RingHeader {
+    // Written last, with release, so a consumer never sees a half initialised ring as valid.
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+    uint32_t reserved;
+    uint64_t slotBytes;
+
+    // Frames published so far, frame i lies in slot i % slotCount.
+    alignas(64) std::atomic<uint64_t> published;
+    std::atomic<uint32_t> closed;
+};
+
+struct alignas(64) SlotHeader {
+    // Twice the times the slot was written, plus one while it is being written.
+    std::atomic<uint64_t> sequence;
+    uint64_t frame;
+    int64_t publishedNs;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t samples;
+};
+
+constexpr size_t alignUp(const size_t size) {
+    return (size + 63) & ~size_t(63);
+}
+
+constexpr size_t slotsOffset = alignUp(sizeof(RingHeader));
+
+std::runtime_error systemError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+int64_t steadyNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+}
+
+class FramePublisher::Impl {
+public:
+    Impl(const std::string& name, const int maxWidth, const int maxHeight, const int slotCount) : name(name) {
+        if (maxWidth <= 0 || maxHeight <= 0 || slotCount < 2)
+            throw std::invalid_argument("A frame ring needs a positive size and at least two slots");
+
+        slotBytes = sizeof(SlotHeader) + alignUp(size_t(maxWidth) * size_t(maxHeight) * sizeof(uint32_t));
+        size = slotsOffset + size_t(slotCount) * slotBytes;
+
+        // A ring left behind by a producer that crashed is replaced, not reused.
+        ::shm_unlink(name.c_str());
+
+        const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            throw systemError("Could not create shared memory " + name);
+
+        if (::ftruncate(fd, off_t(size)) != 0) {
+            const auto error = systemError("Could not size shared memory " + name);
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw error;
+        }
+
+        void* mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            const auto error = systemError("Could not map shared memory " + name);
+            ::shm_unlink(name.c_str());
+            throw error;
+        }
+
+        memory = static_cast<uint8_t*>(mapped);
+
+        // The memory starts zeroed, the atomics only need constructing.
+        header = new (memory) RingHeader();
+        header->version = ringVersion;
+        header->slotCount = uint32_t(slotCount);
+        header->maxWidth = uint32_t(maxWidth);
+        header->maxHeight = uint32_t(maxHeight);
+        header->slotBytes = slotBytes;
+        for (int i = 0; i < slotCount; ++i)
+            new (memory + slotsOffset + size_t(i) * slotBytes) SlotHeader();
+
+        __atomic_store_n(&header->magic, ringMagic, __ATOMIC_RELEASE);
+    }
+
+    void publish(const FrameInfo& info, const std::function<void(uint32_t*)>& write) {
+        if (info.width <= 0 || info.height <= 0 || uint32_t(info.width) > header->maxWidth ||
+            uint32_t(info.height) > header->maxHeight)
+            throw std::invalid_argument("Frame does not fit the shared memory ring");
+
+        std::lock_guard lk(publishMutex);
+
+        const uint64_t index = header->published.load(std::memory_order_relaxed);
+        uint8_t* slotMemory = memory + slotsOffset + size_t(index % header->slotCount) * slotBytes;
+        auto* slot = reinterpret_cast<SlotHeader*>(slotMemory);
+
+        //
+        // Odd while the slot is rewritten. The fence keeps the pixel stores below from becoming visible before it,
+        // a consumer reading the old frame then sees the counter change.
+        //
+        const uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot->frame = info.frame;
+        slot->width = uint32_t(info.width);
+        slot->height = uint32_t(info.height);
+        slot->format = uint32_t(info.format);
+        slot->samples = uint32_t(info.samples);
+
+        write(reinterpret_cast<uint32_t*>(slotMemory + sizeof(SlotHeader)));
+
+        slot->publishedNs = steadyNow();
+        slot->sequence.store(sequence + 2, std::memory_order_release);
+        header->published.store(index + 1, std::memory_order_release);
+    }
+
+    uint64_t published() const {
+        return header->published.load(std::memory_order_acquire);
+    }
+
+    ~Impl() {
+        header->closed.store(1, std::memory_order_release);
+        ::munmap(memory, size);
+        ::shm_unlink(name.c_str());
+    }
+
+private:
+    std::string name;
+    size_t slotBytes;
+    size_t size;
+    uint8_t* memory;
+    RingHeader* header;
+    std::mutex publishMutex;
+};
+
+FramePublisher::FramePublisher(const std::string& name, const int maxWidth, const int maxHeight, const int slotCount)
+    : impl(std::make_unique<Impl>(name, maxWidth, maxHeight, slotCount)) {}
+
+void FramePublisher::publish(const FrameInfo& info, const std::function<void(uint32_t*)>& write) {
+    impl->publish(info, write);
+}
+
+void FramePublisher::publish(const FrameInfo& info, const uint32_t* pixels) {
+    impl->publish(info, [&info, pixels](uint32_t* out) {
+        std::memcpy(out, pixels, size_t(info.width) * size_t(info.height) * sizeof(uint32_t));
+    });
+}
+
+uint64_t FramePublisher::published() const {
+    return impl->published();
+}
+
+FramePublisher::~FramePublisher() = default;
+
+class FrameSubscriber::Impl {
+public:
+    Impl(const std::string& name) {
+        const int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw systemError("Could not open shared memory " + name);
+
+        struct stat status {};
+        if (::fstat(fd, &status) != 0 || size_t(status.st_size) < slotsOffset) {
+            ::close(fd);
+            throw std::runtime_error("Shared memory " + name + " is not a frame ring");
+        }
+
+        size = size_t(status.st_size);
+        void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            throw systemError("Could not map shared memory " + name);
+
+        memory = static_cast<const uint8_t*>(mapped);
+        header = reinterpret_cast<const RingHeader*>(memory);
+
+        if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != ringMagic || header->version != ringVersion ||
+            header->slotCount < 2 || header->slotBytes < sizeof(SlotHeader) ||
+            size != slotsOffset + size_t(header->slotCount) * header->slotBytes) {
+            ::munmap(const_cast<uint8_t*>(memory), size);
+            throw std::runtime_error("Shared memory " + name + " is not a frame ring, or not yet initialised");
+        }
+
+        // The newest frame already published is the first one handed out.
+        const uint64_t published = header->published.load(std::memory_order_acquire);
+        next = published > 0 ? published - 1 : 0;
+    }
+
+    bool acquire(FrameView& view) {
+        //
+        // The producer may lap the slot between reading the count and the slot. Retried against the new count a few
+        // times, which only fails for a consumer descheduled for a whole ring's worth of frames each time.
+        //
+        for (int attempt = 0; attempt < 8; ++attempt) {
+            const uint64_t published = header->published.load(std::memory_order_acquire);
+            if (published <= next)
+                return false;
+
+            const uint64_t index = published - 1;
+            const uint8_t* slotMemory = memory + slotsOffset + size_t(index % header->slotCount) * header->slotBytes;
+            const auto* slot = reinterpret_cast<const SlotHeader*>(slotMemory);
+
+            const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * (index / header->slotCount + 1))
+                continue;
+
+            view.info.frame = slot->frame;
+            view.info.width = int(slot->width);
+            view.info.height = int(slot->height);
+            view.info.format = FrameFormat(slot->format);
+            view.info.samples = int(slot->samples);
+            view.info.publishedNs = slot->publishedNs;
+            view.pixels = reinterpret_cast<const uint32_t*>(slotMemory + sizeof(SlotHeader));
+            view.index = index;
+            view.sequence = sequence;
+
+            if (!unchanged(view))
+                continue;
+
+            if (view.info.width <= 0 || view.info.height <= 0 || slot->width > header->maxWidth ||
+                slot->height > header->maxHeight)
+                return false;
+
+            skippedFrames += index - next;
+            next = index + 1;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool unchanged(const FrameView& view) const {
+        const auto* slot = reinterpret_cast<const SlotHeader*>(memory + slotsOffset +
+                                                               size_t(view.index % header->slotCount) *
+                                                                   header->slotBytes);
+
+        // Orders the reads of the frame before the check of the counter.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+    }
+
+    uint64_t skipped() const {
+        return skippedFrames;
+    }
+
+    bool closed() const {
+        return header->closed.load(std::memory_order_acquire) != 0;
+    }
+
+    ~Impl() {
+        ::munmap(const_cast<uint8_t*>(memory), size);
+    }
+
+private:
+    size_t size;
+    const uint8_t* memory;
+    const RingHeader* header;
+    // Index of the first frame not yet considered.
+    uint64_t next;
+    uint64_t skippedFrames = 0;
+};
+
+FrameSubscriber::FrameSubscriber(const std::string& name) : impl(std::make_unique<Impl>(name)) {}
+
+bool FrameSubscriber::acquire(FrameView& view) {
+    return impl->acquire(view);
+}
+
+bool FrameSubscriber::unchanged(const FrameView& view) const {
+    return impl->unchanged(view);
+}
+
+uint64_t FrameSubscriber::skipped() const {
+    return impl->skipped();
+}
+
+bool FrameSubscriber::closed() const {
+    return impl->closed();
+}
+
+FrameSubscriber::~FrameSubscriber() = default;
+}
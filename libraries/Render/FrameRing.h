@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace bv {
+
+enum class FrameFormat : uint32_t {
+    ARGB8888 = 1
+};
+
+struct FrameInfo {
+    // Numbered by the producer, e.g. the index of a sequence frame or the pass of a progressive preview.
+    uint64_t frame = 0;
+    int width = 0;
+    int height = 0;
+    FrameFormat format = FrameFormat::ARGB8888;
+    // Samples per pixel the frame was resolved from.
+    int samples = 0;
+    // steady_clock time at which the frame was published, comparable between processes on the same machine.
+    int64_t publishedNs = 0;
+};
+
+//
+// Publishes frames into a POSIX shared memory ring (shm_open) of slotCount slots, each large enough for a maxWidth by
+// maxHeight image, so that local processes read them without disk I/O. The producer never waits on consumers: each
+// frame overwrites the oldest slot, and a consumer that falls behind skips to the newest frame.
+//
+// Every slot holds a sequence counter which is odd while the slot is written, consumers read a frame in place and
+// check the counter afterwards to know it was not overwritten meanwhile, see FrameSubscriber. No locks are shared
+// between processes.
+//
+// The name follows shm_open, e.g. "/bv-frames". Creating a publisher replaces any ring left under that name, the
+// destructor marks the ring closed and unlinks it, consumers still attached keep their mapping.
+//
+class FramePublisher {
+public:
+    FramePublisher(const std::string& name, int maxWidth, int maxHeight, int slotCount = 4);
+
+    // Publishes a frame whose pixels write fills in place, in the ring, given the frame's row-major pixels. May be
+    // called from any thread, frames are published one at a time in the order of the calls.
+    void publish(const FrameInfo& info, const std::function<void(uint32_t* pixels)>& write);
+
+    // Copies pixels of info.width by info.height into the ring.
+    void publish(const FrameInfo& info, const uint32_t* pixels);
+
+    uint64_t published() const;
+
+    ~FramePublisher();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// A frame in the ring, valid to read until the producer comes back around to its slot.
+struct FrameView {
+    FrameInfo info;
+    const uint32_t* pixels = nullptr;
+    // Index of the frame among all those published, and the sequence of its slot when it was acquired.
+    uint64_t index = 0;
+    uint64_t sequence = 0;
+};
+
+//
+// Reads frames from a FramePublisher's ring, in another process or the same one. acquire() hands out the newest frame
+// where it lies in shared memory; once done with it, unchanged() tells whether the producer overwrote it meanwhile,
+// in which case whatever was read must be discarded.
+//
+class FrameSubscriber {
+public:
+    // Throws if there is no ring of that name or it was not created by a FramePublisher.
+    FrameSubscriber(const std::string& name);
+
+    // Points view at the newest frame published since the last one acquired. Returns false if there is none.
+    bool acquire(FrameView& view);
+
+    bool unchanged(const FrameView& view) const;
+
+    // Frames published since the subscriber was created that were never acquired.
+    uint64_t skipped() const;
+
+    // True once the publisher was destroyed, frames published before then can still be acquired.
+    bool closed() const;
+
+    ~FrameSubscriber();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+}
@@ -0,0 +1,175 @@
+#include "ImageIO.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+
+namespace bv {
+
+namespace {
+void putU16(std::ofstream& out, const uint16_t v) {
+    const char bytes[2] = {char(v & 0xff), char((v >> 8) & 0xff)};
+    out.write(bytes, 2);
+}
+
+void putU32(std::ofstream& out, const uint32_t v) {
+    const char bytes[4] = {char(v & 0xff), char((v >> 8) & 0xff), char((v >> 16) & 0xff), char((v >> 24) & 0xff)};
+    out.write(bytes, 4);
+}
+}
+
+bool writeBMP(const std::string& filename, const uint32_t* pixels, const int width, const int height) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cout << "Failed to save image: could not open " << filename << "\n";
+        return false;
+    }
+
+    constexpr uint32_t headerSize = 14 + 40;
+    const uint32_t imageSize = uint32_t(width) * uint32_t(height) * 4;
+
+    // File header
+    out.write("BM", 2);
+    putU32(out, headerSize + imageSize);
+    putU32(out, 0);
+    putU32(out, headerSize);
+
+    // BITMAPINFOHEADER, negative height for top-down rows
+    putU32(out, 40);
+    putU32(out, uint32_t(width));
+    putU32(out, uint32_t(-height));
+    putU16(out, 1);
+    putU16(out, 32);
+    putU32(out, 0);
+    putU32(out, imageSize);
+    putU32(out, 2835);
+    putU32(out, 2835);
+    putU32(out, 0);
+    putU32(out, 0);
+
+    // BGRA little-endian is exactly the in-memory layout of ARGB8888 words.
+    for (int i = 0; i < width * height; ++i) {
+        putU32(out, pixels[i]);
+    }
+
+    if (!out) {
+        std::cout << "Failed to save image: error writing " << filename << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+void encodeQOI(const uint32_t* pixels, const int width, const int height, std::vector<uint8_t>& out) {
+    constexpr uint8_t opIndex = 0x00;
+    constexpr uint8_t opDiff = 0x40;
+    constexpr uint8_t opLuma = 0x80;
+    constexpr uint8_t opRun = 0xc0;
+    constexpr uint8_t opRGB = 0xfe;
+    constexpr int maxRun = 62;
+
+    const auto putBE32 = [&out](const uint32_t v) {
+        out.push_back(uint8_t(v >> 24));
+        out.push_back(uint8_t(v >> 16));
+        out.push_back(uint8_t(v >> 8));
+        out.push_back(uint8_t(v));
+    };
+
+    const size_t count = size_t(width) * size_t(height);
+    // Worst case is every pixel as a 4 byte RGB op, plus the 14 byte header and 8 byte end marker.
+    out.reserve(out.size() + count * 4 + 22);
+
+    out.insert(out.end(), {'q', 'o', 'i', 'f'});
+    putBE32(uint32_t(width));
+    putBE32(uint32_t(height));
+    out.push_back(3);
+    out.push_back(0);
+
+    // Alpha is always opaque in the file, the RGB is all the renderer writes. Unused slots hold a value no pixel
+    // can match: the decoder starts them at transparent black, not opaque black.
+    uint32_t index[64];
+    std::fill(std::begin(index), std::end(index), ~0u);
+    uint32_t previous = 0;
+    int run = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t pixel = pixels[i] & 0xffffffu;
+
+        if (pixel == previous) {
+            if (++run == maxRun) {
+                out.push_back(uint8_t(opRun | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            out.push_back(uint8_t(opRun | (run - 1)));
+            run = 0;
+        }
+
+        const int r = int(pixel >> 16);
+        const int g = int((pixel >> 8) & 0xff);
+        const int b = int(pixel & 0xff);
+        const int slot = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+
+        if (index[slot] == pixel) {
+            out.push_back(uint8_t(opIndex | slot));
+        } else {
+            index[slot] = pixel;
+
+            // Channel differences wrap around, as the decoder adds them modulo 256.
+            const int dr = int(int8_t(uint8_t(r - int(previous >> 16))));
+            const int dg = int(int8_t(uint8_t(g - int((previous >> 8) & 0xff))));
+            const int db = int(int8_t(uint8_t(b - int(previous & 0xff))));
+            const int drg = dr - dg;
+            const int dbg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back(uint8_t(opDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                out.push_back(uint8_t(opLuma | (dg + 32)));
+                out.push_back(uint8_t((drg + 8) << 4 | (dbg + 8)));
+            } else {
+                out.insert(out.end(), {opRGB, uint8_t(r), uint8_t(g), uint8_t(b)});
+            }
+        }
+
+        previous = pixel;
+    }
+
+    if (run > 0)
+        out.push_back(uint8_t(opRun | (run - 1)));
+
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+bool writeQOI(const std::string& filename, const uint32_t* pixels, const int width, const int height) {
+    std::vector<uint8_t> encoded;
+    encodeQOI(pixels, width, height, encoded);
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cout << "Failed to save image: could not open " << filename << "\n";
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char*>(encoded.data()), std::streamsize(encoded.size()));
+
+    if (!out) {
+        std::cout << "Failed to save image: error writing " << filename << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool writeImage(const std::string& filename, const uint32_t* pixels, const int width, const int height) {
+    const auto dot = filename.rfind('.');
+    if (dot != std::string::npos && filename.compare(dot, std::string::npos, ".qoi") == 0)
+        return writeQOI(filename, pixels, width, height);
+
+    return writeBMP(filename, pixels, width, height);
+}
+}
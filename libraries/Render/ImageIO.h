@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bv {
+
+// Writes a 32-bit ARGB8888 buffer as an uncompressed BMP, matching SDLScreen::saveImage.
+bool writeBMP(const std::string& filename, const uint32_t* pixels, int width, int height);
+
+// Encodes a 32-bit ARGB8888 buffer as a three channel QOI image, appending it to out. Smooth gradients and flat
+// regions typically shrink to a quarter or less of the BMP size, at a cost of a few ns per pixel.
+void encodeQOI(const uint32_t* pixels, int width, int height, std::vector<uint8_t>& out);
+
+bool writeQOI(const std::string& filename, const uint32_t* pixels, int width, int height);
+
+// Writes with the format picked by the extension of filename, ".qoi" or otherwise BMP.
+bool writeImage(const std::string& filename, const uint32_t* pixels, int width, int height);
+}
@@ -0,0 +1,115 @@
+#include "ImageWriter.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "ImageIO.h"
+
+namespace bv {
+
+class ImageWriter::Impl {
+public:
+    Impl(const size_t maxQueued) : maxQueued(std::max(maxQueued, size_t(1))), thread([this]() { run(); }) {}
+
+    void write(const std::string& filename, std::vector<uint32_t> pixels, const int width, const int height) {
+        std::unique_lock lk(queueMutex);
+        spaceAvailable.wait(lk, [this]() {
+            return queue.size() < maxQueued;
+        });
+        queue.push_back({filename, std::move(pixels), width, height});
+        lk.unlock();
+        workAvailable.notify_one();
+    }
+
+    void flush() {
+        std::unique_lock lk(queueMutex);
+        idle.wait(lk, [this]() {
+            return queue.empty() && !writing;
+        });
+    }
+
+    size_t failures() const {
+        std::lock_guard lk(queueMutex);
+        return failed;
+    }
+
+    ~Impl() {
+        {
+            std::lock_guard lk(queueMutex);
+            stop = true;
+        }
+        workAvailable.notify_one();
+        thread.join();
+    }
+
+private:
+    struct Job {
+        std::string filename;
+        std::vector<uint32_t> pixels;
+        int width;
+        int height;
+    };
+
+    void run() {
+        std::unique_lock lk(queueMutex);
+        for (;;) {
+            workAvailable.wait(lk, [this]() {
+                return stop || !queue.empty();
+            });
+
+            // Stopping still drains the queue, nothing handed to write() is dropped.
+            if (queue.empty())
+                break;
+
+            Job job = std::move(queue.front());
+            queue.pop_front();
+            writing = true;
+            lk.unlock();
+            spaceAvailable.notify_one();
+
+            const bool written = writeImage(job.filename, job.pixels.data(), job.width, job.height);
+
+            lk.lock();
+            writing = false;
+            if (!written)
+                failed++;
+            if (queue.empty())
+                idle.notify_all();
+        }
+    }
+
+    const size_t maxQueued;
+    std::deque<Job> queue;
+    bool writing = false;
+    bool stop = false;
+    size_t failed = 0;
+
+    mutable std::mutex queueMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable spaceAvailable;
+    std::condition_variable idle;
+
+    // Started last, once everything it touches is constructed.
+    std::thread thread;
+};
+
+ImageWriter::ImageWriter(const size_t maxQueued) : impl(std::make_unique<Impl>(maxQueued)) {}
+
+void ImageWriter::write(const std::string& filename, std::vector<uint32_t> pixels, const int width,
+                        const int height) {
+    impl->write(filename, std::move(pixels), width, height);
+}
+
+void ImageWriter::flush() {
+    impl->flush();
+}
+
+size_t ImageWriter::failures() const {
+    return impl->failures();
+}
+
+ImageWriter::~ImageWriter() = default;
+}
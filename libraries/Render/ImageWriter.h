@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bv {
+
+// Encodes and writes images on a thread of its own, so neither compression nor disk I/O holds up tracing. At most
+// maxQueued images wait to be written, further writes block until one is done, bounding the memory held by a
+// renderer that outpaces the disk.
+class ImageWriter {
+public:
+    ImageWriter(size_t maxQueued = 4);
+
+    // Queues an ARGB8888 image, taking ownership of its pixels. The format follows the extension, see writeImage.
+    void write(const std::string& filename, std::vector<uint32_t> pixels, int width, int height);
+
+    // Blocks until every queued image has been written.
+    void flush();
+
+    // Images that could not be written so far.
+    size_t failures() const;
+
+    // Flushes before returning.
+    ~ImageWriter();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+}
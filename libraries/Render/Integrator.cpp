@@ -0,0 +1,238 @@
+#include "Integrator.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "CpuDispatch.h"
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Material.h"
+#include "PhotonMap.h"
+#include "RadianceCache.h"
+#include "Rasterizer.h"
+#include "Scenes.h"
+
+namespace bv {
+
+namespace {
+// Hits are searched for in this range of t along every ray.
+constexpr double minDistance = 1e-3;
+constexpr double maxDistance = 1e12;
+
+// Where a path is: how many diffuse bounces it has taken, and whether it has only bounced specularly since the first.
+struct PathState {
+    int diffuseBounces = 0;
+    bool caustic = false;
+
+    PathState next(const bool diffuse) const {
+        if (diffuse)
+            return {diffuseBounces + 1, false};
+        return {diffuseBounces, diffuseBounces == 1};
+    }
+};
+
+vec3f pathColour(Scene& scene, const Ray& ray, int depth, PathState state, const PathCaches& caches);
+
+vec3f shade(Scene& scene, const Ray& ray, const Hit& hit, const int depth, const PathState state,
+            const PathCaches& caches) {
+    Ray scattered{};
+    vec3f attenuation(0.0f, 0.0f, 0.0f);
+
+    const bool diffuse = scene.materials().diffuse(hit.material);
+
+    if (!scene.materials().scatter(hit.material, ray, hit, attenuation, scattered))
+        return vec3f(0.0f, 0.0f, 0.0f);
+
+    //
+    // The first diffuse hit, where caustics are seen, takes them from the photon map. Lambertian reflectance is
+    // albedo / pi and the attenuation already holds the albedo. Later hits leave them to the path, they are dimmed by
+    // the bounces before.
+    //
+    vec3f caustic(0.0f, 0.0f, 0.0f);
+    if (caches.caustics && diffuse && state.diffuseBounces == 0)
+        caustic = caches.caustics->irradiance(hit.pos, hit.normal) * float(1.0 / M_PI);
+
+    //
+    // Past the first diffuse bounce a path ends at the cached incoming radiance once the cell holds enough paths,
+    // until then it carries on and adds what it finds to the cell.
+    //
+    size_t slot = RadianceCache::none;
+    if (caches.radiance && diffuse && state.diffuseBounces > 0) {
+        slot = caches.radiance->find(hit.pos, hit.normal);
+
+        vec3f cached;
+        if (slot != RadianceCache::none && caches.radiance->lookup(slot, cached))
+            return attenuation * (caustic + cached);
+    }
+
+    const vec3f incoming = pathColour(scene, scattered, depth - 1, state.next(diffuse), caches);
+
+    if (slot != RadianceCache::none)
+        caches.radiance->record(slot, incoming);
+
+    return attenuation * (caustic + incoming);
+}
+
+vec3f pathColour(Scene& scene, const Ray& ray, const int depth, const PathState state, const PathCaches& caches) {
+    vec3f black(0.0f,0.0f,0.0f);
+
+    if (depth <= 0)
+        return black;
+
+    Hit hit{};
+
+    if (scene.intersect(ray, hit, minDistance, maxDistance)) {
+        return shade(scene, ray, hit, depth, state, caches);
+    }
+
+    // A caustic, which the photon map has already added where the path first bounced diffusely.
+    if (caches.caustics && state.caustic)
+        return black;
+
+    return skyColour(ray.dir);
+}
+
+// Colour along a camera ray whose first hit was rasterized. Only that primitive is intersected, the ray is traced
+// through the whole scene if it misses.
+vec3f primaryColour(Scene& scene, const Ray& ray, const uint32_t primitive, const int depth,
+                    const PathCaches& caches) {
+    if (depth <= 0)
+        return vec3f(0.0f, 0.0f, 0.0f);
+
+    if (primitive != VisibilityBuffer::trace) {
+        Hit hit{};
+        if (scene.primitive(primitive).intersect(ray, hit, minDistance, maxDistance)) {
+            hit.primitive = primitive;
+            return shade(scene, ray, hit, depth, {}, caches);
+        }
+    }
+
+    return pathColour(scene, ray, depth, {}, caches);
+}
+}
+
+vec3f skyColour(const vec3d& dir) {
+    const auto unitRayDir = glm::normalize(dir);
+    const float t = 0.5f * (unitRayDir.y + 1.0f);
+    return (1.0f - t) * vec3f(1.0f, 1.0f, 1.0f) + t * vec3f(0.5f, 0.7f, 1.0f);
+}
+
+vec3f rayColour(Scene& scene, const Ray& ray, const int depth, const PathCaches& caches) {
+    return pathColour(scene, ray, depth, {}, caches);
+}
+
+std::vector<Tile> makeTiles(const int width, const int height, const int tileSize) {
+    std::vector<Tile> tiles;
+    tiles.reserve(((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize));
+
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            tiles.push_back({x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)});
+        }
+    }
+
+    return tiles;
+}
+
+Ray primaryRay(const Camerad& camera, const double x, const double y) {
+    return Ray{camera.trans, camera.directionFromPixelUnnormalised({x, y}), 0.0, camera.pixelSpreadAngle()};
+}
+
+bool traceTile(Scene& scene, const Camerad& camera, const Tile& tile, const int numSamples, const int maxBounces,
+               vec3f* radiance, const CancellationToken* cancel, const VisibilityBuffer* visibility,
+               const PathCaches& caches) {
+    const float scale = 1.0f / numSamples;
+
+    for (int y = tile.y0; y < tile.y1; y++) {
+        if (cancel && cancel->cancelled())
+            return false;
+
+        for (int x = tile.x0; x < tile.x1; x++) {
+            vec3f colour(0.0f, 0.0f, 0.0f);
+
+            if (visibility) {
+                const int rasterized = std::min(numSamples, visibility->samplesPerPixel);
+                for (int s = 0; s < rasterized; ++s) {
+                    const auto& offset = visibility->offsets[s];
+                    colour += primaryColour(scene, primaryRay(camera, x + offset.x, y + offset.y),
+                                            visibility->primitive[visibility->index(x, y, s)], maxBounces, caches);
+                }
+
+                // The buffer's positions are shared by every pixel, samples beyond them are jittered afresh and
+                // traced from the camera so antialiasing keeps converging to the box filtered pixel.
+                for (int i = rasterized; i < numSamples; ++i) {
+                    colour += rayColour(scene, primaryRay(camera, x + randomDouble(), y + randomDouble()), maxBounces,
+                                        caches);
+                }
+
+                colour *= scale;
+            } else if (numSamples > 1) {
+                for (int i = 0; i < numSamples; ++i) {
+                    colour += rayColour(scene, primaryRay(camera, x + randomDouble(), y + randomDouble()), maxBounces,
+                                        caches);
+                }
+
+                colour *= scale;
+            } else {
+                colour = rayColour(scene, primaryRay(camera, x, y), maxBounces, caches);
+            }
+
+            radiance[y * camera.imageWidth + x] = colour;
+        }
+    }
+
+    return true;
+}
+
+bool accumulateTile(Scene& scene, const Camerad& camera, const Tile& tile, const int maxBounces, vec3f* sum,
+                    float* count, const CancellationToken* cancel, const VisibilityBuffer* visibility,
+                    const int visibilitySample, const PathCaches& caches) {
+    for (int y = tile.y0; y < tile.y1; y++) {
+        if (cancel && cancel->cancelled())
+            return false;
+
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const int i = y * camera.imageWidth + x;
+
+            if (visibility) {
+                const auto& offset = visibility->offsets[visibilitySample];
+                sum[i] += primaryColour(scene, primaryRay(camera, x + offset.x, y + offset.y),
+                                        visibility->primitive[visibility->index(x, y, visibilitySample)],
+                                        maxBounces, caches);
+            } else {
+                sum[i] += rayColour(scene, primaryRay(camera, x + randomDouble(), y + randomDouble()), maxBounces,
+                                    caches);
+            }
+
+            count[i] += 1.0f;
+        }
+    }
+
+    return true;
+}
+
+vec3f gammaCorrect(const vec3f& colour) {
+    return {std::sqrt(colour.x), std::sqrt(colour.y), std::sqrt(colour.z)};
+}
+
+uint32_t packARGB(const vec3f& colour) {
+    const auto r = uint32_t(std::clamp(255.0f * colour.x, 0.f, 255.f));
+    const auto g = uint32_t(std::clamp(255.0f * colour.y, 0.f, 255.f));
+    const auto b = uint32_t(std::clamp(255.0f * colour.z, 0.f, 255.f));
+
+    return (128u << 24) + (r << 16) + (g << 8) + b;
+}
+
+void resolve(const std::vector<vec3f>& radiance, std::vector<uint32_t>& pixels) {
+    pixels.resize(radiance.size());
+    resolve(radiance.data(), radiance.size(), pixels.data());
+}
+
+void resolve(const vec3f* radiance, const size_t count, uint32_t* pixels) {
+    dispatchCpu([&]() BV_CPU_KERNEL {
+        for (size_t i = 0; i < count; ++i) {
+            pixels[i] = packARGB(gammaCorrect(radiance[i]));
+        }
+    });
+}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GlmTypes.h"
+#include "Camera.h"
+#include "CancellationToken.h"
+#include "GeometryUtils.h"
+
+namespace bv {
+
+class PhotonMap;
+class RadianceCache;
+class Scene;
+struct VisibilityBuffer;
+
+// Rectangular region of the image [x0, x1) x [y0, y1) traced as a single unit of work.
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Optional structures shared by every path of a render.
+struct PathCaches {
+    // Diffuse bounces after the first may end the path at the radiance cached there.
+    RadianceCache* radiance = nullptr;
+    // The first diffuse hit of a path adds the caustic radiance estimated from the photons around it. Paths stop
+    // picking up light that reaches the sky from that hit through specular bounces only, the photons carry it.
+    const PhotonMap* caustics = nullptr;
+};
+
+// Radiance from the sky along dir, what every ray leaving the scene sees.
+vec3f skyColour(const vec3d& dir);
+
+// Radiance along ray from a path of at most depth segments.
+vec3f rayColour(Scene& scene, const Ray& ray, int depth, const PathCaches& caches = {});
+
+// Camera ray through the (fractional) pixel position, carrying the camera's pixel cone.
+Ray primaryRay(const Camerad& camera, double x, double y);
+
+std::vector<Tile> makeTiles(int width, int height, int tileSize);
+
+// Traces every pixel in the tile and writes the mean linear radiance into the full-frame buffer. Returns false if
+// cancel was signalled, checked once per row, leaving the rest of the tile untouched. With a visibility buffer the
+// first samples are taken at its positions and start from its first hits, any beyond them trace camera rays.
+bool traceTile(Scene& scene, const Camerad& camera, const Tile& tile, int numSamples, int maxBounces,
+               vec3f* radiance, const CancellationToken* cancel = nullptr,
+               const VisibilityBuffer* visibility = nullptr, const PathCaches& caches = {});
+
+// Adds one jittered sample per pixel to a running sum and per-pixel sample count, for progressive accumulation.
+// With a visibility buffer the sample is taken at position visibilitySample of every pixel, starting from its
+// rasterized first hit.
+bool accumulateTile(Scene& scene, const Camerad& camera, const Tile& tile, int maxBounces, vec3f* sum, float* count,
+                    const CancellationToken* cancel = nullptr, const VisibilityBuffer* visibility = nullptr,
+                    int visibilitySample = 0, const PathCaches& caches = {});
+
+vec3f gammaCorrect(const vec3f& colour);
+
+uint32_t packARGB(const vec3f& colour);
+
+// Gamma corrects and packs a linear radiance buffer into ARGB8888 pixels.
+void resolve(const std::vector<vec3f>& radiance, std::vector<uint32_t>& pixels);
+
+// Resolves count pixels into memory owned by the caller, e.g. a slot of a FramePublisher.
+void resolve(const vec3f* radiance, size_t count, uint32_t* pixels);
+}
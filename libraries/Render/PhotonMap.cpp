@@ -0,0 +1,210 @@
+#include "PhotonMap.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Integrator.h"
+#include "Material.h"
+#include "ParallelChunks.h"
+#include "Scenes.h"
+
+namespace bv {
+
+namespace {
+// Photons emitted per chunk, each chunk reseeds the generator.
+constexpr size_t emitGrain = 4096;
+// The caller waits on its helpers, so they are queued ahead of any tiles still being traced.
+constexpr int helperPriority = 1;
+// Hits are searched for in this range of t along every photon, as along the integrator's rays.
+constexpr double minDistance = 1e-3;
+constexpr double maxDistance = 1e12;
+
+// Two unit vectors completing an orthonormal basis with unit vector n (Duff et al. 2017).
+void basis(const vec3d& n, vec3d& u, vec3d& v) {
+    const double sign = std::copysign(1.0, n.z);
+    const double a = -1.0 / (sign + n.z);
+    const double b = n.x * n.y * a;
+    u = {1.0 + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    v = {b, sign + n.y * n.y * a, -n.y};
+}
+
+int64_t cellOf(const double x, const double cellSize) {
+    return int64_t(std::floor(x / cellSize));
+}
+}
+
+PhotonMap::PhotonMap(Scene& scene, const PhotonMapSettings& settings, ThreadPool* threadPool)
+    : radius(settings.radius), cellSize(2.0 * settings.radius), bucketStart(2, 0) {
+    const auto& materials = scene.materials();
+
+    AABB sceneBounds;
+    AABB specularBounds;
+    for (size_t i = 0; i < scene.size(); ++i) {
+        const Geometry& primitive = scene.primitive(i);
+        const AABB bounds = primitive.bounds();
+        sceneBounds.extend(bounds);
+
+        // A primitive of several materials may have specular parts.
+        MaterialId material;
+        if (!primitive.uniformMaterial(material) || !materials.diffuse(material))
+            specularBounds.extend(bounds);
+    }
+
+    if (specularBounds.empty() || settings.photons == 0)
+        return;
+
+    //
+    // Photons leave from a disk facing their direction, as wide as the sphere around the specular primitives and far
+    // enough back to be outside the scene. Each carries the sky radiance it leaves with times its share of the flux
+    // through every such disk.
+    //
+    const vec3d targetCentre = 0.5 * (specularBounds.min + specularBounds.max);
+    const double targetRadius = 0.5 * glm::length(specularBounds.max - specularBounds.min);
+    const vec3d sceneCentre = 0.5 * (sceneBounds.min + sceneBounds.max);
+    const double distance = glm::length(targetCentre - sceneCentre) +
+                            0.5 * glm::length(sceneBounds.max - sceneBounds.min) + targetRadius;
+    const double flux = 4.0 * M_PI * M_PI * targetRadius * targetRadius / double(settings.photons);
+
+    const size_t chunks = (settings.photons + emitGrain - 1) / emitGrain;
+    std::vector<std::vector<vec3f>> storedPositions(chunks);
+    std::vector<std::vector<Photon>> stored(chunks);
+
+    parallelChunks(threadPool, chunks, [&](const size_t chunk) {
+        seedRandom(mix(settings.seed ^ mix(chunk)));
+
+        const size_t end = std::min(settings.photons, (chunk + 1) * emitGrain);
+        for (size_t i = chunk * emitGrain; i < end; ++i) {
+            const vec3d dir = randomUnitVector();
+            vec3d u, v;
+            basis(dir, u, v);
+
+            const double angle = 2.0 * M_PI * randomDouble();
+            const double offset = targetRadius * std::sqrt(randomDouble());
+            Ray ray{targetCentre + offset * (std::cos(angle) * u + std::sin(angle) * v) - distance * dir, dir};
+            vec3f power = skyColour(-dir) * float(flux);
+
+            for (int bounce = 0; bounce <= settings.maxBounces; ++bounce) {
+                Hit hit{};
+                if (!scene.intersect(ray, hit, minDistance, maxDistance))
+                    break;
+
+                // Light reaching a diffuse surface straight from the sky is left to the paths from the camera.
+                if (materials.diffuse(hit.material)) {
+                    if (bounce > 0) {
+                        storedPositions[chunk].push_back(vec3f(hit.pos));
+                        stored[chunk].push_back({vec3f(glm::normalize(ray.dir)), power});
+                    }
+                    break;
+                }
+
+                vec3f attenuation(0.0f, 0.0f, 0.0f);
+                Ray scattered{};
+                if (!materials.scatter(hit.material, ray, hit, attenuation, scattered))
+                    break;
+
+                power *= attenuation;
+                ray = scattered;
+            }
+        }
+    }, helperPriority);
+
+    //
+    // Counting sort of the photons by bucket.
+    //
+    size_t count = 0;
+    for (const auto& chunk : stored)
+        count += chunk.size();
+
+    size_t buckets = 1;
+    while (buckets < count)
+        buckets <<= 1;
+    mask = buckets - 1;
+
+    std::vector<uint32_t> keys;
+    keys.reserve(count);
+    bucketStart.assign(buckets + 1, 0);
+    for (const auto& chunk : storedPositions) {
+        for (const auto& pos : chunk) {
+            bounds.extend(vec3d(pos));
+            keys.push_back(uint32_t(bucket(cellOf(pos.x, cellSize), cellOf(pos.y, cellSize), cellOf(pos.z, cellSize))));
+            ++bucketStart[keys.back() + 1];
+        }
+    }
+
+    for (size_t b = 0; b < buckets; ++b)
+        bucketStart[b + 1] += bucketStart[b];
+
+    std::vector<uint32_t> next(bucketStart.begin(), bucketStart.end() - 1);
+    positions.resize(count);
+    photons.resize(count);
+    size_t i = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        for (size_t j = 0; j < stored[c].size(); ++j) {
+            const uint32_t slot = next[keys[i++]]++;
+            positions[slot] = storedPositions[c][j];
+            photons[slot] = stored[c][j];
+        }
+        storedPositions[c] = {};
+        stored[c] = {};
+    }
+}
+
+size_t PhotonMap::bucket(const int64_t x, const int64_t y, const int64_t z) const {
+    return size_t(mix(uint64_t(x) * 0x9e3779b1ull ^ uint64_t(y) * 0x85ebca77ull ^ uint64_t(z) * 0xc2b2ae3dull)) & mask;
+}
+
+vec3f PhotonMap::irradiance(const vec3d& pos, const vec3d& normal) const {
+    vec3f sum(0.0f, 0.0f, 0.0f);
+
+    if (photons.empty())
+        return sum;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (pos[axis] + radius < bounds.min[axis] || pos[axis] - radius > bounds.max[axis])
+            return sum;
+    }
+
+    //
+    // Cells are as wide as the estimate, so it overlaps two along each axis, or three when rounding puts its ends
+    // either side of a cell boundary it only touches. The visited buckets below are sized for that bound.
+    //
+    int64_t lo[3], hi[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = cellOf(pos[axis] - radius, cellSize);
+        hi[axis] = std::min(cellOf(pos[axis] + radius, cellSize), lo[axis] + 2);
+    }
+
+    const vec3f p(pos);
+    const vec3f n(normal);
+    const auto radius2 = float(radius * radius);
+
+    // Cells may share buckets.
+    size_t visited[27];
+    int numVisited = 0;
+
+    for (int64_t z = lo[2]; z <= hi[2]; ++z) {
+        for (int64_t y = lo[1]; y <= hi[1]; ++y) {
+            for (int64_t x = lo[0]; x <= hi[0]; ++x) {
+                const size_t b = bucket(x, y, z);
+                if (std::find(visited, visited + numVisited, b) != visited + numVisited)
+                    continue;
+                visited[numVisited++] = b;
+
+                for (uint32_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i) {
+                    const vec3f d = positions[i] - p;
+                    if (glm::dot(d, d) <= radius2 && glm::dot(photons[i].dir, n) < 0.0f)
+                        sum += photons[i].power;
+                }
+            }
+        }
+    }
+
+    return sum * float(1.0 / (M_PI * radius * radius));
+}
+
+size_t PhotonMap::size() const {
+    return photons.size();
+}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GeometryUtils.h"
+#include "GlmTypes.h"
+
+namespace bv {
+
+class Scene;
+class ThreadPool;
+
+struct PhotonMapSettings {
+    // Photons emitted from the sky. Only those reaching a diffuse surface through specular bounces are kept.
+    size_t photons = size_t(1) << 20;
+    // Radius of the density estimate in world units. Smaller is sharper and noisier.
+    double radius = 0.02;
+    // Specular bounces a photon is followed through before it is dropped.
+    int maxBounces = 8;
+    // The map only depends on the scene, the settings and this.
+    uint64_t seed = 1;
+};
+
+// Caustic photon map: light from the sky that reaches diffuse surfaces through specular bounces only, which paths
+// traced from the camera find only by chance. Photons are aimed from every direction at a sphere bounding the
+// scene's specular primitives, followed until they land on a diffuse one, and stored in a hashed grid of cells twice
+// the estimate radius across, sorted by cell so that a cell's photons are contiguous. Read only once built, so every
+// render thread shares it.
+class PhotonMap {
+public:
+    // Emits settings.photons photons into scene in chunks spread over threadPool when given, which must not be the
+    // pool the caller runs on. Each chunk reseeds randomDouble.
+    PhotonMap(Scene& scene, const PhotonMapSettings& settings = {}, ThreadPool* threadPool = nullptr);
+
+    // Irradiance at pos from the photons within the radius that arrived on the side normal points to.
+    vec3f irradiance(const vec3d& pos, const vec3d& normal) const;
+
+    // Photons stored.
+    size_t size() const;
+
+private:
+    struct Photon {
+        // Direction of travel, unit length.
+        vec3f dir;
+        vec3f power;
+    };
+
+    size_t bucket(int64_t x, int64_t y, int64_t z) const;
+
+    double radius;
+    double cellSize;
+    size_t mask = 0;
+    // Around every photon, most diffuse hits are nowhere near a caustic.
+    AABB bounds;
+    // Photons of bucket b are at positions[bucketStart[b], bucketStart[b + 1]), positions are kept apart from the
+    // rest so that scanning a bucket only reads what the distance test needs.
+    std::vector<uint32_t> bucketStart;
+    std::vector<vec3f> positions;
+    std::vector<Photon> photons;
+};
+}
@@ -0,0 +1,337 @@
+#include "Preview.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include "Scenes.h"
+#include "TaskGroup.h"
+#include "ThreadPool.h"
+
+namespace bv {
+
+namespace {
+// First hit through a pixel centre. depth < 0 marks rays that left the scene.
+struct Surface {
+    vec3f position;
+    vec3f normal;
+    float depth;
+};
+
+Surface primarySurface(Scene& scene, const Camerad& camera, const int x, const int y) {
+    Hit hit{};
+    if (!scene.intersect(primaryRay(camera, x + 0.5, y + 0.5), hit, 1e-3, 1e12))
+        return {vec3f(0.0f), vec3f(0.0f), -1.0f};
+
+    return {vec3f(hit.pos), vec3f(glm::normalize(hit.normal)), float(camera.depth(hit.pos))};
+}
+}
+
+struct PreviewRenderer::History {
+    History(const Camerad& camera, const int size)
+            : camera(camera), sum(size, vec3f(0.0f, 0.0f, 0.0f)), count(size, 0.0f), surfaces(size) {}
+
+    Camerad camera;
+    std::vector<vec3f> sum;
+    std::vector<float> count;
+    std::vector<Surface> surfaces;
+    // Set once a pass has filled surfaces for every pixel.
+    bool hasSurfaces = false;
+};
+
+struct PreviewRenderer::Pass {
+    Pass(ThreadPool& threadPool, const int priority) : group(threadPool, priority) {}
+
+    Scene* scene;
+    PreviewSettings settings;
+    PassType type;
+    Camerad camera;
+    double scale;
+    bool adaptScale;
+    bool writeSurfaces;
+    std::vector<vec3f> radiance;
+    std::shared_ptr<History> history;
+    std::shared_ptr<const History> previous;
+    std::atomic<int64_t> tileNanoseconds{0};
+    TaskGroup group;
+
+    void accumulate(const Tile& tile) {
+        auto& h = *history;
+
+        if (writeSurfaces) {
+            for (int y = tile.y0; y < tile.y1; y++) {
+                for (int x = tile.x0; x < tile.x1; x++) {
+                    h.surfaces[y * camera.imageWidth + x] = primarySurface(*scene, camera, x, y);
+                }
+            }
+        }
+
+        accumulateTile(*scene, camera, tile, settings.maxBounces, h.sum.data(), h.count.data(), &group.token());
+    }
+
+    void reproject(const Tile& tile) {
+        auto& h = *history;
+        const auto& old = *previous;
+        const int width = camera.imageWidth;
+
+        for (int y = tile.y0; y < tile.y1; y++) {
+            if (group.token().cancelled())
+                return;
+
+            for (int x = tile.x0; x < tile.x1; x++) {
+                const int i = y * width + x;
+                const auto surface = primarySurface(*scene, camera, x, y);
+                h.surfaces[i] = surface;
+
+                if (surface.depth <= 0.0f)
+                    continue;
+
+                // Backward reprojection: where was this surface point in the previous view?
+                const vec3d position(surface.position);
+                if (old.camera.depth(position) <= 0.0)
+                    continue;
+
+                const auto p = old.camera.project(position);
+                if (!old.camera.inImage(p))
+                    continue;
+
+                const int j = int(p.y) * old.camera.imageWidth + int(p.x);
+                const auto& oldSurface = old.surfaces[j];
+
+                const bool sameSurface = oldSurface.depth > 0.0f
+                        && glm::length(oldSurface.position - surface.position) < settings.depthTolerance * surface.depth
+                        && glm::dot(oldSurface.normal, surface.normal) > settings.normalThreshold;
+
+                if (!sameSurface || old.count[j] <= 0.0f)
+                    continue;
+
+                const float samples = std::min(old.count[j], settings.maxHistorySamples);
+                h.sum[i] = old.sum[j] * (samples / old.count[j]);
+                h.count[i] = samples;
+            }
+        }
+
+        // Disoccluded pixels start from this fresh sample, reprojected ones refine.
+        accumulateTile(*scene, camera, tile, settings.maxBounces, h.sum.data(), h.count.data(), &group.token());
+    }
+};
+
+PreviewRenderer::PreviewRenderer(Scene& scene, ThreadPool& threadPool, const int width, const int height,
+                                 const PreviewSettings& settings)
+        : scene(scene), threadPool(threadPool), width(width), height(height), settings(settings),
+          motionScale(std::clamp(0.25, settings.minScale, settings.maxScale)), currentScale(motionScale),
+          display(width * height) {}
+
+void PreviewRenderer::cameraMoved() {
+    moving = true;
+
+    if (pass) {
+        pass->group.cancel();
+
+        //
+        // Reprojection reads the accumulated history, so let the cancelled tiles drain first. Each one stops at its
+        // next row.
+        //
+        if (settings.temporalReprojection)
+            pass->group.wait();
+        else
+            abandoned.push_back(pass->group.close());
+
+        pass = nullptr;
+    }
+}
+
+bool PreviewRenderer::startPass(const Camerad& camera) {
+    if (pass)
+        return true;
+
+    if (moving) {
+        moving = false;
+        numSamples = 0;
+
+        if (settings.temporalReprojection && history && history->hasSurfaces) {
+            currentScale = 1.0;
+            launch(camera, PassType::Reproject, 1.0, false);
+            return true;
+        }
+
+        currentScale = motionScale;
+        launch(camera, PassType::Scaled, currentScale, true);
+        return true;
+    }
+
+    if (currentScale < 1.0) {
+        //
+        // Camera is still, step the resolution up towards full.
+        //
+        currentScale = std::min(currentScale * 2.0, 1.0);
+        if (currentScale < 1.0) {
+            launch(camera, PassType::Scaled, currentScale, false);
+            return true;
+        }
+    }
+
+    //
+    // Accumulation starts over after a moving pass, whatever its scale, even full resolution ones that skip the steps
+    // above. A reprojected pass has already counted its first sample and carries on from its own history.
+    //
+    if (numSamples == 0)
+        history = std::make_shared<History>(camera, width * height);
+
+    if (numSamples >= settings.maxSamples)
+        return false;
+
+    launch(camera, PassType::Accumulate, 1.0, false);
+    return true;
+}
+
+bool PreviewRenderer::collect() {
+    if (!pass || !pass->group.finished())
+        return false;
+
+    const auto finished = std::move(pass);
+
+    if (finished->type != PassType::Scaled) {
+        numSamples++;
+
+        if (finished->type == PassType::Reproject)
+            history = finished->history;
+        if (finished->writeSurfaces)
+            history->hasSurfaces = true;
+
+        for (size_t i = 0; i < display.size(); ++i) {
+            display[i] = gammaCorrect(history->sum[i] / std::max(history->count[i], 1.0f));
+        }
+        return true;
+    }
+
+    if (finished->adaptScale)
+        adaptMotionScale(*finished);
+
+    // Nearest neighbour upscale of the reduced resolution pass.
+    const int lowWidth = finished->camera.imageWidth;
+    const int lowHeight = finished->camera.imageHeight;
+    for (int y = 0; y < height; y++) {
+        const int ly = std::min(int(y * finished->scale), lowHeight - 1);
+        for (int x = 0; x < width; x++) {
+            const int lx = std::min(int(x * finished->scale), lowWidth - 1);
+            display[y * width + x] = gammaCorrect(finished->radiance[ly * lowWidth + lx]);
+        }
+    }
+
+    return true;
+}
+
+bool PreviewRenderer::renderPass(const Camerad& camera) {
+    if (!startPass(camera))
+        return false;
+
+    pass->group.wait();
+    return collect();
+}
+
+vec3f PreviewRenderer::pixel(const int x, const int y) const {
+    return display[y * width + x];
+}
+
+double PreviewRenderer::scale() const {
+    return currentScale;
+}
+
+int PreviewRenderer::samples() const {
+    return numSamples;
+}
+
+void PreviewRenderer::launch(const Camerad& camera, const PassType type, const double scale, const bool adaptScale) {
+    //
+    // Only tiles of abandoned passes can still be queued, so the priority starts over once they have drained rather
+    // than growing for as long as the preview runs.
+    //
+    abandoned.erase(std::remove_if(abandoned.begin(), abandoned.end(), [](const std::shared_future<bool>& done) {
+        return done.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), abandoned.end());
+    if (abandoned.empty())
+        passPriority = 0;
+
+    pass = std::make_shared<Pass>(threadPool, ++passPriority);
+    pass->scene = &scene;
+    pass->settings = settings;
+    pass->type = type;
+    pass->scale = scale;
+    pass->adaptScale = adaptScale;
+    pass->camera = camera;
+    pass->writeSurfaces = false;
+
+    switch (type) {
+        case PassType::Scaled: {
+            const int lowWidth = std::max(1, int(width * scale));
+            const int lowHeight = std::max(1, int(height * scale));
+
+            pass->camera.imageWidth = lowWidth;
+            pass->camera.imageHeight = lowHeight;
+            pass->camera.focalLength *= scale;
+            pass->camera.centreX *= scale;
+            pass->camera.centreY *= scale;
+            pass->radiance.assign(lowWidth * lowHeight, vec3f(0.0f, 0.0f, 0.0f));
+            break;
+        }
+        case PassType::Accumulate:
+            pass->history = history;
+            pass->writeSurfaces = settings.temporalReprojection && !history->hasSurfaces;
+            break;
+        case PassType::Reproject:
+            pass->previous = history;
+            pass->history = std::make_shared<History>(camera, width * height);
+            pass->writeSurfaces = true;
+            break;
+    }
+
+    //
+    // Tasks hold the pass, not the renderer, so tiles still running after a cancel only ever write into buffers
+    // nobody reads any more.
+    //
+    for (const auto& tile : makeTiles(pass->camera.imageWidth, pass->camera.imageHeight, settings.tileSize)) {
+        pass->group.run([p = pass, tile]() {
+            const auto start = std::chrono::steady_clock::now();
+
+            switch (p->type) {
+                case PassType::Scaled:
+                    traceTile(*p->scene, p->camera, tile, 1, p->settings.maxBounces, p->radiance.data(), &p->group.token());
+                    break;
+                case PassType::Accumulate:
+                    p->accumulate(tile);
+                    break;
+                case PassType::Reproject:
+                    p->reproject(tile);
+                    break;
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            p->tileNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        });
+    }
+
+    pass->group.close();
+}
+
+void PreviewRenderer::adaptMotionScale(const Pass& pass) {
+    //
+    // Pick the scale whose predicted pass time, from this pass's per-pixel tile cost spread over the workers,
+    // fits the frame budget. Averaging with the old scale damps oscillation between passes.
+    //
+    const double tileSeconds = double(pass.tileNanoseconds.load()) * 1e-9;
+    const double secondsPerPixel = tileSeconds / double(pass.camera.imageWidth * pass.camera.imageHeight);
+    if (secondsPerPixel <= 0.0)
+        return;
+
+    const double budgetSeconds = settings.frameBudgetMs * 1e-3 * threadPool.size();
+    const double target = std::sqrt(budgetSeconds / (secondsPerPixel * width * height));
+    motionScale = std::clamp(0.5 * (motionScale + target), settings.minScale, settings.maxScale);
+}
+
+PreviewRenderer::~PreviewRenderer() {
+    if (pass)
+        pass->group.cancel();
+}
+}
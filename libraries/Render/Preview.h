@@ -0,0 +1,108 @@
+#pragma once
+
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "Camera.h"
+#include "Integrator.h"
+
+namespace bv {
+
+class Scene;
+class ThreadPool;
+
+struct PreviewSettings {
+    // Target time for a pass while the camera is moving.
+    double frameBudgetMs = 33.0;
+    // Resolution scale bounds for moving passes.
+    double minScale = 1.0 / 8.0;
+    double maxScale = 1.0;
+    // Samples per pixel at which refinement stops.
+    int maxSamples = 512;
+    int maxBounces = 16;
+    int tileSize = 32;
+
+    // When the camera moves after full resolution samples have been accumulated, reproject them into the new
+    // view instead of dropping to a reduced resolution pass.
+    bool temporalReprojection = false;
+    // Cap on the samples a pixel may carry over, so stale shading (e.g. view dependent reflections) fades out.
+    float maxHistorySamples = 32.0f;
+    // Reprojected history is rejected when the surface it came from is further than this fraction of the view
+    // depth from the new first hit, or its normal differs by more than the cosine threshold.
+    float depthTolerance = 0.02f;
+    float normalThreshold = 0.9f;
+};
+
+// Progressive preview for interactive sessions. While the camera moves each pass traces 1 spp at a reduced
+// resolution, chosen from measured tile times to fit the frame budget, and is upscaled to the full image. Once
+// the camera stops, passes double the resolution until it is full and then accumulate full resolution samples.
+//
+// With temporalReprojection, every full resolution accumulation also records the first hit of each pixel. A camera
+// move then reprojects the accumulated radiance into the new view, rejecting disocclusions by depth and normal,
+// and accumulation continues from that history.
+//
+// Passes run asynchronously on the thread pool: startPass() queues one, collect() picks up its result. Moving the
+// camera cancels the running pass, which is abandoned within a row of each in-flight tile, and the next pass is
+// queued at a higher priority than anything left over.
+class PreviewRenderer {
+public:
+    PreviewRenderer(Scene& scene, ThreadPool& threadPool, int width, int height, const PreviewSettings& settings);
+
+    // Cancels the running pass and discards refinement, the next pass restarts at the motion resolution.
+    void cameraMoved();
+
+    // Queues the next pass for camera unless one is already running. Returns false once maxSamples have been
+    // accumulated and there is nothing left to do.
+    bool startPass(const Camerad& camera);
+
+    // Returns true if a pass finished since the last call, its result is then visible through pixel().
+    bool collect();
+
+    // Starts a pass and blocks until it completes.
+    bool renderPass(const Camerad& camera);
+
+    // Gamma corrected colour of a full resolution pixel from the latest collected pass.
+    vec3f pixel(int x, int y) const;
+
+    double scale() const;
+    int samples() const;
+
+    ~PreviewRenderer();
+
+private:
+    struct Pass;
+    struct History;
+
+    enum class PassType {
+        Scaled,
+        Accumulate,
+        Reproject
+    };
+
+    void launch(const Camerad& camera, PassType type, double scale, bool adaptScale);
+    void adaptMotionScale(const Pass& pass);
+
+    Scene& scene;
+    ThreadPool& threadPool;
+    int width, height;
+    PreviewSettings settings;
+
+    // Resolution used while moving, adapted after every moving pass.
+    double motionScale;
+    // Resolution of the latest refinement step, 1.0 once accumulating.
+    double currentScale;
+    bool moving = true;
+    int numSamples = 0;
+    // Raised for every pass so new tiles overtake stale ones in the pool.
+    int passPriority = 0;
+    // Cancelled passes whose tiles may still be queued.
+    std::vector<std::shared_future<bool>> abandoned;
+
+    std::shared_ptr<Pass> pass;
+    // Full resolution accumulation. Replaced rather than cleared so cancelled tiles never write into the buffers
+    // of a newer pass.
+    std::shared_ptr<History> history;
+    std::vector<vec3f> display;
+};
+}
@@ -0,0 +1,143 @@
+#include "RadianceCache.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "GeometryUtils.h"
+
+namespace bv {
+
+namespace {
+// Slots tried after the one a key hashes to before giving up.
+constexpr size_t maxProbes = 32;
+// Fixed point scale of the radiance sums, and the largest radiance recorded.
+constexpr double fixedScale = 65536.0;
+constexpr double maxRadiance = double(1 << 24);
+// Normals are quantized to a normalBuckets x normalBuckets grid over their octahedral projection.
+constexpr int normalBuckets = 8;
+// Reads of a cell before a lookup gives up on it while it keeps being recorded to.
+constexpr int maxReadAttempts = 4;
+
+uint64_t normalBucket(const vec3d& normal) {
+    const double l1 = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+    double u = normal.x / l1;
+    double v = normal.y / l1;
+
+    // The lower hemisphere folds over the upper one's diagonals.
+    if (normal.z < 0.0) {
+        const double fu = (1.0 - std::fabs(v)) * (u >= 0.0 ? 1.0 : -1.0);
+        const double fv = (1.0 - std::fabs(u)) * (v >= 0.0 ? 1.0 : -1.0);
+        u = fu;
+        v = fv;
+    }
+
+    const auto quantize = [](const double x) {
+        return uint64_t(std::clamp(int((x * 0.5 + 0.5) * normalBuckets), 0, normalBuckets - 1));
+    };
+    return quantize(u) * normalBuckets + quantize(v);
+}
+}
+
+RadianceCache::RadianceCache(const RadianceCacheSettings& settings) : settings(settings) {
+    size_t capacity = 1;
+    while (capacity < settings.capacity)
+        capacity <<= 1;
+
+    mask = capacity - 1;
+    table = std::make_unique<Cell[]>(capacity);
+}
+
+size_t RadianceCache::find(const vec3d& pos, const vec3d& normal) {
+    const double scale = 1.0 / settings.cellSize;
+    uint64_t hash = normalBucket(normal);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const auto cell = int64_t(std::floor(pos[axis] * scale + randomDouble() - 0.5));
+        hash = mix(hash ^ uint64_t(cell));
+    }
+
+    const uint64_t key = hash | 1;
+
+    for (size_t probe = 0; probe <= maxProbes; ++probe) {
+        const size_t slot = (hash + probe) & mask;
+        uint64_t current = table[slot].key.load(std::memory_order_acquire);
+
+        if (current == 0) {
+            if (table[slot].key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                occupied.fetch_add(1, std::memory_order_relaxed);
+                return slot;
+            }
+        }
+
+        // Either taken before, or by another thread inserting the same key just now.
+        if (current == key)
+            return slot;
+    }
+
+    return none;
+}
+
+bool RadianceCache::lookup(const size_t slot, vec3f& radiance) const {
+    const auto& cell = table[slot];
+
+    for (int attempt = 0; attempt < maxReadAttempts; ++attempt) {
+        const uint32_t count = cell.count.load(std::memory_order_acquire);
+        if (count < settings.minSamples)
+            return false;
+
+        uint64_t sum[3];
+        for (int c = 0; c < 3; ++c)
+            sum[c] = cell.sum[c].load(std::memory_order_relaxed);
+
+        //
+        // Every path added to the sums read above was counted in started first. Unless a record began since count
+        // was read, the sums therefore hold exactly count paths, and not part of one still being added.
+        //
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (cell.started.load(std::memory_order_relaxed) != count)
+            continue;
+
+        const double scale = 1.0 / (fixedScale * count);
+        radiance = vec3f(float(sum[0] * scale), float(sum[1] * scale), float(sum[2] * scale));
+        return true;
+    }
+
+    // The path carries on rather than using a mean it could not read consistently.
+    return false;
+}
+
+void RadianceCache::record(const size_t slot, const vec3f& radiance) {
+    auto& cell = table[slot];
+
+    if (cell.count.load(std::memory_order_relaxed) >= settings.maxSamples)
+        return;
+
+    // Announced before any sum changes, so lookups can tell when the sums hold paths count does not.
+    cell.started.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (int c = 0; c < 3; ++c) {
+        const double value = std::clamp(double(radiance[c]), 0.0, maxRadiance);
+        cell.sum[c].fetch_add(uint64_t(value * fixedScale + 0.5), std::memory_order_relaxed);
+    }
+
+    // Published after the sums, so a reader that sees the count sees at least that many paths summed.
+    cell.count.fetch_add(1, std::memory_order_release);
+}
+
+void RadianceCache::clear() {
+    for (size_t slot = 0; slot <= mask; ++slot) {
+        auto& cell = table[slot];
+        cell.key.store(0, std::memory_order_relaxed);
+        cell.count.store(0, std::memory_order_relaxed);
+        cell.started.store(0, std::memory_order_relaxed);
+        for (auto& sum : cell.sum)
+            sum.store(0, std::memory_order_relaxed);
+    }
+    occupied.store(0, std::memory_order_relaxed);
+}
+
+size_t RadianceCache::cells() const {
+    return occupied.load(std::memory_order_relaxed);
+}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "GlmTypes.h"
+
+namespace bv {
+
+struct RadianceCacheSettings {
+    // Side of a cell in world units. Lookups are jittered by up to a cell, which blends neighbouring cells.
+    double cellSize = 0.05;
+    // Paths a cell must have recorded before lookups use it.
+    uint32_t minSamples = 16;
+    // Cells stop recording once they hold this many paths.
+    uint32_t maxSamples = 4096;
+    // Slots in the table, rounded up to a power of two.
+    size_t capacity = size_t(1) << 18;
+};
+
+// Mean incoming radiance over the cosine weighted hemisphere, cached in a hashed grid of cells keyed by position and
+// quantized normal. Cells are created lazily by the first path to reach them and fill up with the paths that carry
+// on from there, then end later paths at the cached mean. The table is a fixed size open addressed hash map updated
+// with atomics only, so every render thread shares it without locks.
+class RadianceCache {
+public:
+    static constexpr size_t none = ~size_t(0);
+
+    explicit RadianceCache(const RadianceCacheSettings& settings = {});
+
+    // Slot of the cell around pos, jittered by randomDouble, and normal, created if missing. none if every slot it
+    // could go in is taken.
+    size_t find(const vec3d& pos, const vec3d& normal);
+
+    // Mean radiance recorded in slot, false until it holds minSamples paths. Also false, so the path is traced on,
+    // when paths keep being recorded to it faster than it can be read consistently.
+    bool lookup(size_t slot, vec3f& radiance) const;
+
+    void record(size_t slot, const vec3f& radiance);
+
+    // Forgets every cell, for when the scene changes. Must not run alongside other calls.
+    void clear();
+
+    size_t cells() const;
+
+private:
+    struct Cell {
+        // Zero while the slot is free.
+        std::atomic<uint64_t> key{0};
+        // Records begun, and records finished, which the mean divides by.
+        std::atomic<uint32_t> started{0};
+        std::atomic<uint32_t> count{0};
+        // Radiance sums in fixed point, integer adds are the only atomic arithmetic C++17 has.
+        std::atomic<uint64_t> sum[3] = {};
+    };
+
+    RadianceCacheSettings settings;
+    size_t mask;
+    std::unique_ptr<Cell[]> table;
+    std::atomic<size_t> occupied{0};
+};
+}
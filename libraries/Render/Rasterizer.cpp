@@ -0,0 +1,346 @@
+#include "Rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Integrator.h"
+#include "ParallelChunks.h"
+#include "Scenes.h"
+
+namespace bv {
+
+namespace {
+// Side of the square screen tiles triangles are binned to.
+constexpr int binSize = 32;
+// Primitives set up per chunk when spread over a pool.
+constexpr size_t setupGrain = 4096;
+// The caller waits on its helpers, so they are queued ahead of any tiles still being traced.
+constexpr int helperPriority = 1;
+// Triangles are clipped where they come nearer than this along the viewing axis.
+constexpr double nearPlane = 1e-6;
+
+struct ScreenTriangle {
+    // Edge i, opposite vertex i, is a[i] * x + b[i] * y + c[i]: zero on the edge and the triangle's doubled area at
+    // vertex i. A sample is inside when all three are positive, ties go to edges facing right or down.
+    double a[3], b[3], c[3];
+    // 1 / depth at each vertex divided by the doubled area, interpolated with the edge values.
+    double invDepth[3];
+    // Pixels the triangle may cover, [x0, x1) x [y0, y1).
+    int x0, y0, x1, y1;
+    uint32_t primitive;
+};
+
+// Projected bounds of a primitive that cannot be rasterized.
+struct ScreenBounds {
+    int x0, y0, x1, y1;
+    // Nearest depth inside the bounds.
+    float nearDepth;
+};
+
+struct Setup {
+    std::vector<ScreenTriangle> triangles;
+    std::vector<ScreenBounds> bounds;
+};
+
+struct ProjectedVertex {
+    // Pixel position and depth along the viewing axis.
+    double x, y, z;
+};
+
+bool inside(const double e, const double a, const double b) {
+    return e > 0.0 || (e == 0.0 && (a > 0.0 || (a == 0.0 && b > 0.0)));
+}
+
+void pixelRange(const double min, const double max, const int size, int& begin, int& end) {
+    begin = int(std::clamp(std::floor(min), 0.0, double(size)));
+    end = int(std::clamp(std::floor(max) + 1.0, 0.0, double(size)));
+}
+
+void setupTriangle(ProjectedVertex v0, ProjectedVertex v1, ProjectedVertex v2, const uint32_t primitive,
+                   const int width, const int height, std::vector<ScreenTriangle>& out) {
+    double area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+
+    // Seen edge on, a ray can never hit it.
+    if (area == 0.0 || !std::isfinite(area))
+        return;
+
+    if (area < 0.0) {
+        std::swap(v1, v2);
+        area = -area;
+    }
+
+    ScreenTriangle t{};
+    const ProjectedVertex v[3] = {v0, v1, v2};
+    for (int i = 0; i < 3; ++i) {
+        const auto& from = v[(i + 1) % 3];
+        const auto& to = v[(i + 2) % 3];
+        t.a[i] = from.y - to.y;
+        t.b[i] = to.x - from.x;
+        t.c[i] = -(t.a[i] * from.x + t.b[i] * from.y);
+        t.invDepth[i] = 1.0 / (v[i].z * area);
+    }
+
+    pixelRange(std::min({v0.x, v1.x, v2.x}), std::max({v0.x, v1.x, v2.x}), width, t.x0, t.x1);
+    pixelRange(std::min({v0.y, v1.y, v2.y}), std::max({v0.y, v1.y, v2.y}), height, t.y0, t.y1);
+    if (t.x0 >= t.x1 || t.y0 >= t.y1)
+        return;
+
+    t.primitive = primitive;
+    out.push_back(t);
+}
+
+//
+// Clips a triangle in camera space, where depth is the third homogeneous coordinate, to the near plane and emits
+// the one or two triangles left.
+//
+void clipTriangle(const vec3d (&homogeneous)[3], const uint32_t primitive, const int width, const int height,
+                  std::vector<ScreenTriangle>& out) {
+    vec3d clipped[4];
+    int count = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        const auto& p = homogeneous[i];
+        const auto& q = homogeneous[(i + 1) % 3];
+        const bool pIn = p.z >= nearPlane;
+        const bool qIn = q.z >= nearPlane;
+
+        if (pIn)
+            clipped[count++] = p;
+        if (pIn != qIn)
+            clipped[count++] = p + (q - p) * ((nearPlane - p.z) / (q.z - p.z));
+    }
+
+    if (count < 3)
+        return;
+
+    ProjectedVertex projected[4];
+    for (int i = 0; i < count; ++i) {
+        projected[i] = {clipped[i].x / clipped[i].z, clipped[i].y / clipped[i].z, clipped[i].z};
+    }
+
+    for (int i = 1; i + 1 < count; ++i) {
+        setupTriangle(projected[0], projected[i], projected[i + 1], primitive, width, height, out);
+    }
+}
+
+void setupBounds(const AABB& box, const mat3x4d& projection, const int width, const int height,
+                 std::vector<ScreenBounds>& out) {
+    if (box.empty())
+        return;
+
+    vec3d corners[8];
+    double nearDepth = std::numeric_limits<double>::infinity();
+    for (int corner = 0; corner < 8; ++corner) {
+        const vec3d p((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y,
+                      (corner & 4) ? box.max.z : box.min.z);
+        corners[corner] = projection * vec4d(p, 1.0);
+        nearDepth = std::min(nearDepth, corners[corner].z);
+    }
+
+    double minX = std::numeric_limits<double>::infinity();
+    double minY = minX;
+    double maxX = -minX;
+    double maxY = -minX;
+    const auto extend = [&](const vec3d& h) {
+        minX = std::min(minX, h.x / h.z);
+        maxX = std::max(maxX, h.x / h.z);
+        minY = std::min(minY, h.y / h.z);
+        maxY = std::max(maxY, h.y / h.z);
+    };
+
+    //
+    // A box reaching behind the camera is clipped to the near plane first: its visible part projects within the
+    // corners in front and the points where the box's edges cross the plane.
+    //
+    for (int corner = 0; corner < 8; ++corner) {
+        const auto& p = corners[corner];
+        if (p.z >= nearPlane)
+            extend(p);
+
+        for (int axis = 1; axis < 8; axis <<= 1) {
+            const auto& q = corners[corner | axis];
+            if ((corner & axis) == 0 && (p.z >= nearPlane) != (q.z >= nearPlane))
+                extend(p + (q - p) * ((nearPlane - p.z) / (q.z - p.z)));
+        }
+    }
+
+    ScreenBounds b{};
+    pixelRange(minX, maxX, width, b.x0, b.x1);
+    pixelRange(minY, maxY, height, b.y0, b.y1);
+    b.nearDepth = float(std::max(nearDepth, 0.0));
+
+    if (b.x0 < b.x1 && b.y0 < b.y1)
+        out.push_back(b);
+}
+
+void rasterizeTile(const Tile& tile, const std::vector<const ScreenTriangle*>& triangles,
+                   const std::vector<const ScreenBounds*>& bounds, VisibilityBuffer& buffer) {
+    const int samples = buffer.samplesPerPixel;
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            for (int s = 0; s < samples; ++s) {
+                const size_t i = buffer.index(x, y, s);
+                buffer.primitive[i] = VisibilityBuffer::trace;
+                buffer.depth[i] = std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+
+    // Per edge, its value at each sample relative to the pixel's corner and the largest of those.
+    std::vector<double> sampleEdge(3 * size_t(samples));
+    double maxSampleEdge[3];
+
+    for (const auto* t : triangles) {
+        const int x0 = std::max(t->x0, tile.x0);
+        const int x1 = std::min(t->x1, tile.x1);
+        const int y0 = std::max(t->y0, tile.y0);
+        const int y1 = std::min(t->y1, tile.y1);
+
+        bool tieInside[3];
+        for (int k = 0; k < 3; ++k) {
+            tieInside[k] = inside(0.0, t->a[k], t->b[k]);
+            maxSampleEdge[k] = -std::numeric_limits<double>::infinity();
+            for (int s = 0; s < samples; ++s) {
+                const double e = t->a[k] * buffer.offsets[s].x + t->b[k] * buffer.offsets[s].y;
+                sampleEdge[k * samples + s] = e;
+                maxSampleEdge[k] = std::max(maxSampleEdge[k], e);
+            }
+        }
+
+        for (int y = y0; y < y1; ++y) {
+            double corner[3];
+            for (int k = 0; k < 3; ++k)
+                corner[k] = t->a[k] * x0 + t->b[k] * y + t->c[k];
+
+            for (int x = x0; x < x1; ++x) {
+                const bool anyInside = corner[0] + maxSampleEdge[0] >= 0.0 && corner[1] + maxSampleEdge[1] >= 0.0 &&
+                                       corner[2] + maxSampleEdge[2] >= 0.0;
+
+                for (int s = 0; anyInside && s < samples; ++s) {
+                    double e[3];
+                    bool covered = true;
+                    for (int k = 0; k < 3; ++k) {
+                        e[k] = corner[k] + sampleEdge[k * samples + s];
+                        covered &= (e[k] > 0.0) | ((e[k] == 0.0) & tieInside[k]);
+                    }
+                    if (!covered)
+                        continue;
+
+                    // Depth is not linear in screen space, its reciprocal is.
+                    const double invDepth = e[0] * t->invDepth[0] + e[1] * t->invDepth[1] + e[2] * t->invDepth[2];
+                    const auto depth = float(1.0 / invDepth);
+
+                    const size_t i = buffer.index(x, y, s);
+                    if (depth < buffer.depth[i]) {
+                        buffer.depth[i] = depth;
+                        buffer.primitive[i] = t->primitive;
+                    }
+                }
+
+                for (int k = 0; k < 3; ++k)
+                    corner[k] += t->a[k];
+            }
+        }
+    }
+
+    for (const auto* b : bounds) {
+        const int x0 = std::max(b->x0, tile.x0);
+        const int x1 = std::min(b->x1, tile.x1);
+        const int y0 = std::max(b->y0, tile.y0);
+        const int y1 = std::min(b->y1, tile.y1);
+
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                for (int s = 0; s < samples; ++s) {
+                    const size_t i = buffer.index(x, y, s);
+                    if (buffer.depth[i] >= b->nearDepth)
+                        buffer.primitive[i] = VisibilityBuffer::trace;
+                }
+            }
+        }
+    }
+}
+}
+
+void rasterize(const Scene& scene, const Camerad& camera, const int samplesPerPixel, VisibilityBuffer& buffer,
+               ThreadPool* threadPool) {
+    const int width = camera.imageWidth;
+    const int height = camera.imageHeight;
+    const int samples = std::max(samplesPerPixel, 1);
+
+    buffer.width = width;
+    buffer.height = height;
+    buffer.samplesPerPixel = samples;
+    buffer.primitive.resize(size_t(width) * size_t(height) * size_t(samples));
+    buffer.depth.resize(buffer.primitive.size());
+
+    //
+    // Stratified in both axes: sample s lies in row s and in a shuffled column of an s x s grid over the pixel.
+    //
+    std::vector<int> columns(samples);
+    for (int s = 0; s < samples; ++s)
+        columns[s] = s;
+    for (int s = samples - 1; s > 0; --s)
+        std::swap(columns[s], columns[std::min(int(randomDouble() * (s + 1)), s)]);
+
+    buffer.offsets.resize(samples);
+    for (int s = 0; s < samples; ++s) {
+        buffer.offsets[s] = {(columns[s] + randomDouble()) / samples, (s + randomDouble()) / samples};
+    }
+
+    const mat3x4d projection = camera.projMatrix();
+    const size_t primitives = scene.size();
+    const size_t chunks = std::max<size_t>((primitives + setupGrain - 1) / setupGrain, 1);
+    std::vector<Setup> setups(chunks);
+
+    parallelChunks(threadPool, chunks, [&](const size_t c) {
+        auto& setup = setups[c];
+        const size_t end = std::min(primitives, (c + 1) * setupGrain);
+
+        for (size_t p = c * setupGrain; p < end; ++p) {
+            const auto& geometry = scene.primitive(p);
+            vec3d v[3];
+
+            if (geometry.vertices(v[0], v[1], v[2])) {
+                const vec3d homogeneous[3] = {projection * vec4d(v[0], 1.0), projection * vec4d(v[1], 1.0),
+                                              projection * vec4d(v[2], 1.0)};
+                clipTriangle(homogeneous, uint32_t(p), width, height, setup.triangles);
+            } else {
+                setupBounds(geometry.bounds(), projection, width, height, setup.bounds);
+            }
+        }
+    }, helperPriority);
+
+    //
+    // Binned in primitive order, so ties in depth resolve the same way however the setup was split.
+    //
+    const auto tiles = makeTiles(width, height, binSize);
+    const int binsX = (width + binSize - 1) / binSize;
+    std::vector<std::vector<const ScreenTriangle*>> triangleBins(tiles.size());
+    std::vector<std::vector<const ScreenBounds*>> boundsBins(tiles.size());
+
+    const auto forBins = [binsX](const int x0, const int y0, const int x1, const int y1, const auto& f) {
+        for (int by = y0 / binSize; by <= (y1 - 1) / binSize; ++by) {
+            for (int bx = x0 / binSize; bx <= (x1 - 1) / binSize; ++bx) {
+                f(size_t(by) * size_t(binsX) + size_t(bx));
+            }
+        }
+    };
+
+    for (const auto& setup : setups) {
+        for (const auto& t : setup.triangles)
+            forBins(t.x0, t.y0, t.x1, t.y1, [&](const size_t bin) { triangleBins[bin].push_back(&t); });
+        for (const auto& b : setup.bounds)
+            forBins(b.x0, b.y0, b.x1, b.y1, [&](const size_t bin) { boundsBins[bin].push_back(&b); });
+    }
+
+    parallelChunks(threadPool, tiles.size(), [&](const size_t t) {
+        rasterizeTile(tiles[t], triangleBins[t], boundsBins[t], buffer);
+    }, helperPriority);
+}
+}
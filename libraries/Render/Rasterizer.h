@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Camera.h"
+#include "GlmTypes.h"
+
+namespace bv {
+
+class Scene;
+class ThreadPool;
+
+// First hits of the primary rays through a fixed set of sample positions in every pixel, found by rasterizing the
+// scene's triangles instead of tracing. Only a hint: the integrator intersects the primitive a sample names with the
+// sample's ray, and traces the ray as usual when that misses or the sample is marked trace.
+struct VisibilityBuffer {
+    // Nothing rasterized at the sample, or a primitive that cannot be rasterized may be in front of what was.
+    static constexpr uint32_t trace = ~0u;
+
+    int width = 0;
+    int height = 0;
+    int samplesPerPixel = 0;
+    // Sample positions within a pixel, shared by every pixel.
+    std::vector<vec2d> offsets;
+    // samplesPerPixel entries per pixel in row major order: the nearest primitive, by the index Scene::add returned,
+    // and its depth along the viewing axis.
+    std::vector<uint32_t> primitive;
+    std::vector<float> depth;
+
+    size_t index(const int x, const int y, const int sample) const {
+        return (size_t(y) * size_t(width) + size_t(x)) * size_t(samplesPerPixel) + size_t(sample);
+    }
+};
+
+// Rasterizes scene as seen by camera into buffer at samplesPerPixel stratified positions drawn from randomDouble.
+// Triangles are clipped to the near plane, projected and binned to the screen tiles they overlap, then the tiles are
+// rasterized independently. Other primitives cover the projection of their bounds with trace wherever they may be
+// nearest. Setup and tiles are spread over threadPool when given, which must not be the pool the caller runs on.
+void rasterize(const Scene& scene, const Camerad& camera, int samplesPerPixel, VisibilityBuffer& buffer,
+               ThreadPool* threadPool = nullptr);
+}
@@ -0,0 +1,133 @@
+#include "RenderService.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "GeometryUtils.h"
+#include "ImageIO.h"
+#include "Integrator.h"
+#include "ParallelFor.h"
+#include "Scenes.h"
+#include "ThreadPool.h"
+
+namespace bv {
+
+namespace {
+constexpr int tileSize = 32;
+constexpr int maxDimension = 8192;
+constexpr int maxSamples = 1 << 16;
+// Job priorities are clamped to this either side of zero, so clients cannot spread the pool over unbounded lanes.
+constexpr int maxPriority = 16;
+}
+
+RenderService::RenderService(ThreadPool& threadPool, SceneLoader loader, const size_t sceneCacheSize)
+    : threadPool(threadPool), loader(std::move(loader)), sceneCacheSize(std::max<size_t>(sceneCacheSize, 1)) {}
+
+std::shared_ptr<Scene> RenderService::acquireScene(const std::string& id, bool& cached) {
+    std::promise<std::shared_ptr<Scene>> promise;
+    SceneFuture scene;
+    uint64_t generation = 0;
+
+    {
+        std::lock_guard lk(cacheMutex);
+
+        const auto found = cacheIndex.find(id);
+        cached = found != cacheIndex.end();
+
+        if (cached) {
+            cache.splice(cache.begin(), cache, found->second);
+            scene = found->second->scene;
+        } else {
+            generation = ++loads;
+            scene = promise.get_future().share();
+            cache.push_front({id, scene, generation});
+            cacheIndex[id] = cache.begin();
+
+            while (cache.size() > sceneCacheSize) {
+                cacheIndex.erase(cache.back().id);
+                cache.pop_back();
+            }
+        }
+    }
+
+    if (cached)
+        return scene.get();
+
+    //
+    // Loaded outside the lock, so jobs for other scenes carry on while jobs for this one wait on the future. A failed
+    // load is dropped from the cache, unless it was already evicted and replaced, so the next job retries it.
+    //
+    try {
+        std::shared_ptr<Scene> loaded = loader(id);
+        if (!loaded)
+            throw std::runtime_error("Unknown scene " + id);
+
+        loaded->build(&threadPool);
+        promise.set_value(std::move(loaded));
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+
+        std::lock_guard lk(cacheMutex);
+        const auto found = cacheIndex.find(id);
+        if (found != cacheIndex.end() && found->second->generation == generation) {
+            cache.erase(found->second);
+            cacheIndex.erase(found);
+        }
+    }
+
+    return scene.get();
+}
+
+RenderResult RenderService::render(const RenderJob& job) {
+    RenderResult result;
+    const auto start = std::chrono::steady_clock::now();
+
+    if (job.width < 1 || job.height < 1 || job.width > maxDimension || job.height > maxDimension) {
+        result.error = "Image size must be between 1 and " + std::to_string(maxDimension);
+        return result;
+    }
+
+    if (job.samples < 1 || job.samples > maxSamples) {
+        result.error = "Samples must be between 1 and " + std::to_string(maxSamples);
+        return result;
+    }
+
+    std::shared_ptr<Scene> scene;
+    try {
+        scene = acquireScene(job.scene, result.sceneCached);
+    } catch (const std::exception& e) {
+        result.error = e.what();
+        return result;
+    }
+
+    Camerad camera(job.pose.trans, job.pose.roll, job.pose.pitch, job.pose.yaw, job.height, 1.0, job.width,
+                   job.height, job.width / 2.0, job.height / 2.0);
+
+    const auto tiles = makeTiles(job.width, job.height, tileSize);
+    std::vector<vec3f> radiance(size_t(job.width) * job.height);
+
+    // This thread traces tiles too, so a job makes progress even while other jobs fill the pool.
+    parallelFor(&threadPool, tiles.size(), 1, [&](const size_t t) {
+        seedRandom(mix(job.seed ^ mix(t)));
+        traceTile(*scene, camera, tiles[t], job.samples, job.maxBounces, radiance.data());
+    }, std::clamp(job.priority, -maxPriority, maxPriority));
+
+    std::vector<uint32_t> pixels;
+    resolve(radiance, pixels);
+    encodeQOI(pixels.data(), job.width, job.height, result.image);
+
+    result.ok = true;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+std::vector<std::string> RenderService::cachedScenes() const {
+    std::lock_guard lk(cacheMutex);
+
+    std::vector<std::string> ids;
+    for (const auto& entry : cache)
+        ids.push_back(entry.id);
+    return ids;
+}
+}
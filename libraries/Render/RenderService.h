@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Sequence.h"
+
+namespace bv {
+
+class Scene;
+class ThreadPool;
+
+// One image to render: which scene, from where, how large and with how many samples.
+struct RenderJob {
+    std::string scene;
+    CameraPose pose{};
+    int width = 160;
+    int height = 120;
+    int samples = 16;
+    int maxBounces = 16;
+    // Tiles are reseeded from it, so a job renders the same image every time.
+    uint64_t seed = 1;
+    // Priority of the job's tiles on the pool, higher overtakes jobs already running. Clamped to [-16, 16].
+    int priority = 0;
+};
+
+struct RenderResult {
+    bool ok = false;
+    std::string error;
+    // QOI encoded image, see encodeQOI.
+    std::vector<uint8_t> image;
+    // Whether the scene came from the cache rather than being loaded for this job.
+    bool sceneCached = false;
+    double seconds = 0.0;
+};
+
+// Creates the scene with the given id, or returns null if there is none.
+using SceneLoader = std::function<std::unique_ptr<Scene>(const std::string& id)>;
+
+//
+// Renders jobs for a long running process. Scenes are loaded and built on first use and kept, acceleration structure
+// included, in a cache of the sceneCacheSize most recently used. A scene evicted while jobs still render it lives
+// until they finish.
+//
+// render() may be called from any number of threads at once, none of them workers of threadPool. Their tiles share
+// the pool, and jobs asking for a scene that is still loading wait for that load rather than starting another.
+//
+class RenderService {
+public:
+    RenderService(ThreadPool& threadPool, SceneLoader loader, size_t sceneCacheSize = 4);
+
+    RenderResult render(const RenderJob& job);
+
+    // Scenes currently cached, most recently used first.
+    std::vector<std::string> cachedScenes() const;
+
+private:
+    using SceneFuture = std::shared_future<std::shared_ptr<Scene>>;
+
+    struct CacheEntry {
+        std::string id;
+        SceneFuture scene;
+        // Tells a load apart from a later one of the same id.
+        uint64_t generation;
+    };
+
+    std::shared_ptr<Scene> acquireScene(const std::string& id, bool& cached);
+
+    ThreadPool& threadPool;
+    SceneLoader loader;
+    size_t sceneCacheSize;
+
+    mutable std::mutex cacheMutex;
+    // Most recently used first.
+    std::list<CacheEntry> cache;
+    std::unordered_map<std::string, std::list<CacheEntry>::iterator> cacheIndex;
+    uint64_t loads = 0;
+};
+}
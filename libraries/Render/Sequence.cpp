@@ -0,0 +1,163 @@
+#include "Sequence.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "FrameRing.h"
+#include "ImageWriter.h"
+#include "Integrator.h"
+#include "Latch.h"
+#include "Rasterizer.h"
+#include "Scenes.h"
+#include "Semaphore.h"
+#include "ThreadPool.h"
+
+namespace bv {
+
+namespace {
+struct Frame {
+    int index;
+    Camerad camera;
+    std::vector<vec3f> radiance;
+    VisibilityBuffer visibility;
+    std::atomic<int> tilesRemaining;
+};
+
+std::string frameFilename(const std::string& prefix, const int index, const std::string& extension) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "%04d", index);
+    return prefix + number + extension;
+}
+}
+
+std::vector<CameraPose> loadCameraPoses(const std::string& filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        throw std::runtime_error("Could not open camera pose file: " + filename);
+    }
+
+    std::vector<CameraPose> poses;
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(in, line)) {
+        lineNumber++;
+
+        const auto first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        std::istringstream fields(line);
+        CameraPose pose{};
+        if (!(fields >> pose.trans.x >> pose.trans.y >> pose.trans.z >> pose.roll >> pose.pitch >> pose.yaw)) {
+            throw std::runtime_error("Malformed camera pose on line " + std::to_string(lineNumber) + " of " + filename);
+        }
+
+        poses.push_back(pose);
+    }
+
+    return poses;
+}
+
+void renderSequence(Scene& scene, const Camerad& camera, const std::vector<CameraPose>& poses,
+                    ThreadPool& threadPool, const SequenceSettings& settings) {
+    const auto tiles = makeTiles(camera.imageWidth, camera.imageHeight, settings.tileSize);
+    const auto numTiles = static_cast<int>(tiles.size());
+
+    Semaphore frameSlots(std::max(settings.framesInFlight, 1));
+    Latch latch(static_cast<int>(poses.size()));
+    ImageWriter writer(static_cast<size_t>(std::max(settings.writeQueueLength, 1)));
+    const auto cache =
+        settings.radianceCache ? std::make_unique<RadianceCache>(settings.radianceCacheSettings) : nullptr;
+    const auto caustics =
+        settings.caustics ? std::make_unique<PhotonMap>(scene, settings.causticSettings, &threadPool) : nullptr;
+    const PathCaches caches{cache.get(), caustics.get()};
+    const auto publisher = settings.sharedMemoryName.empty()
+                               ? nullptr
+                               : std::make_unique<FramePublisher>(settings.sharedMemoryName, camera.imageWidth,
+                                                                  camera.imageHeight, settings.sharedMemorySlots);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < poses.size(); ++i) {
+        //
+        // Blocks only once framesInFlight frames are queued. Tiles of this frame are then queued behind the
+        // remaining tiles of the previous one so workers roll straight over the frame boundary.
+        //
+        frameSlots.acquire();
+
+        auto frame = std::make_shared<Frame>();
+        frame->index = static_cast<int>(i);
+        frame->camera = camera;
+        frame->camera.trans = poses[i].trans;
+        frame->camera.roll = poses[i].roll;
+        frame->camera.pitch = poses[i].pitch;
+        frame->camera.yaw = poses[i].yaw;
+        frame->camera.updateRotationMatrix();
+        frame->radiance.resize(camera.imageWidth * camera.imageHeight);
+        frame->tilesRemaining = numTiles;
+
+        // Rasterized here, while the workers are still busy with the previous frames' tiles.
+        if (settings.visibilitySamples > 0)
+            rasterize(scene, frame->camera, std::min(settings.visibilitySamples, settings.numSamples), frame->visibility,
+                      &threadPool);
+
+        for (const auto& tile : tiles) {
+            threadPool.enqueue([frame, tile, &scene, &settings, &frameSlots, &latch, &writer, &caches, &publisher]() {
+                traceTile(scene, frame->camera, tile, settings.numSamples, settings.maxBounces, frame->radiance.data(),
+                          nullptr, settings.visibilitySamples > 0 ? &frame->visibility : nullptr, caches);
+
+                if (frame->tilesRemaining.fetch_sub(1) != 1)
+                    return;
+
+                //
+                // Last tile of the frame: resolve it here and hand the pixels to the writer thread, which encodes
+                // them while the workers carry on with the next frame's tiles.
+                //
+                FrameInfo info;
+                info.frame = uint64_t(frame->index);
+                info.width = frame->camera.imageWidth;
+                info.height = frame->camera.imageHeight;
+                info.samples = settings.numSamples;
+
+                if (settings.writeImages) {
+                    std::vector<uint32_t> pixels;
+                    resolve(frame->radiance, pixels);
+
+                    if (publisher)
+                        publisher->publish(info, pixels.data());
+
+                    writer.write(frameFilename(settings.outputPrefix, frame->index, settings.outputExtension),
+                                 std::move(pixels), info.width, info.height);
+                } else if (publisher) {
+                    publisher->publish(info, [&frame](uint32_t* pixels) {
+                        resolve(frame->radiance.data(), frame->radiance.size(), pixels);
+                    });
+                }
+
+                frame->radiance = {};
+                frame->visibility = {};
+
+                frameSlots.release();
+                latch.countDown();
+            });
+        }
+    }
+
+    latch.wait();
+    writer.flush();
+
+    if (writer.failures() > 0)
+        std::cout << writer.failures() << " frames could not be written\n";
+
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Rendered " << poses.size() << " frames in " << seconds << " s ("
+              << (seconds > 0.0 ? poses.size() / seconds : 0.0) << " frames/s)\n";
+}
+}
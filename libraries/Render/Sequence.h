@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Camera.h"
+#include "PhotonMap.h"
+#include "RadianceCache.h"
+
+namespace bv {
+
+class Scene;
+class ThreadPool;
+
+// A single keyframe of a camera fly-through.
+struct CameraPose {
+    vec3d trans;
+    double roll, pitch, yaw;
+};
+
+struct SequenceSettings {
+    int numSamples = 64;
+    int maxBounces = 64;
+    int tileSize = 32;
+    // Number of frames whose tiles may be queued at once. Two is enough to keep workers busy while
+    // the previous frame is resolved and written.
+    int framesInFlight = 2;
+    // Writes each frame to a file, see outputPrefix. May be turned off when frames go to shared memory instead.
+    bool writeImages = true;
+    std::string outputPrefix = "frame_";
+    // ".qoi" or ".bmp", see writeImage.
+    std::string outputExtension = ".qoi";
+    // Sample positions per pixel rasterized into a visibility buffer, whose first hits replace tracing camera rays.
+    // Samples beyond them, or all of them at zero, trace camera rays at random positions.
+    int visibilitySamples = 8;
+    // Ends diffuse paths at a radiance cache after their first diffuse bounce, see RadianceCache. The cache is
+    // shared by every frame, the lighting it holds does not depend on the camera.
+    bool radianceCache = false;
+    RadianceCacheSettings radianceCacheSettings;
+    // Estimates caustics from a photon map emitted once before the first frame, see PhotonMap.
+    bool caustics = false;
+    PhotonMapSettings causticSettings;
+    // Resolved frames waiting on the image writer before the worker finishing a frame blocks.
+    int writeQueueLength = 4;
+    // Also publishes each resolved frame to a shared memory ring of this name, see FramePublisher. Without files
+    // to write, frames are resolved straight into the ring.
+    std::string sharedMemoryName;
+    int sharedMemorySlots = 4;
+};
+
+// Reads one pose per line: "tx ty tz roll pitch yaw". Blank lines and lines starting with '#' are skipped.
+std::vector<CameraPose> loadCameraPoses(const std::string& filename);
+
+// Renders each pose to <outputPrefix><NNNN><outputExtension> and/or a shared memory ring, numbered by pose. The scene is shared by all frames; tiles from
+// consecutive frames are interleaved on the pool so that no worker waits at a frame boundary, and finished frames
+// are encoded and written by a background ImageWriter.
+void renderSequence(Scene& scene, const Camerad& camera, const std::vector<CameraPose>& poses,
+                    ThreadPool& threadPool, const SequenceSettings& settings);
+}
@@ -1,18 +1,29 @@
 #include "SDL.h" // Annoying but forward declaration...
 
 #include "SDLWrapper.h"
-#include "glm/vec3.hpp"
 
 #include <algorithm>
-#include <iostream>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <iostream>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 
 namespace bv {
+
+namespace {
+// Beyond this many tiles waiting, the whole texture is uploaded at once rather than tile by tile.
+constexpr size_t maxDirtyRects = 256;
+}
+
 class SDLScreen::Impl {
 public:
-    Impl(const int width, const int height, const std::string& title, const bool fullscreen = false) {
+    Impl(const int width, const int height, const std::string& title, const bool fullscreen, const double presentRate)
+        : width(width), height(height),
+          presentInterval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(1.0 / std::max(presentRate, 1.0)))) {
         SDL_version compiled;
         SDL_VERSION(&compiled);
         if (compiled.major < 2) {
@@ -33,10 +44,7 @@ public:
             throw std::runtime_error("Could not initialise SDL: " + std::string(SDL_GetError()));
         }
 
-        this->width = width;
-        this->height = height;
-        buffer = new uint32_t[width * height];
-        memset(buffer, 0, width * height * sizeof(uint32_t));
+        buffer.assign(size_t(width) * size_t(height), 0);
 
         uint32_t flags = SDL_WINDOW_OPENGL;
         if (fullscreen) {
@@ -47,15 +55,16 @@ public:
                                   SDL_WINDOWPOS_UNDEFINED,
                                   width, height, flags);
         if (!window) {
+            SDL_Quit();
             throw std::runtime_error("Could not set video mode: "
                                      + std::string(SDL_GetError()));
         }
 
-        flags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC;
-        renderer = SDL_CreateRenderer(window, -1, flags);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
         if (!renderer) {
-            throw std::runtime_error("Could not create renderer: "
-                                     + std::string(SDL_GetError()));
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            throw std::runtime_error("Could not create renderer: " + std::string(SDL_GetError()));
         }
 
         SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
@@ -63,49 +72,84 @@ public:
 
         texture = SDL_CreateTexture(renderer,
                                     SDL_PIXELFORMAT_ARGB8888,
-                                    SDL_TEXTUREACCESS_STATIC,
+                                    SDL_TEXTUREACCESS_STREAMING,
                                     width, height);
         if (!texture) {
-            throw std::runtime_error("Could not allocate texture: "
-                                     + std::string(SDL_GetError()));
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            throw std::runtime_error("Could not allocate texture: " + std::string(SDL_GetError()));
         }
+
+        // Without it tiles still show, only up to a wait later.
+        wakeEvent = SDL_RegisterEvents(1);
+
+        // Streaming textures start out undefined.
+        allDirty = true;
+        nextPresent = std::chrono::steady_clock::now();
     }
 
-    void putPixel(const int x, const int y, const glm::vec3& colour) {
-        if (x < 0 || x >= width || y < 0 || y >= height) {
-            std::cout << "apa" << std::endl;
+    void putTile(int x, int y, int w, int h, const uint32_t* pixels, const int stride) {
+        // Clipped rather than rejected, partial tiles along the edges are common.
+        const int x0 = std::max(x, 0), y0 = std::max(y, 0);
+        const int x1 = std::min(x + w, width), y1 = std::min(y + h, height);
+        if (x0 >= x1 || y0 >= y1)
             return;
-        }
 
-        const auto r = uint32_t(std::clamp(255.0f * colour.x, 0.f, 255.f));
-        const auto g = uint32_t(std::clamp(255.0f * colour.y, 0.f, 255.f));
-        const auto b = uint32_t(std::clamp(255.0f * colour.z, 0.f, 255.f));
+        pixels += size_t(y0 - y) * size_t(stride) + size_t(x0 - x);
 
-        buffer[y * width + x] = (128 << 24) + (r << 16) + (g << 8) + b;
-    }
+        std::lock_guard lk(bufferMutex);
+        for (int row = y0; row < y1; ++row) {
+            std::memcpy(&buffer[size_t(row) * width + x0], pixels, size_t(x1 - x0) * sizeof(uint32_t));
+            pixels += stride;
+        }
 
-    std::vector<SDL_Event> render() {
-        {
-            std::lock_guard lk(bufferMutex);
-            SDL_UpdateTexture(texture, NULL, buffer, width * sizeof(uint32_t));
+        if (!allDirty) {
+            if (dirty.size() < maxDirtyRects)
+                dirty.push_back({x0, y0, x1 - x0, y1 - y0});
+            else
+                allDirty = true;
         }
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
 
-        const auto time = SDL_GetTicks64();
-        const auto dt = time - lastFrameTime;
-        std::cout << "Render time: " << dt << " ms. FPS: " << 1000.0f / std::max(dt, 1ULL) << "\n";
-        lastFrameTime = time;
+        // One event wakes the window's thread if it is waiting in pollEvents, until it uploads what is queued.
+        if (!wakePending && wakeEvent != uint32_t(-1)) {
+            wakePending = true;
+            SDL_Event event{};
+            event.type = wakeEvent;
+            SDL_PushEvent(&event);
+        }
+    }
 
+    std::vector<SDL_Event> pollEvents(const int waitMs) {
         std::vector<SDL_Event> events;
         SDL_Event event;
 
-        while(SDL_PollEvent(&event)) {
-            events.push_back(event);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(waitMs, 0));
+        for (;;) {
+            present(false);
+
+            while (SDL_PollEvent(&event)) {
+                keep(event, events);
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (!events.empty() || now >= deadline)
+                return events;
+
+            // Tiles waiting for their present slot cut the wait short, so they show on time.
+            auto until = deadline;
+            if (tilesWaiting())
+                until = std::min(until, nextPresent);
+
+            const auto wait = std::chrono::ceil<std::chrono::milliseconds>(until - now).count();
+            if (SDL_WaitEventTimeout(&event, int(std::max<int64_t>(wait, 1))))
+                keep(event, events);
         }
+    }
 
-        return events;
+    uint64_t presentedFrames() const {
+        std::lock_guard lk(bufferMutex);
+        return presented;
     }
 
     void saveImage(const std::string& filename) {
@@ -123,22 +167,29 @@ public:
             bmask = 0xff << 0;
         }
 
-        SDL_Surface *surf;
+        // A copy, so tiles keep arriving while it is written.
+        std::vector<uint32_t> pixels;
         {
             std::lock_guard lk(bufferMutex);
-            surf = SDL_CreateRGBSurfaceFrom((void *) buffer, width, height,
-                                            32, width * sizeof(uint32_t),
-                                            rmask, gmask, bmask, amask);
+            pixels = buffer;
         }
 
+        SDL_Surface *surf = SDL_CreateRGBSurfaceFrom((void *) pixels.data(), width, height,
+                                                    32, width * sizeof(uint32_t),
+                                                    rmask, gmask, bmask, amask);
+
         if (SDL_SaveBMP(surf, filename.c_str()) != 0) {
             std::cout << "Failed to save image: "
                       << SDL_GetError() << "\n";
         }
+
+        SDL_FreeSurface(surf);
     }
 
     ~Impl() {
-        delete[] buffer;
+        // Tiles written before the screen is destroyed are still shown.
+        present(true);
+
         SDL_DestroyTexture(texture);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
@@ -146,26 +197,102 @@ public:
     }
 
 private:
+    bool tilesWaiting() const {
+        std::lock_guard lk(bufferMutex);
+        return allDirty || !dirty.empty();
+    }
+
+    void keep(const SDL_Event& event, std::vector<SDL_Event>& events) const {
+        if (event.type != wakeEvent)
+            events.push_back(event);
+    }
+
+    // Uploads the tiles written since the last present and presents them, once the present slot has come unless forced.
+    void present(const bool force) {
+        const auto now = std::chrono::steady_clock::now();
+        if (!force && now < nextPresent)
+            return;
+
+        {
+            // Tiles are copied into the texture under the lock, so none shows half written. Presenting, which may
+            // wait for vertical sync, happens outside it.
+            std::lock_guard lk(bufferMutex);
+            if (dirty.empty() && !allDirty)
+                return;
+
+            if (allDirty) {
+                upload({0, 0, width, height});
+            } else {
+                for (const auto& rect : dirty)
+                    upload(rect);
+            }
+            dirty.clear();
+            allDirty = false;
+            wakePending = false;
+        }
+
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+
+        // A present that overran its slot, e.g. while the window was hidden and vertical sync stalled, moves the
+        // schedule on rather than presenting the missed frames back to back.
+        nextPresent += presentInterval;
+        if (nextPresent < now)
+            nextPresent = now + presentInterval;
+
+        std::lock_guard lk(bufferMutex);
+        presented++;
+    }
+
+    void upload(const SDL_Rect& rect) {
+        void* pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0)
+            return;
+
+        for (int row = 0; row < rect.h; ++row) {
+            std::memcpy(static_cast<uint8_t*>(pixels) + size_t(row) * size_t(pitch),
+                        &buffer[size_t(rect.y + row) * width + rect.x], size_t(rect.w) * sizeof(uint32_t));
+        }
+
+        SDL_UnlockTexture(texture);
+    }
+
+    const int width;
+    const int height;
+    const std::chrono::steady_clock::duration presentInterval;
     SDL_Window *window;
-    SDL_Renderer *renderer;
-    SDL_Texture *texture;
-    int height;
-    int width;
-    uint32_t *buffer;
-    std::mutex bufferMutex;
-
-    uint64_t lastFrameTime = 0;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    // Touched only by the window's thread.
+    uint32_t wakeEvent;
+    std::chrono::steady_clock::time_point nextPresent;
+
+    mutable std::mutex bufferMutex;
+    std::vector<uint32_t> buffer;
+    // Blocks written since the last upload, or the whole image.
+    std::vector<SDL_Rect> dirty;
+    bool allDirty = false;
+    bool wakePending = false;
+    uint64_t presented = 0;
 };
 
-SDLScreen::SDLScreen(const int width, const int height, const std::string& title, const bool fullscreen)
-    : impl(std::make_unique<Impl>(width, height, title, fullscreen)) {}
+SDLScreen::SDLScreen(const int width, const int height, const std::string& title, const bool fullscreen,
+                     const double presentRate)
+    : impl(std::make_unique<Impl>(width, height, title, fullscreen, presentRate)) {}
 
-void SDLScreen::putPixel(const int x, const int y, const glm::vec3 &colour) {
-    impl->putPixel(x, y, colour);
+void SDLScreen::putTile(const int x, const int y, const int width, const int height, const uint32_t* pixels,
+                        const int stride) {
+    impl->putTile(x, y, width, height, pixels, stride);
 }
 
-std::vector<SDL_Event> SDLScreen::render() {
-    return impl->render();
+std::vector<SDL_Event> SDLScreen::pollEvents(const int waitMs) {
+    return impl->pollEvents(waitMs);
+}
+
+uint64_t SDLScreen::presentedFrames() const {
+    return impl->presentedFrames();
 }
 
 void SDLScreen::saveImage(const std::string &filename) {
@@ -173,4 +300,4 @@ void SDLScreen::saveImage(const std::string &filename) {
 }
 
 SDLScreen::~SDLScreen() = default;
-}
\ No newline at end of file
+}
@@ -1,22 +1,36 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
-
-#include <glm/fwd.hpp>
+#include <string>
+#include <vector>
 
 namespace {
     typedef union SDL_Event SDL_Event;
 }
 
 namespace bv {
+//
+// Window showing an ARGB8888 image which renderers write to a tile at a time, from any thread. Tiles are queued and
+// the thread that created the screen uploads them into a streaming texture and presents, at most presentRate times a
+// second, from pollEvents. Only tiles written since the last present are uploaded.
+//
+// SDL wants the window, its renderer and events on one thread, the main one on macOS, so everything but putTile,
+// presentedFrames and saveImage, the destructor included, must run on the thread that created the screen.
+//
 class SDLScreen {
 public:
-    SDLScreen(int width, int height, const std::string& title, bool fullscreen = false);
+    SDLScreen(int width, int height, const std::string& title, bool fullscreen = false, double presentRate = 60.0);
+
+    // Copies a width by height block of pixels, rows stride pixels apart, to (x, y), clipped to the screen. Blocks
+    // written from different threads at once should not overlap.
+    void putTile(int x, int y, int width, int height, const uint32_t* pixels, int stride);
 
-    // Buffer is not protected by a mutex lock for performance reasons.
-    void putPixel(int x, int y, const glm::vec3& colour);
+    // Presents queued tiles when a present is due, then returns the events since the last call, waiting up to waitMs
+    // for one when there are none. Tiles written meanwhile are presented during the wait.
+    std::vector<SDL_Event> pollEvents(int waitMs = 0);
 
-    std::vector<SDL_Event> render();
+    uint64_t presentedFrames() const;
 
     void saveImage(const std::string& filename);
 
@@ -26,4 +40,4 @@ private:
     class Impl;
     std::unique_ptr<Impl> impl;
 };
-}
\ No newline at end of file
+}
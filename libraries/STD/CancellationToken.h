@@ -0,0 +1,24 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+namespace bv {
+// Shared cancellation flag. Copies observe the same state, so a token handed to running work can be cancelled by
+// whoever kept a copy. Work is expected to poll cancelled() at convenient points and return early.
+class CancellationToken {
+public:
+    CancellationToken() : state(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() {
+        state->store(true, std::memory_order_relaxed);
+    }
+
+    bool cancelled() const {
+        return state->load(std::memory_order_relaxed);
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> state;
+};
+}
@@ -0,0 +1,128 @@
+#include "CpuDispatch.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#if BV_CPU_DISPATCH
+#include <cpuid.h>
+#endif
+
+namespace bv {
+
+namespace {
+#if BV_CPU_DISPATCH
+// Register state the operating system saves on context switches, XCR0.
+uint64_t enabledRegisterState() {
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (uint64_t(hi) << 32) | lo;
+}
+
+CpuPath detect() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return CpuPath::Generic;
+
+    const bool sse42 = (ecx & bit_SSE4_2) && (ecx & bit_POPCNT);
+    if (!sse42)
+        return CpuPath::Generic;
+
+    // Without OSXSAVE the upper halves of vector registers would be lost on a context switch.
+    const bool osxsave = ecx & bit_OSXSAVE;
+    const bool avx = (ecx & bit_AVX) && (ecx & bit_FMA) && osxsave;
+    const uint64_t xcr0 = avx ? enabledRegisterState() : 0;
+    if (!avx || (xcr0 & 0x6) != 0x6 || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return CpuPath::SSE42;
+
+    if (!(ebx & bit_AVX2) || !(ebx & bit_BMI) || !(ebx & bit_BMI2))
+        return CpuPath::SSE42;
+
+    // Opmask and both halves of the 32 wide registers as well.
+    const bool avx512 = (ebx & bit_AVX512F) && (ebx & bit_AVX512DQ) && (ebx & bit_AVX512BW) &&
+                        (ebx & bit_AVX512VL) && (xcr0 & 0xe6) == 0xe6;
+    return avx512 ? CpuPath::AVX512 : CpuPath::AVX2;
+}
+#else
+CpuPath detect() {
+    return CpuPath::Generic;
+}
+#endif
+
+CpuPath initialPath() {
+    const CpuPath best = bestCpuPath();
+
+    const char* forced = std::getenv("BV_CPU_PATH");
+    if (!forced || !*forced)
+        return best;
+
+    CpuPath path;
+    if (!parseCpuPath(forced, path)) {
+        std::cerr << "Unknown BV_CPU_PATH " << forced << ", using " << cpuPathName(best) << "\n";
+        return best;
+    }
+    if (!cpuSupports(path)) {
+        std::cerr << "BV_CPU_PATH " << forced << " is not supported here, using " << cpuPathName(best) << "\n";
+        return best;
+    }
+    return path;
+}
+
+std::atomic<CpuPath>& activePath() {
+    static std::atomic<CpuPath> path{initialPath()};
+    return path;
+}
+}
+
+const char* cpuPathName(const CpuPath path) {
+    switch (path) {
+    case CpuPath::SSE42:
+        return "sse4.2";
+    case CpuPath::AVX2:
+        return "avx2";
+    case CpuPath::AVX512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
+
+bool parseCpuPath(const std::string& name, CpuPath& path) {
+    for (const auto p : {CpuPath::Generic, CpuPath::SSE42, CpuPath::AVX2, CpuPath::AVX512}) {
+        if (name == cpuPathName(p)) {
+            path = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cpuSupports(const CpuPath path) {
+    return path <= bestCpuPath();
+}
+
+CpuPath bestCpuPath() {
+    static const CpuPath best = detect();
+    return best;
+}
+
+CpuPath cpuPath() {
+    return activePath().load(std::memory_order_relaxed);
+}
+
+void setCpuPath(const CpuPath path) {
+    if (!cpuSupports(path))
+        throw std::invalid_argument(std::string("CPU path ") + cpuPathName(path) + " is not supported here, the best is "
+                                    + cpuPathName(bestCpuPath()));
+    activePath().store(path, std::memory_order_relaxed);
+}
+
+void setCpuPath(const std::string& name) {
+    CpuPath path;
+    if (!parseCpuPath(name, path))
+        throw std::invalid_argument("Unknown CPU path " + name + ", expected generic, sse4.2, avx2 or avx512");
+    setCpuPath(path);
+}
+}
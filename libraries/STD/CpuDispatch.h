@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+
+//
+// Hot kernels are compiled once per instruction set below within the same binary, and the best one the CPU runs is
+// picked at startup from cpuid. BV_CPU_PATH in the environment, or setCpuPath, forces a path instead, so that results
+// can be compared and timed across them.
+//
+// A kernel is a lambda marked BV_CPU_KERNEL run through dispatchCpu. Everything it calls that should be compiled for
+// the path must be inlined into it, so the kernel's own functions are marked BV_CPU_INLINE. Calls it cannot inline,
+// such as virtual ones, run the generic code unless they dispatch themselves.
+//
+// Floating point is never contracted into fused multiply-adds (-ffp-contract=off), so every path gives the same
+// results bit for bit and only differs in speed.
+//
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BV_CPU_DISPATCH 1
+#define BV_CPU_INLINE inline __attribute__((always_inline))
+#define BV_CPU_KERNEL __attribute__((always_inline))
+#define BV_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define BV_TARGET_AVX2 __attribute__((target("avx2,fma,bmi,bmi2,popcnt")))
+#define BV_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl,avx2,fma,bmi,bmi2,popcnt")))
+#else
+#define BV_CPU_DISPATCH 0
+#define BV_CPU_INLINE inline
+#define BV_CPU_KERNEL
+#define BV_TARGET_SSE42
+#define BV_TARGET_AVX2
+#define BV_TARGET_AVX512
+#endif
+
+namespace bv {
+// Instruction sets kernels are compiled for, each a superset of the one before.
+enum class CpuPath { Generic, SSE42, AVX2, AVX512 };
+
+// generic, sse4.2, avx2 or avx512.
+const char* cpuPathName(CpuPath path);
+bool parseCpuPath(const std::string& name, CpuPath& path);
+
+// Whether both the CPU and the operating system, which has to save the wider registers, support the path.
+bool cpuSupports(CpuPath path);
+CpuPath bestCpuPath();
+
+// Path kernels run. On first use the best supported one, or BV_CPU_PATH when it names one that is supported.
+CpuPath cpuPath();
+
+// Forces a path, throws std::invalid_argument when it is unknown or unsupported. Meant for startup, kernels already
+// running finish on the path they started on.
+void setCpuPath(CpuPath path);
+void setCpuPath(const std::string& name);
+
+namespace detail {
+template <typename Kernel>
+decltype(auto) runGeneric(Kernel& kernel) {
+    return kernel();
+}
+
+template <typename Kernel>
+BV_TARGET_SSE42 decltype(auto) runSSE42(Kernel& kernel) {
+    return kernel();
+}
+
+template <typename Kernel>
+BV_TARGET_AVX2 decltype(auto) runAVX2(Kernel& kernel) {
+    return kernel();
+}
+
+template <typename Kernel>
+BV_TARGET_AVX512 decltype(auto) runAVX512(Kernel& kernel) {
+    return kernel();
+}
+}
+
+// Runs kernel() compiled for the current path.
+template <typename Kernel>
+inline decltype(auto) dispatchCpu(Kernel&& kernel) {
+#if BV_CPU_DISPATCH
+    switch (cpuPath()) {
+    case CpuPath::AVX512:
+        return detail::runAVX512(kernel);
+    case CpuPath::AVX2:
+        return detail::runAVX2(kernel);
+    case CpuPath::SSE42:
+        return detail::runSSE42(kernel);
+    default:
+        break;
+    }
+#endif
+    return detail::runGeneric(kernel);
+}
+}
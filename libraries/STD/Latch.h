@@ -1,6 +1,7 @@
 #pragma once
 
 #include <condition_variable>
+#include <mutex>
 
 namespace bv {
 class Latch {
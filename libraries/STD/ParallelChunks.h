@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "ThreadPool.h"
+
+namespace bv {
+// Runs work(chunk) for every chunk in [0, chunks), spread over threadPool when given. Helpers are queued at
+// priority. The calling thread takes part and only waits for chunks other threads have started, never for helpers
+// still queued, so it may be one of the pool's own workers.
+inline void parallelChunks(ThreadPool* threadPool, const size_t chunks, const std::function<void(size_t)>& work,
+                           const int priority = 0) {
+    if (!threadPool || threadPool->size() == 0 || chunks < 2) {
+        for (size_t c = 0; c < chunks; ++c)
+            work(c);
+        return;
+    }
+
+    //
+    // Helpers that start after the last chunk was claimed find nothing to do and never touch work, which lives on
+    // the caller's stack. The state they share outlives the call.
+    //
+    struct State {
+        const std::function<void(size_t)>* work;
+        size_t chunks;
+        std::atomic<size_t> nextChunk{0};
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        State(const std::function<void(size_t)>& work, const size_t chunks)
+            : work(&work), chunks(chunks), remaining(chunks) {}
+
+        void drain() {
+            for (size_t c = nextChunk++; c < chunks; c = nextChunk++) {
+                (*work)(c);
+
+                if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard lk(mutex);
+                    cv.notify_all();
+                }
+            }
+        }
+    };
+
+    const auto state = std::make_shared<State>(work, chunks);
+
+    const int helpers = static_cast<int>(std::min(chunks - 1, static_cast<size_t>(threadPool->size())));
+    for (int h = 0; h < helpers; ++h) {
+        threadPool->enqueue([state]() {
+            state->drain();
+        }, priority);
+    }
+
+    state->drain();
+
+    std::unique_lock lk(state->mutex);
+    state->cv.wait(lk, [&state]() {
+        return state->remaining.load(std::memory_order_acquire) == 0;
+    });
+}
+}
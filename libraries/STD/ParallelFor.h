@@ -0,0 +1,43 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "ParallelChunks.h"
+#include "ThreadPool.h"
+
+namespace bv {
+// Runs body(i) for every i in [0, count), in chunks of grain consecutive indices spread over threadPool when given.
+// Returns once every index is done, see parallelChunks.
+inline void parallelFor(ThreadPool* threadPool, const size_t count, const size_t grain,
+                        const std::function<void(size_t)>& body, const int priority = 0) {
+    const size_t step = std::max<size_t>(grain, 1);
+
+    parallelChunks(threadPool, (count + step - 1) / step, [&](const size_t c) {
+        const size_t end = std::min(count, (c + 1) * step);
+        for (size_t i = c * step; i < end; ++i)
+            body(i);
+    }, priority);
+}
+
+// Reduces [0, count) in chunks of grain: map(begin, end) gives each chunk's value, and the values are folded into
+// identity with combine in chunk order, so the result does not depend on which thread ran which chunk.
+template <typename T, typename Map, typename Combine>
+T parallelReduce(ThreadPool* threadPool, const size_t count, const size_t grain, T identity, const Map& map,
+                 const Combine& combine, const int priority = 0) {
+    const size_t step = std::max<size_t>(grain, 1);
+    const size_t chunks = (count + step - 1) / step;
+
+    std::vector<T> partial(chunks, identity);
+    parallelChunks(threadPool, chunks, [&](const size_t c) {
+        partial[c] = map(c * step, std::min(count, (c + 1) * step));
+    }, priority);
+
+    for (auto& value : partial)
+        identity = combine(std::move(identity), std::move(value));
+
+    return identity;
+}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+namespace bv {
+class Semaphore {
+public:
+    Semaphore(const int count) : count(count) {}
+
+    void acquire() {
+        std::unique_lock<std::mutex> lk(countMutex);
+
+        cv.wait(lk, [this]() {
+            return count > 0;
+        });
+
+        count--;
+    }
+
+    void release() {
+        {
+            std::lock_guard lk(countMutex);
+            count++;
+        }
+        cv.notify_one();
+    }
+
+private:
+    std::condition_variable cv;
+    int count;
+    std::mutex countMutex;
+};
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "CancellationToken.h"
+#include "ThreadPool.h"
+
+namespace bv {
+// A set of tasks queued on a ThreadPool at one priority that complete, or are cancelled, together. Tasks that
+// have not started when the group is cancelled are skipped; running tasks can poll token() to stop early.
+//
+//     TaskGroup group(threadPool, priority);
+//     for (...) group.run(task);
+//     auto done = group.close(onComplete);
+//
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool& threadPool, const int priority = 0)
+            : threadPool(threadPool), priority(priority), state(std::make_shared<State>()) {
+        state->future = state->promise.get_future().share();
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> task) {
+        state->pending++;
+        threadPool.enqueue([state = state, task = std::move(task)]() {
+            if (!state->token.cancelled())
+                task();
+            state->finishOne();
+        }, priority);
+    }
+
+    // No more tasks will be added. Once every task has finished or been skipped, onComplete is called on the
+    // worker that ran the last one and the returned future becomes ready. Both report false if cancelled.
+    std::shared_future<bool> close(std::function<void(bool completed)> onComplete = nullptr) {
+        if (!closed) {
+            closed = true;
+            state->onComplete = std::move(onComplete);
+            state->finishOne();
+        }
+        return state->future;
+    }
+
+    void cancel() {
+        state->token.cancel();
+    }
+
+    const CancellationToken& token() const {
+        return state->token;
+    }
+
+    // True once closed and every task has finished or been skipped.
+    bool finished() const {
+        return state->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    bool wait() {
+        return close().get();
+    }
+
+    ~TaskGroup() {
+        close();
+    }
+
+private:
+    struct State {
+        // Starts at one for the submitter, released by close().
+        std::atomic<int> pending{1};
+        CancellationToken token;
+        std::function<void(bool)> onComplete;
+        std::promise<bool> promise;
+        std::shared_future<bool> future;
+
+        void finishOne() {
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+
+            const bool completed = !token.cancelled();
+            if (onComplete)
+                onComplete(completed);
+            promise.set_value(completed);
+        }
+    };
+
+    ThreadPool& threadPool;
+    int priority;
+    bool closed = false;
+    std::shared_ptr<State> state;
+};
+}
@@ -1,5 +1,263 @@
 #include "ThreadPool.h"
 
+#include <algorithm>
+
 namespace bv {
 
-}
\ No newline at end of file
+namespace {
+// The pool and worker the calling thread belongs to, if any.
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+
+// Beyond this many a worker gives the nodes it runs to spares instead of keeping them.
+constexpr size_t maxFreeNodes = 1024;
+
+constexpr int addressBits = 48;
+constexpr uint64_t addressMask = (uint64_t(1) << addressBits) - 1;
+
+template <typename Node>
+Node* topOf(const uint64_t head) {
+    return reinterpret_cast<Node*>(uintptr_t(head & addressMask));
+}
+
+// Head with node on top, counted one past head.
+template <typename Node>
+uint64_t nextHead(const uint64_t head, Node* node) {
+    return (((head >> addressBits) + 1) << addressBits) | uint64_t(uintptr_t(node));
+}
+
+template <typename Node>
+void deleteList(Node* node) {
+    while (node) {
+        Node* next = node->next;
+        delete node;
+        node = next;
+    }
+}
+}
+
+ThreadPool::ThreadPool(const int numThreads) {
+    workers.reserve(std::max(numThreads, 0));
+    for (int i = 0; i < numThreads; ++i)
+        workers.push_back(std::make_unique<Worker>());
+
+    // Started once every worker exists, they steal from each other from the outset.
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i]->thread = std::thread([this, i]() { run(i); });
+}
+
+bool ThreadPool::onWorker() const {
+    return currentPool == this;
+}
+
+ThreadPool::Node* ThreadPool::allocate() {
+    if (onWorker()) {
+        Worker& worker = *workers[currentWorker];
+        if (Node* node = worker.free) {
+            worker.free = node->next;
+            worker.freeCount--;
+            node->next = nullptr;
+            return node;
+        }
+    }
+
+    if (Node* node = popSpare())
+        return node;
+
+    Node* node = new Node;
+    node->shared = !onWorker();
+    return node;
+}
+
+void ThreadPool::recycle(const size_t index, Node* node) {
+    // Releases whatever the task captured now rather than when the node is next used.
+    node->task = Task();
+
+    // Workers that queue more than they run take the surplus of those that run more, through spares.
+    Worker& worker = *workers[index];
+    if (node->shared || worker.freeCount >= maxFreeNodes) {
+        if (!pushSpare(node))
+            delete node;
+        return;
+    }
+
+    node->next = worker.free;
+    worker.free = node;
+    worker.freeCount++;
+}
+
+bool ThreadPool::pushSpare(Node* node) {
+    // Addresses the head cannot hold are freed instead.
+    if (uint64_t(uintptr_t(node)) & ~addressMask)
+        return false;
+
+    uint64_t head = spares.load(std::memory_order_relaxed);
+    do {
+        node->nextSpare.store(topOf<Node>(head), std::memory_order_relaxed);
+    } while (!spares.compare_exchange_weak(head, nextHead(head, node), std::memory_order_release,
+                                           std::memory_order_relaxed));
+    return true;
+}
+
+ThreadPool::Node* ThreadPool::popSpare() {
+    uint64_t head = spares.load(std::memory_order_acquire);
+    while (Node* node = topOf<Node>(head)) {
+        // Nodes are only freed with the pool, so one popped by another thread meanwhile can still be read.
+        Node* next = node->nextSpare.load(std::memory_order_relaxed);
+        if (spares.compare_exchange_weak(head, nextHead(head, next), std::memory_order_acquire,
+                                         std::memory_order_acquire))
+            return node;
+    }
+    return nullptr;
+}
+
+void ThreadPool::push(Node* node) {
+    if (workers.empty()) {
+        // Nothing would ever run it.
+        delete node;
+        return;
+    }
+
+    const size_t index = onWorker() ? currentWorker : nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    Worker& worker = *workers[index];
+
+    worker.pending.fetch_add(1, std::memory_order_relaxed);
+    node->next = worker.inbox.load(std::memory_order_relaxed);
+    while (!worker.inbox.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+
+    //
+    // A worker about to sleep registers in sleepers before it reads epoch and looks for work one last time, so it
+    // either finds this task or sees epoch move on, and is woken here if it already waits.
+    //
+    epoch.fetch_add(1);
+    if (sleepers.load() > 0) {
+        std::lock_guard lk(sleepMutex);
+        cv.notify_one();
+    }
+}
+
+ThreadPool::Node* ThreadPool::take(Worker& worker) {
+    std::lock_guard lk(worker.mutex);
+
+    // The inbox is newest first, reversed so each lane keeps the order tasks were queued in.
+    Node* queued = nullptr;
+    for (Node* node = worker.inbox.exchange(nullptr, std::memory_order_acquire); node;) {
+        Node* next = node->next;
+        node->next = queued;
+        queued = node;
+        node = next;
+    }
+
+    for (Node* node = queued; node;) {
+        Node* next = node->next;
+        node->next = nullptr;
+
+        auto lane = std::find_if(worker.lanes.begin(), worker.lanes.end(), [node](const Lane& l) {
+            return l.priority <= node->priority;
+        });
+        if (lane == worker.lanes.end() || lane->priority != node->priority)
+            lane = worker.lanes.insert(lane, Lane{node->priority});
+
+        (lane->tail ? lane->tail->next : lane->head) = node;
+        lane->tail = node;
+        node = next;
+    }
+
+    // Lanes are never left empty, so the first one holds the next task.
+    if (worker.lanes.empty())
+        return nullptr;
+
+    Lane& lane = worker.lanes.front();
+    Node* node = lane.head;
+    lane.head = node->next;
+    if (!lane.head)
+        worker.lanes.erase(worker.lanes.begin());
+
+    worker.pending.fetch_sub(1, std::memory_order_relaxed);
+    return node;
+}
+
+ThreadPool::Node* ThreadPool::steal(const size_t thief) {
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker& victim = *workers[(thief + i) % workers.size()];
+        if (victim.pending.load(std::memory_order_relaxed) == 0)
+            continue;
+
+        if (Node* node = take(victim))
+            return node;
+    }
+
+    return nullptr;
+}
+
+bool ThreadPool::hasWork() const {
+    return std::any_of(workers.begin(), workers.end(), [](const auto& worker) {
+        return worker->pending.load() > 0;
+    });
+}
+
+void ThreadPool::run(const size_t index) {
+    currentPool = this;
+    currentWorker = index;
+
+    for (;;) {
+        Node* node = take(*workers[index]);
+        if (!node)
+            node = steal(index);
+
+        if (node) {
+            node->task();
+            recycle(index, node);
+            continue;
+        }
+
+        // Only once nothing is left, so the pool drains on its way out.
+        if (kill.load(std::memory_order_acquire))
+            break;
+
+        sleepers.fetch_add(1);
+        const uint64_t seen = epoch.load();
+
+        if (!hasWork()) {
+            std::unique_lock lk(sleepMutex);
+            cv.wait(lk, [this, seen]() {
+                return epoch.load() != seen || kill.load();
+            });
+        }
+
+        sleepers.fetch_sub(1);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lk(sleepMutex);
+        kill = true;
+    }
+    cv.notify_all();
+
+    for (auto& worker : workers)
+        worker->thread.join();
+
+    // Left only by tasks queued from other threads while the workers were stopping, run here instead.
+    for (bool ran = true; ran;) {
+        ran = false;
+        for (auto& worker : workers) {
+            while (Node* node = take(*worker)) {
+                node->task();
+                delete node;
+                ran = true;
+            }
+        }
+    }
+
+    for (auto& worker : workers)
+        deleteList(worker->free);
+    for (Node* node = topOf<Node>(spares.load()); node;) {
+        Node* next = node->nextSpare.load();
+        delete node;
+        node = next;
+    }
+}
+}
@@ -1,65 +1,219 @@
 #pragma once
 
-#include <functional>
-#include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <thread>
-#include <iostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace bv {
-class ThreadPool {
+// Move only callable. Callables of up to inlineSize bytes are stored in place, larger ones on the heap.
+class Task {
 public:
-    ThreadPool(const int numThreads) {
-        threads.reserve(numThreads);
-        for (int i = 0; i < numThreads; ++i) {
-            threads.emplace_back(std::thread([this]() {
-                std::unique_lock<std::mutex> lk(tasksMutex);
-                for (;;) {
-                    cv.wait(lk, [this]() {
-                        return kill || !tasks.empty();
-                    });
+    static constexpr size_t inlineSize = 64;
 
-                    if (kill)
-                        break;
+    Task() = default;
 
-                    auto task = tasks.front();
-                    tasks.pop();
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using T = std::decay_t<F>;
 
-                    lk.unlock();
+        if constexpr (sizeof(T) <= inlineSize && alignof(T) <= alignof(std::max_align_t) &&
+                      std::is_nothrow_move_constructible_v<T>) {
+            new (storage) T(std::forward<F>(f));
+            ops = &inlineOps<T>;
+        } else {
+            *reinterpret_cast<T**>(storage) = new T(std::forward<F>(f));
+            ops = &heapOps<T>;
+        }
+    }
 
-                    task();
+    Task(Task&& other) noexcept {
+        take(other);
+    }
 
-                    lk.lock();
-                }
-            }));
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
         }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    void operator()() {
+        ops->invoke(storage);
+    }
+
+    explicit operator bool() const {
+        return ops != nullptr;
     }
 
-    void enqueue(const std::function<void()>& task) {
-        {
-            std::lock_guard lk(tasksMutex);
-            tasks.emplace(task);
+    ~Task() {
+        reset();
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Moves the callable from one storage to another and destroys what is left behind.
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename T>
+    static constexpr Ops inlineOps = {
+        [](void* storage) { (*std::launder(reinterpret_cast<T*>(storage)))(); },
+        [](void* from, void* to) {
+            T* source = std::launder(reinterpret_cast<T*>(from));
+            new (to) T(std::move(*source));
+            source->~T();
+        },
+        [](void* storage) { std::launder(reinterpret_cast<T*>(storage))->~T(); },
+    };
+
+    template <typename T>
+    static constexpr Ops heapOps = {
+        [](void* storage) { (**reinterpret_cast<T**>(storage))(); },
+        [](void* from, void* to) { *reinterpret_cast<T**>(to) = *reinterpret_cast<T**>(from); },
+        [](void* storage) { delete *reinterpret_cast<T**>(storage); },
+    };
+
+    void take(Task& other) {
+        if (other.ops) {
+            other.ops->relocate(other.storage, storage);
+            ops = other.ops;
+            other.ops = nullptr;
         }
-        cv.notify_one();
     }
 
-    ~ThreadPool() {
-        {
-            std::lock_guard lk(tasksMutex);
-            kill = true;
+    void reset() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
         }
-        cv.notify_all();
-        for (auto& t : threads)
-            t.join();
     }
 
+    alignas(std::max_align_t) unsigned char storage[inlineSize];
+    const Ops* ops = nullptr;
+};
+
+//
+// Work stealing pool. Every worker owns a queue, tasks queued from a worker go to its own and tasks queued from
+// other threads are dealt out in turn. Queuing is lock free: tasks are pushed onto the chosen worker's inbox, which
+// is moved into its queue whenever the queue is taken from. A worker runs the tasks in its own queue first and then
+// steals from the others, so the only locks are per worker and rarely contended.
+//
+// Within a queue higher priority tasks are taken first, tasks of equal priority in the order they were queued.
+// Across workers the order is only approximate. Tasks still queued when the pool is destroyed are run before it
+// returns, along with any they queue in turn.
+//
+// Queue nodes are recycled rather than freed. Workers keep their own free list and fall back on a lock free stack
+// shared with other threads, so queuing a task whose callable fits in a Task allocates nothing and takes no lock
+// once the pool is warm.
+//
+class ThreadPool {
+public:
+    ThreadPool(int numThreads);
+
+    template <typename F>
+    void enqueue(F&& task, const int priority = 0) {
+        Task wrapped(std::forward<F>(task));
+        Node* node = allocate();
+        node->priority = priority;
+        node->task = std::move(wrapped);
+        push(node);
+    }
+
+    template <typename F>
+    auto submit(F&& f, const int priority = 0) -> std::future<std::invoke_result_t<F>> {
+        using R = std::invoke_result_t<F>;
+
+        std::packaged_task<R()> task(std::forward<F>(f));
+        auto future = task.get_future();
+        enqueue([task = std::move(task)]() mutable { task(); }, priority);
+        return future;
+    }
+
+    int size() const {
+        return static_cast<int>(workers.size());
+    }
+
+    // True on the pool's own workers.
+    bool onWorker() const;
+
+    ~ThreadPool();
+
 private:
-    std::queue<std::function<void()>> tasks;
-    mutable std::mutex tasksMutex;
+    struct Node {
+        int priority = 0;
+        Task task;
+        Node* next = nullptr;
+        // Link in spares, read by threads racing to pop the node.
+        std::atomic<Node*> nextSpare{nullptr};
+        // Taken from spares, and given back there once run.
+        bool shared = false;
+    };
 
-    bool kill = false;
-    std::condition_variable cv;
+    // First in first out list of the tasks of one priority.
+    struct Lane {
+        int priority;
+        Node* head = nullptr;
+        Node* tail = nullptr;
+    };
+
+    // Aligned to keep workers' hot fields on separate cache lines.
+    struct alignas(64) Worker {
+        // Lock free stack of newly queued tasks, moved into queue by whoever holds mutex.
+        std::atomic<Node*> inbox{nullptr};
+        // Tasks in inbox and queue, read without the lock to skip empty workers.
+        std::atomic<size_t> pending{0};
+        std::mutex mutex;
+        // One lane per priority queued and not yet taken, highest first. Emptied lanes are removed.
+        std::vector<Lane> lanes;
+        std::thread thread;
+        // Nodes this worker ran, touched only by its own thread.
+        Node* free = nullptr;
+        size_t freeCount = 0;
+    };
 
-    std::vector<std::thread> threads;
+    Node* allocate();
+    void recycle(size_t index, Node* node);
+    bool pushSpare(Node* node);
+    Node* popSpare();
+    void push(Node* node);
+    Node* take(Worker& worker);
+    Node* steal(size_t thief);
+    bool hasWork() const;
+    void run(size_t index);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> nextWorker{0};
+
+    //
+    // Nodes for threads other than the workers, and workers' overflow, as a lock free stack. The head packs the top
+    // node's address, which fits in 48 bits, with a 16 bit count bumped by every push and pop. A pop whose head was
+    // popped and pushed back meanwhile then fails its exchange rather than installing a stale next.
+    //
+    std::atomic<uint64_t> spares{0};
+
+    //
+    // Idle workers sleep on cv until epoch moves on. Queuing bumps epoch and only takes sleepMutex to wake a worker
+    // when some are asleep.
+    //
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> kill{false};
+    std::mutex sleepMutex;
+    std::condition_variable cv;
 };
 }